@@ -9,42 +9,163 @@
 --]]
 require('signal').blockAll()
 local Tempest = require('tempest')
+local Report = require('tempest.report')
 local getopts = require('tempest.getopts')
 local strformat = string.format
 local unpack = unpack or table.unpack
 local opts = getopts(unpack(arg))
 
 
+-- set loglevel
+if opts.loglevel then
+    require('tempest.logger').setlevel( opts.loglevel )
+end
+
+
+-- agent mode
+if opts.agent then
+    local ok, err = require('act').run(function()
+        local err = require('tempest.agent').serve( opts.host, opts.port )
+
+        if err then
+            log.err( 'failed to run agent:', err )
+        end
+    end)
+    if not ok then
+        log.err( err )
+    end
+    return
+end
+
+
 -- print execution parameters
 print(strformat([[
 tempest run with following options;
 -----------------------------------
     address: %q
  enable TLS: %s
+       bind: %s
+       cpus: %s
+     agents: %s
      worker: %s
      client: %s
    duration: %s
+     warmup: %s
+       rate: %s
+     replay: %s
+   pipeline: %s
+      churn: %s
+     native: %s
+      uring: %s
    rcvtimeo: %s
    sndtimeo: %s
+    sigdigs: %s
+   timeline: %s
+       save: %s
+   baseline: %s
+   find-max: %s
      script: %q
+     corpus: %s
    loglevel: %s
 -----------------------------------]],
-    opts[-1].addr, opts[-1].tls,
-    opts[-1].worker, opts[-1].client, opts[-1].duration,
-    opts[-1].rcvtimeo, opts[-1].sndtimeo, opts[-1].script,
-    opts[-1].loglevel
+    opts[-1].addr, opts[-1].tls, opts[-1].bind, opts[-1].cpus,
+    opts[-1].agents,
+    opts[-1].worker, opts[-1].client, opts[-1].duration, opts[-1].warmup,
+    opts[-1].rate,
+    opts[-1].replay,
+    opts[-1].pipeline, opts[-1].churn, opts[-1].native, opts[-1].uring,
+    opts[-1].rcvtimeo, opts[-1].sndtimeo,
+    opts[-1].sigdigs,
+    opts[-1].timeline, opts[-1].save, opts[-1].baseline, opts[-1].findmax,
+    opts[-1].script,
+    opts[-1].corpus, opts[-1].loglevel
 ))
 
 
--- set loglevel
-if opts.loglevel then
-    require('tempest.logger').setlevel( opts.loglevel )
+--- report
+-- saves the result and compares it with the baseline
+-- @param stats
+-- @param encoded
+-- @return ok
+local function report( stats, encoded )
+    local run = {
+        options = opts[-1],
+        elapsed = stats.elapsed,
+        stats = encoded,
+    }
+
+    if opts.save then
+        local ok, err = Report.save( opts.save, run )
+
+        if not ok then
+            log.err( 'failed to save the result:', err )
+            return false
+        end
+    end
+
+    if opts.baseline then
+        local cmp, err = Report.compare( opts.baseline, run, opts.threshold,
+                                         opts.percentiles )
+
+        if not cmp then
+            log.err( 'failed to compare with the baseline:', err )
+            return false
+        end
+        Report.printComparison( cmp )
+
+        return #cmp.regressions == 0
+    end
+
+    return true
 end
 
 
+local passed = false
 local ok, err = require('act').run(function()
-    local t = Tempest.new( opts.worker, opts.rcvtimeo )
-    local stats, err, timeout = t:execute( opts, 1000 )
+    -- distributed mode
+    if opts.agents then
+        local stats, err = require('tempest.coordinator').coordinate( opts )
+
+        if err then
+            log.err( err )
+        else
+            Tempest.printStats( stats )
+            passed = report( stats, stats.encoded )
+        end
+        return
+    end
+
+    local t = Tempest.new( opts.worker, opts.rcvtimeo, opts.sigdigs,
+                           opts.timeline and opts.interval,
+                           opts.labels and #opts.labels )
+    local resolution, overhead, err = t:clock( opts.clock )
+
+    if err then
+        log.err( 'failed to select clock source:', err )
+        return
+    end
+    -- clock self-test
+    print(strformat(
+        '      clock: %s (resolution %d ns, overhead %.1f ns/call)',
+        opts.clock, resolution, overhead
+    ))
+
+    -- saturation search
+    if opts.findmax then
+        local result
+        result, err = t:findMax( opts )
+
+        if err then
+            log.err( err )
+        else
+            Tempest.printFindMax( result, opts )
+            passed = result.best ~= nil
+        end
+        return
+    end
+
+    local stats, timeout
+    stats, err, timeout = t:execute( opts, 1000 )
 
     if err then
         log.err( err )
@@ -52,10 +173,13 @@ local ok, err = require('act').run(function()
         log.err( 'timeout' )
     else
         Tempest.printStats( stats )
+        passed = report( stats, t:encode() )
     end
 end)
 if not ok then
     log.err( err )
 end
-
-
+-- exit with non-zero status for the regression gate
+if not passed then
+    os.exit( 1 )
+end
@@ -0,0 +1,25 @@
+--[[
+
+    Copyright (C) 2018 Masatoshi Fukunaga
+
+    handler/replay.lua
+    tempest
+    Created by Masatoshi Fukunaga on 18/09/28
+
+--]]
+
+return [[
+
+--- handler
+-- sends the request of the replay entry
+-- @param conn
+-- @return ok
+local function handler( conn )
+    local entry = conn.entry
+
+    return conn:request( entry.tmpl, entry.uri, entry.body ) ~= nil
+end
+
+return handler
+
+]]
@@ -0,0 +1,142 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/agent.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/20
+
+--]]
+
+--- file scope variables
+local NewInetServer = require('net.stream.inet').server.new
+local TLSConfig = require("libtls.config")
+local Tempest = require('tempest')
+local Channel = require('tempest.channel')
+local Corpus = require('tempest.corpus')
+--- constants
+local MSG_TIMEOUT = 10000
+
+
+--- run
+-- runs the scenario that received from the coordinator
+-- @param req
+-- @return res
+-- @return err
+local function run( req )
+    local opts = req.opts
+    local t, stats, resolution, overhead, err, timeout
+
+    -- TLS config cannot be transferred
+    if opts.tls then
+        opts.tlscfg = TLSConfig.new()
+        if opts.insecure then
+            opts.tlscfg:insecure_noverifycert()
+            opts.tlscfg:insecure_noverifyname()
+        end
+        -- CA file must exist on each agent
+        if opts.cacert then
+            local ok
+            ok, err = opts.tlscfg:set_ca_file( opts.cacert )
+            if not ok then
+                return nil, 'failed to load cacert: ' .. tostring( err )
+            end
+        end
+    end
+    -- corpus must be mapped on each agent
+    if opts.corpus then
+        opts.corpusmap, err = Corpus.open( opts.corpus, opts.zipf )
+        if not opts.corpusmap then
+            return nil, 'failed to open corpus: ' .. err
+        end
+    end
+    opts.startat = req.startat
+
+    t, err = Tempest.new( opts.worker, opts.rcvtimeo, opts.sigdigs, nil,
+                          opts.labels and #opts.labels )
+    if err then
+        return nil, err
+    end
+
+    resolution, overhead, err = t:clock( opts.clock )
+    if err then
+        return nil, err
+    end
+    log.verbose( 'clock:', opts.clock, resolution, 'ns resolution',
+                 overhead, 'ns/call' )
+
+    stats, err, timeout = t:execute( opts, 1000 )
+    if not stats then
+        return nil, err or timeout and 'timeout'
+    end
+
+    return {
+        stats = t:encode(),
+        started = stats.started,
+        stopped = stats.stopped,
+        binds = stats.binds,
+        workers = stats.workers,
+    }
+end
+
+
+--- serve
+-- waits for the scenario from the coordinator and runs it
+-- @param host
+-- @param port
+-- @return err
+local function serve( host, port )
+    local server, err = NewInetServer({
+        host = host,
+        port = port,
+        reuseaddr = true,
+    })
+
+    if err then
+        return err
+    end
+
+    err = server:listen()
+    if err then
+        server:close()
+        return err
+    end
+    log.notice( 'agent is listening on', host .. ':' .. port )
+
+    while true do
+        local sock, aerr = server:accept()
+
+        if aerr then
+            server:close()
+            return aerr
+        elseif sock then
+            local ch = Channel.new( sock )
+            local req, rerr, timeout = ch:read( MSG_TIMEOUT )
+
+            if req then
+                local res, _
+
+                log.notice( 'run the scenario', req.opts.script )
+                res, rerr = run( req )
+                if not res then
+                    log.err( 'failed to run the scenario:', rerr )
+                    res = {
+                        error = rerr
+                    }
+                end
+                _, rerr, timeout = ch:write( res, MSG_TIMEOUT )
+            end
+
+            if rerr or timeout then
+                log.err( 'failed to communicate with coordinator:',
+                         rerr or 'timeout' )
+            end
+            ch:close()
+        end
+    end
+end
+
+
+return {
+    serve = serve
+}
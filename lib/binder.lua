@@ -0,0 +1,280 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/binder.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/18
+
+--]]
+
+--- file scope variables
+local Socket = require('tempest.socket')
+local strsplit = require('string.split')
+local floor = math.floor
+local strformat = string.format
+local strmatch = string.match
+local strsub = string.sub
+local tonumber = tonumber
+--- constants
+local MAX_ADDRS = 65536
+
+
+--- class BoundSocket
+-- implements the methods of net.stream.inet client that used by Connection
+local BoundSocket = {}
+
+
+--- handshake
+-- the connection has already been established by Binder:connect
+-- @return ok
+function BoundSocket:handshake()
+    return true
+end
+
+
+--- deadlines
+-- @param rcvtimeo
+-- @param sndtimeo
+function BoundSocket:deadlines( rcvtimeo, sndtimeo )
+    self.rcvtimeo = rcvtimeo
+    self.sndtimeo = sndtimeo
+end
+
+
+--- fd
+-- @return fd
+function BoundSocket:fd()
+    return self.sock:fd()
+end
+
+
+--- linger
+-- @param sec
+-- @return ok
+-- @return err
+function BoundSocket:linger( sec )
+    return self.sock:linger( sec )
+end
+
+
+--- send
+-- @param str
+-- @return len
+-- @return err
+-- @return timeout
+function BoundSocket:send( str )
+    local sock = self.sock
+    local len = #str
+    local sent = 0
+
+    while true do
+        local n, err = sock:write( sent == 0 and str or strsub( str, sent + 1 ) )
+
+        if not n then
+            return nil, err
+        end
+
+        sent = sent + n
+        if sent == len then
+            return len
+        end
+
+        -- wait until writable
+        local ok, werr, timeout = writable( sock:fd(), self.sndtimeo )
+        if not ok then
+            return nil, werr, timeout
+        end
+    end
+end
+
+
+--- writev
+-- @param iov
+-- @return len
+-- @return err
+-- @return timeout
+function BoundSocket:writev( iov )
+    return self:send( iov:concat() )
+end
+
+
+--- recv
+-- @return data
+-- @return err
+-- @return timeout
+function BoundSocket:recv()
+    local sock = self.sock
+
+    while true do
+        local data, err = sock:read()
+
+        if data ~= false then
+            return data, err
+        end
+
+        -- wait until readable
+        local ok, rerr, timeout = readable( sock:fd(), self.rcvtimeo )
+        if not ok then
+            return nil, rerr, timeout
+        end
+    end
+end
+
+
+--- close
+function BoundSocket:close()
+    self.sock:close()
+end
+
+
+--- class Binder
+local Binder = {}
+
+
+--- connect
+-- connects to the host from the next local address in round-robin order
+-- @param host
+-- @param port
+-- @param msec
+-- @return sock
+-- @return err
+-- @return timeout
+function Binder:connect( host, port, msec )
+    local addrs = self.addrs
+    local laddr = addrs[self.idx]
+    local rhost = self.rhost
+    local sock, err, ok, timeout
+
+    self.idx = self.idx % #addrs + 1
+    -- resolve the host only once
+    if not rhost then
+        rhost, err = Socket.resolve( host )
+        if not rhost then
+            return nil, err
+        end
+        self.rhost = rhost
+    end
+
+    sock, err = Socket.connect( rhost, port, laddr )
+    if not sock then
+        return nil, err
+    end
+
+    -- wait for the completion of connect
+    ok, err, timeout = writable( sock:fd(), msec )
+    if ok then
+        err = sock:sockerror()
+    end
+    if not ok or err then
+        sock:close()
+        return nil, err, timeout
+    end
+
+    self.nconn[laddr] = ( self.nconn[laddr] or 0 ) + 1
+
+    return setmetatable({
+        sock = sock,
+    }, {
+        __index = BoundSocket
+    })
+end
+
+
+--- toipv4
+-- @param str
+-- @return n
+local function toipv4( str )
+    local a, b, c, d = strmatch( str, '^(%d+)%.(%d+)%.(%d+)%.(%d+)$' )
+
+    a, b, c, d = tonumber( a ), tonumber( b ), tonumber( c ), tonumber( d )
+    if a and a < 256 and b < 256 and c < 256 and d < 256 then
+        return ( ( a * 256 + b ) * 256 + c ) * 256 + d
+    end
+end
+
+
+--- fromipv4
+-- @param n
+-- @return str
+local function fromipv4( n )
+    return strformat( '%d.%d.%d.%d', floor( n / 16777216 ) % 256,
+                      floor( n / 65536 ) % 256, floor( n / 256 ) % 256,
+                      n % 256 )
+end
+
+
+--- parse
+-- parses the comma separated list of local addresses. IPv4 CIDR notation
+-- is expanded to the host addresses.
+-- @param str
+-- @return addrs
+-- @return err
+local function parse( str )
+    local addrs = {}
+
+    for _, item in ipairs( strsplit( str, ',' ) ) do
+        local addr, prefix = strmatch( item, '^([^/]+)/(%d+)$' )
+
+        if not addr then
+            addrs[#addrs + 1] = item
+        else
+            local n = toipv4( addr )
+
+            prefix = tonumber( prefix )
+            if not n then
+                return nil, strformat( 'invalid IPv4 CIDR %q', item )
+            elseif prefix > 32 or prefix < 16 then
+                return nil, strformat(
+                    'prefix length of %q must be in the range of 16 to 32',
+                    item
+                )
+            end
+
+            local size = 2 ^ ( 32 - prefix )
+            local head = n - n % size
+            local tail = head + size - 1
+
+            -- exclude the network and broadcast addresses
+            if size > 2 then
+                head = head + 1
+                tail = tail - 1
+            end
+
+            for v = head, tail do
+                addrs[#addrs + 1] = fromipv4( v )
+            end
+        end
+
+        if #addrs > MAX_ADDRS then
+            return nil, strformat( 'too many addresses (max %d)', MAX_ADDRS )
+        end
+    end
+
+    if #addrs == 0 then
+        return nil, 'no address'
+    end
+
+    return addrs
+end
+
+
+--- new
+-- @param addrs
+-- @param offset
+-- @return binder
+local function new( addrs, offset )
+    return setmetatable({
+        addrs = addrs,
+        idx = ( offset or 0 ) % #addrs + 1,
+        nconn = {},
+    }, {
+        __index = Binder
+    })
+end
+
+
+return {
+    new = new,
+    parse = parse,
+}
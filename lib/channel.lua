@@ -0,0 +1,107 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/channel.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/20
+
+--]]
+
+--- file scope variables
+local isa = require('isa')
+local encode = require('act.aux.syscall').encode
+local decode = require('act.aux.syscall').decode
+
+
+--- class Channel
+-- message channel between the coordinator and agents over the stream socket
+local Channel = {}
+
+
+--- close
+function Channel:close()
+    self.sock:close()
+end
+
+
+--- read
+-- @param msec
+-- @return msg
+-- @return err
+-- @return timeout
+function Channel:read( msec )
+    local buf = self.buf
+
+    self.sock:deadlines( msec )
+    while true do
+        local val, use, err, again = decode( buf )
+
+        if again then
+            local data, rerr, timeout = self.sock:recv()
+
+            if not data then
+                return nil, rerr, timeout
+            end
+
+            buf = buf .. data
+        elseif err then
+            -- reset buffer
+            self.buf = ''
+            return nil, err
+        elseif not isa.table( val ) then
+            self.buf = ''
+            return nil, 'UNEXPECTED-MESSAGE'
+        else
+            self.buf = buf:sub( use + 1 )
+            return val
+        end
+    end
+end
+
+
+--- write
+-- @param msg
+-- @param msec
+-- @return ok
+-- @return err
+-- @return timeout
+function Channel:write( msg, msec )
+    local data, err = encode( msg )
+
+    if data then
+        local len, werr, timeout
+
+        self.sock:deadlines( nil, msec )
+        len, werr, timeout = self.sock:send( data )
+        if len then
+            if len == #data then
+                return true
+            end
+
+            werr = 'UNEXPECTED-ERROR'
+        end
+
+        return false, werr, timeout
+    end
+
+    return false, err
+end
+
+
+--- new
+-- @param sock
+-- @return channel
+local function new( sock )
+    return setmetatable({
+        sock = sock,
+        buf = '',
+    }, {
+        __index = Channel
+    })
+end
+
+
+return {
+    new = new
+}
@@ -10,13 +10,48 @@
 
 --- file scope variables
 local NewInetClient = require('net.stream.inet').client.new
+local NewHttpParser = require('tempest.http').parser
 local Timer = require('tempest.timer')
+local floor = math.floor
+local max = math.max
+local min = math.min
+local random = math.random
+local strformat = string.format
+local strsub = string.sub
+local tostring = tostring
+--- constants
+-- range of the backoff time of reconnection in milliseconds
+local BACKOFF_MIN = 10
+local BACKOFF_MAX = 1000
 
 
 --- class
 local Connection = {}
 
 
+--- isResumed
+-- @param sock
+-- @return ok true if the TLS handshake resumed the previous session
+local function isResumed( sock )
+    local tls = sock.tls
+
+    return tls ~= nil and tls:conn_session_resumed() == true
+end
+
+
+--- failed
+-- counts the error by errno, records the time until the pending request
+-- failed and closes the connection.
+-- @param self
+-- @param err
+-- @param timeout
+local function failed( self, err, timeout )
+    self.stats:incrErrno( err, timeout )
+    self.timer:error()
+    self:close()
+end
+
+
 --- connect
 -- @return ok
 function Connection:connect()
@@ -25,14 +60,50 @@ function Connection:connect()
         local opts = self.opts
         local addr = self.addr
 
+        local timer = self.timer
+
         while not self.aborted do
-            local sock = NewInetClient( addr )
+            local sock
+
+            timer:connect()
+            if self.binder then
+                sock = self.binder:connect( addr.host, addr.port,
+                                            opts.sndtimeo )
+            else
+                sock = NewInetClient( addr )
+            end
 
             if sock then
+                if addr.tlscfg then
+                    timer:handshake()
+                end
                 if sock:handshake() then
+                    -- full and resumed TLS handshakes are recorded
+                    -- separately
+                    if addr.tlscfg then
+                        timer:handshaked( isResumed( sock ) )
+                    end
+                    timer:connected()
+                    -- send and receive via io_uring
+                    if self.ring and not addr.tlscfg then
+                        sock = self.ring:wrap( sock )
+                    end
                     -- set deadlines
                     sock:deadlines( opts.rcvtimeo, opts.sndtimeo )
+                    -- churn mode: reset the connection on close to avoid
+                    -- the exhaustion of ephemeral ports by TIME_WAIT
+                    if self.churn then
+                        sock:linger( 0 )
+                    end
                     self.sock = sock
+                    -- TLS and io_uring connection must be read and written
+                    -- via socket
+                    if not addr.tlscfg and not self.ring then
+                        self.fd = sock:fd()
+                    end
+                    self.parser:reset( false, true )
+                    self.nreq = 0
+                    self.backoff = 0
                     return true
                 end
 
@@ -40,7 +111,11 @@ function Connection:connect()
             end
 
             stats:incrEConnect()
-            sleep( 500 )
+            -- exponential backoff with jitter to avoid the reconnection
+            -- storm of all clients
+            self.backoff = min( max( self.backoff * 2, BACKOFF_MIN ),
+                                BACKOFF_MAX )
+            sleep( floor( self.backoff * ( 0.5 + random() * 0.5 ) ) )
         end
     end
 
@@ -59,13 +134,11 @@ function Connection:send( str )
 
         if not len or len ~= #str then
             if timeout then
-                self.stats:incrESendtimeo()
+                self.stats:incrESendTimeo()
             else
                 self.stats:incrESend()
             end
-            self.sock:close()
-            self.sock = nil
-            self.timer:reset()
+            failed( self, err, timeout )
         else
             -- update total-sent bytes and number of sent
             self.stats:addBytesSent( len )
@@ -94,9 +167,7 @@ function Connection:writev( iov )
             else
                 self.stats:incrESend()
             end
-            self.timer:reset()
-            self.sock:close()
-            self.sock = nil
+            failed( self, err, timeout )
         else
             -- update total-sent bytes
             self.stats:addBytesSent( len )
@@ -124,9 +195,7 @@ function Connection:recv()
             else
                 self.stats:incrERecv()
             end
-            self.timer:reset()
-            self.sock:close()
-            self.sock = nil
+            failed( self, err, timeout )
         else
             -- update total-recv bytes
             self.stats:addBytesRecv( #data )
@@ -139,9 +208,422 @@ function Connection:recv()
 end
 
 
---- measure
-function Connection:measure()
+--- recvfail
+-- @param self
+-- @param err
+-- @param timeout
+-- @return status
+-- @return err
+-- @return timeout
+local function recvfail( self, err, timeout )
+    if timeout then
+        self.stats:incrERecvTimeo()
+    else
+        self.stats:incrERecv()
+    end
+    failed( self, err, timeout )
+
+    return nil, err, timeout
+end
+
+
+--- readResponse
+-- reads the response directly from the file descriptor.
+-- @param self
+-- @return status
+-- @return err
+-- @return timeout
+local function readResponse( self )
+    local stats = self.stats
+    local timer = self.timer
+    local parser = self.parser
+    local fd = self.fd
+    local rcvtimeo = self.opts.rcvtimeo
+
+    while true do
+        local status, err, nread = parser:readfrom( fd )
+
+        if nread > 0 then
+            timer:measure()
+            stats:addBytesRecv( nread )
+        end
+
+        if status then
+            return status
+        elseif status == nil then
+            return recvfail( self, err )
+        end
+
+        -- wait until readable
+        local ok, rerr, timeout = readable( fd, rcvtimeo )
+        if not ok then
+            return recvfail( self, rerr, timeout )
+        end
+    end
+end
+
+
+--- recvResponse
+-- receives the response via socket.
+-- @param self
+-- @return status
+-- @return err
+-- @return timeout
+local function recvResponse( self )
+    local stats = self.stats
+    local timer = self.timer
+    local parser = self.parser
+
+    while true do
+        local data, err, timeout = self.sock:recv()
+        local status
+
+        timer:measure()
+        if data then
+            stats:addBytesRecv( #data )
+            status, err = parser:feed( data )
+        elseif not err and not timeout then
+            -- closed by peer
+            status, err = parser:eof()
+        end
+
+        if status then
+            return status
+        elseif status == nil then
+            return recvfail( self, err, timeout )
+        end
+    end
+end
+
+
+--- sendRequest
+-- @param self
+-- @param tmpl
+-- @param ...
+-- @return ok
+-- @return err
+-- @return timeout
+local function sendRequest( self, tmpl, ... )
+    local fd = self.fd
+
+    -- TLS or io_uring connection
+    if not fd then
+        local len, err, timeout = self:send( tmpl:render( ... ) )
+        return len ~= nil and self.sock ~= nil, err, timeout
+    end
+
+    local len, total = tmpl:writev( fd, ... )
+    if not len then
+        self.stats:incrESend()
+        failed( self, total )
+        return false, total
+    end
+    self.stats:addBytesSent( len )
+
+    -- send the rest of the request via socket
+    if len < total then
+        local err, timeout
+        len, err, timeout = self:send( strsub( tmpl:render( ... ), len + 1 ) )
+        return len ~= nil and self.sock ~= nil, err, timeout
+    end
+
+    return true
+end
+
+
+--- pushHead
+-- @param self
+-- @param head
+local function pushHead( self, head )
+    local heads = self.heads
+
+    -- prepare the parser for the first in-flight request
+    if heads.head == heads.tail then
+        self.parser:reset( head )
+    end
+    heads[heads.tail] = head
+    heads.tail = heads.tail + 1
+end
+
+
+--- popHead
+-- @param self
+local function popHead( self )
+    local heads = self.heads
+    local head = heads.head + 1
+
+    heads[heads.head] = nil
+    heads.head = head
+    -- prepare the parser for the next in-flight request
+    if head ~= heads.tail then
+        self.parser:reset( heads[head] )
+    end
+end
+
+
+--- receivePipeline
+-- receives the responses of in-flight requests. if block is true, it waits
+-- until at least one response is received, otherwise it returns when there
+-- is no data available.
+-- @param self
+-- @param block
+-- @return ok
+-- @return err
+-- @return timeout
+local function receivePipeline( self, block )
+    local stats = self.stats
+    local timer = self.timer
+    local parser = self.parser
+    local fd = self.fd
+    local rcvtimeo = self.opts.rcvtimeo
+
+    while timer:pending() > 0 do
+        local status, err, timeout, nread
+
+        if fd then
+            status, err, nread = parser:readfrom( fd )
+        else
+            -- parse the buffered data first
+            status, err = parser:feed( '' )
+            if status == false then
+                local data
+                data, err, timeout = self.sock:recv()
+                if data then
+                    nread = #data
+                    status, err = parser:feed( data )
+                elseif not err and not timeout then
+                    nread = 0
+                    status, err = parser:eof()
+                end
+            end
+        end
+
+        if nread and nread > 0 then
+            timer:arrive()
+            stats:addBytesRecv( nread )
+        end
+
+        if status then
+            timer:dequeue()
+            stats:incrSuccess()
+            stats:incrStatus( status )
+            popHead( self )
+            if not parser:keepalive() then
+                self:close()
+                return true
+            elseif block then
+                return true
+            end
+        elseif status == nil then
+            recvfail( self, err, timeout )
+            return false, err, timeout
+        elseif not block then
+            return true
+        elseif fd then
+            -- wait until readable
+            local ok
+            ok, err, timeout = readable( fd, rcvtimeo )
+            if not ok then
+                recvfail( self, err, timeout )
+                return false, err, timeout
+            end
+        end
+    end
+
+    return true
+end
+
+
+--- pipeline
+-- sends the request without waiting for the response while the number of
+-- in-flight requests is less than the pipeline depth. the responses are
+-- counted as success when they are received.
+-- @param self
+-- @param tmpl
+-- @param ...
+-- @return ok
+-- @return err
+-- @return timeout
+local function pipeline( self, tmpl, ... )
+    local timer = self.timer
+    local ok, err, timeout
+
+    -- wait for the response of the oldest request
+    if timer:pending() >= self.depth then
+        ok, err, timeout = receivePipeline( self, true )
+        if not ok or not self.sock then
+            return ok, err, timeout
+        end
+    end
+
+    self.pipelined = true
+    timer:enqueue()
+    pushHead( self, tmpl:ishead() )
+    ok, err, timeout = sendRequest( self, tmpl, ... )
+    if not ok then
+        return false, err, timeout
+    -- reap the received responses without blocking
+    elseif self.fd then
+        return receivePipeline( self, false )
+    end
+
+    return true
+end
+
+
+--- request
+-- sends the request built from the template and receives the response.
+-- the connection will be closed if the response does not allow keep-alive.
+-- in pipelining mode, it returns true after the request has been sent.
+-- @param tmpl
+-- @param ...
+-- @return status
+-- @return err
+-- @return timeout
+function Connection:request( tmpl, ... )
+    if self.aborted then
+        return nil, 'aborted'
+    elseif self.depth > 1 then
+        return pipeline( self, tmpl, ... )
+    end
+
+    local ok, err, timeout, status
+
     self.timer:start()
+    self.parser:reset( tmpl:ishead() )
+    ok, err, timeout = sendRequest( self, tmpl, ... )
+    if not ok then
+        return nil, err, timeout
+    elseif self.fd then
+        status, err, timeout = readResponse( self )
+    else
+        status, err, timeout = recvResponse( self )
+    end
+
+    if status then
+        self.stats:incrStatus( status )
+        if not self.parser:keepalive() then
+            -- record the response before the close discards it
+            self.timer:flush()
+            self:close()
+        end
+    end
+
+    return status, err, timeout
+end
+
+
+--- settle
+-- closes the connection after the in-flight responses are received and the
+-- last response is recorded.
+function Connection:settle()
+    while self.sock and self.timer:pending() > 0 do
+        if not receivePipeline( self, true ) then
+            break
+        end
+    end
+    -- record the last response before the close discards it
+    self.timer:flush()
+    self:close()
+end
+
+
+--- done
+-- counts the completed request. in churn mode, the connection is settled
+-- when the number of requests reaches the limit.
+function Connection:done()
+    local churn = self.churn
+
+    if churn and self.sock then
+        local nreq = self.nreq + 1
+
+        self.nreq = nreq
+        if nreq >= churn then
+            self:settle()
+        end
+    end
+end
+
+
+--- schedule
+-- @param nsec
+function Connection:schedule( nsec )
+    self.timer:schedule( nsec )
+end
+
+
+--- measure
+-- starts the measurement. the label is applied to the subsequent
+-- measurements until it is changed, and it must be declared in the labels
+-- that are returned by the script along with the handler.
+-- @param label
+function Connection:measure( label )
+    local id
+
+    if label then
+        local labelids = self.labelids
+
+        id = labelids[label]
+        if not id then
+            log.warn( strformat( 'label %q is not declared; the script ' ..
+                                 'must return it in the array of labels',
+                                 tostring( label ) ) )
+            -- warn once per worker
+            id = 0
+            labelids[label] = id
+        end
+    end
+    self.timer:start( id )
+end
+
+
+--- status
+-- counts the HTTP status code of the response that is received by the
+-- script.
+-- @param code
+function Connection:status( code )
+    self.stats:incrStatus( code )
+end
+
+
+--- fail
+-- counts the failure of the script and its label, and records the time
+-- until it failed.
+function Connection:fail()
+    self.stats:incrFailure()
+    self.timer:fail()
+end
+
+
+--- wait
+-- suspends the handler until it is activated
+-- @return ok
+function Connection:wait()
+    local ok
+
+    self.cid = getcid()
+    ok = suspend()
+    self.cid = nil
+
+    return ok
+end
+
+
+--- park
+-- parks the client at the end of the current iteration. the connection is
+-- settled while the client is parked.
+function Connection:park()
+    self.parked = true
+end
+
+
+--- activate
+-- resumes the parked client
+function Connection:activate()
+    self.parked = false
+    if self.cid then
+        resume( self.cid )
+    end
 end
 
 
@@ -151,28 +633,61 @@ function Connection:abort()
 end
 
 
---- abort
+--- close
 function Connection:close()
     if self.sock then
+        local nlost
+
         self.sock:close()
         self.sock = nil
-        self.timer:reset()
+        self.fd = nil
+        self.heads = {
+            head = 1,
+            tail = 1
+        }
+        -- in-flight requests that will never be answered
+        nlost = self.timer:reset( not self.aborted )
+        if nlost > 0 and not self.aborted then
+            self.stats:addFailure( nlost )
+        end
     end
 end
 
 
-local function new( stats, opts )
+--- new
+-- @param stats
+-- @param opts
+-- @param binder
+-- @param ring
+-- @return conn
+local function new( stats, opts, binder, ring )
     return setmetatable({
         aborted = false,
+        parked = false,
+        -- true if the current iteration of script sent pipelined requests
+        pipelined = false,
         stats = stats,
         opts = opts,
+        binder = binder,
+        ring = ring,
         addr = {
             host = opts.host,
             port = opts.port,
             tlscfg = opts.tlscfg,
             servername = opts.servername,
         },
-        timer = Timer.new( stats ),
+        timer = Timer.new( stats, opts.pipeline ),
+        -- ids of the labels that are declared by the script
+        labelids = opts.labelids or {},
+        parser = NewHttpParser(),
+        depth = opts.pipeline or 1,
+        churn = opts.churn,
+        nreq = 0,
+        backoff = 0,
+        heads = {
+            head = 1,
+            tail = 1
+        },
     }, {
         __index = Connection
     })
@@ -0,0 +1,216 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/coordinator.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/20
+
+--]]
+
+--- file scope variables
+local NewInetClient = require('net.stream.inet').client.new
+local gettimeofday = require('process').gettimeofday
+local Stats = require('tempest.stats')
+local Channel = require('tempest.channel')
+local nameLabels = require('tempest').nameLabels
+local ipairs = ipairs
+local pairs = pairs
+local strformat = string.format
+local tostring = tostring
+--- constants
+-- delay of the shared start time to prepare the workers of all agents
+local START_DELAY = 3
+local MSG_TIMEOUT = 10000
+-- options that are shipped to the agents
+local REMOTE_OPTS = {
+    'worker',
+    'duration',
+    'warmup',
+    'ramp',
+    'poisson',
+    'pipeline',
+    'churn',
+    'native',
+    'get',
+    'uring',
+    'rcvtimeo',
+    'sndtimeo',
+    'sigdigs',
+    'clock',
+    'host',
+    'port',
+    'tls',
+    'insecure',
+    'cacert',
+    'tlsresume',
+    'bindaddrs',
+    'script',
+    'chunk',
+    'labels',
+    'corpus',
+    'zipf',
+    'replay',
+    'speed',
+}
+
+
+--- closeChannels
+-- @param chs
+local function closeChannels( chs )
+    for i = 1, #chs do
+        chs[i]:close()
+    end
+end
+
+
+--- connectAgents
+-- @param agents
+-- @return chs
+-- @return err
+local function connectAgents( agents )
+    local chs = {}
+
+    for i = 1, #agents do
+        local agent = agents[i]
+        local sock, err = NewInetClient({
+            host = agent.host,
+            port = agent.port,
+        })
+
+        if not sock then
+            closeChannels( chs )
+            return nil, strformat( 'failed to connect to agent %s: %s',
+                                   agent.name, tostring( err ) )
+        end
+        chs[i] = Channel.new( sock )
+    end
+
+    return chs
+end
+
+
+--- coordinate
+-- ships the scenario to the agents and merges their results. the number of
+-- clients and the request rate are shared among the agents.
+-- @param opts
+-- @return stats
+-- @return err
+local function coordinate( opts )
+    local agents = opts.agents
+    local nagent = #agents
+    local surplus = opts.client % nagent
+    local nclient = ( opts.client - surplus ) / nagent
+    local chs, err = connectAgents( agents )
+    local stats, startat, binds, workers
+
+    if err then
+        return nil, err
+    end
+
+    -- start all agents at the same time
+    startat = gettimeofday() + START_DELAY
+    for i = 1, nagent do
+        local ropts = {}
+        local ok, timeout
+
+        for _, k in ipairs( REMOTE_OPTS ) do
+            ropts[k] = opts[k]
+        end
+        ropts.client = nclient
+        if i <= surplus then
+            ropts.client = nclient + 1
+        end
+        if opts.rate then
+            ropts.rate = opts.rate / nagent
+        end
+        -- shard of the replay log
+        if opts.replay then
+            ropts.ragent = i
+            ropts.nagent = nagent
+        end
+
+        ok, err, timeout = chs[i]:write({
+            opts = ropts,
+            startat = startat,
+        }, MSG_TIMEOUT )
+        if not ok then
+            closeChannels( chs )
+            return nil, strformat( 'failed to send a scenario to agent %s: %s',
+                                   agents[i].name,
+                                   tostring( err or timeout and 'timeout' ) )
+        end
+    end
+
+    -- merge the results of agents
+    stats, err = Stats.new( opts.rcvtimeo, opts.sigdigs, 1, 0,
+                            opts.labels and #opts.labels )
+    if err then
+        closeChannels( chs )
+        return nil, err
+    end
+
+    local started = 0
+    local stopped = 0
+    local msec = START_DELAY * 1000 + opts.ramp + opts.warmup +
+                 opts.duration + MSG_TIMEOUT
+    for i = 1, nagent do
+        local res, timeout, _
+        res, err, timeout = chs[i]:read( msec )
+
+        if res then
+            if res.error then
+                err = res.error
+            else
+                _, err = stats:merge( res.stats )
+            end
+        elseif not err then
+            err = timeout and 'timeout' or 'closed by peer'
+        end
+
+        if err then
+            closeChannels( chs )
+            stats:dispose()
+            return nil, strformat( 'failed to get a result of agent %s: %s',
+                                   agents[i].name, tostring( err ) )
+        end
+
+        if started == 0 or started > res.started then
+            started = res.started
+        end
+        if stopped < res.stopped then
+            stopped = res.stopped
+        end
+        if res.binds then
+            binds = binds or {}
+            for addr, n in pairs( res.binds ) do
+                binds[addr] = ( binds[addr] or 0 ) + n
+            end
+        end
+        -- diagnostics of the workers of all agents
+        if res.workers then
+            workers = workers or {}
+            for _, w in ipairs( res.workers ) do
+                workers[#workers + 1] = w
+            end
+        end
+    end
+    closeChannels( chs )
+
+    local data = stats:data( opts.percentiles )
+    data.encoded = stats:encode()
+    stats:dispose()
+    nameLabels( data, opts.labels )
+    data.started = started
+    data.stopped = stopped
+    data.elapsed = stopped - started
+    data.binds = binds
+    data.workers = workers
+
+    return data
+end
+
+
+return {
+    coordinate = coordinate
+}
@@ -12,22 +12,45 @@ local isa = require('isa')
 local TLSConfig = require("libtls.config")
 local logger = require('tempest.logger')
 local EchoHandler = require('tempest.handler.echo')
+local ReplayHandler = require('tempest.handler.replay')
 local compileString = require('tempest.script').compileString
 local compileFile = require('tempest.script').compileFile
+local parseBindAddrs = require('tempest.binder').parse
+local Affinity = require('tempest.affinity')
+local Corpus = require('tempest.corpus')
+local Clocks = require('tempest.stats').clocks
+local loadReport = require('tempest.report').load
 local strsplit = require('string.split')
 local touint = require('tempest.util').touint
 local tomsec = require('tempest.util').tomsec
 local toaddr = require('tempest.util').toaddr
+local concat = table.concat
 local error = error
+local ipairs = ipairs
 local pairs = pairs
 local print = print
 local select = select
+local sort = table.sort
 local strfind = string.find
 local strformat = string.format
+local strmatch = string.match
 local strsub = string.sub
 local toupper = string.upper
+local tonumber = tonumber
 local tostring = tostring
 local unpack = unpack or table.unpack
+--- constants
+-- same as TEMPEST_SNAPSHOT_MAXPCT
+local MAX_PERCENTILES = 32
+-- same as TEMPEST_STATS_MAXLABEL
+local MAX_LABELS = 64
+-- multiplier of the time-unit of slo to msec
+local SLO_UNITS = {
+    [''] = 1,
+    ms = 1,
+    s = 1000,
+    us = 0.001,
+}
 
 
 --- parseOptargs
@@ -149,15 +172,97 @@ Options:
     -w, --worker=<N>        : number of workers (default `1`)
     -c, --client=<N>        : number of clients (default `1`)
     -d, --duration=<time>   : duration (default `5s`)
+    --ramp=<time>           : release the clients linearly over <time>
+                              before the warm-up (default `0`)
+    --warmup=<time>         : run the scenario for <time> before the
+                              measurement starts (default `0`)
+    --rate=<N>              : open-loop mode; send <N> requests per second
+                              on a fixed timetable regardless of response
+                              time, and measure the latency from the
+                              intended start time of each request
+    --poisson               : use exponentially distributed intervals in
+                              open-loop mode
+    --replay=<pathname>     : replay the timestamped request log at the
+                              original timing. each line of the log is
+                              `<sec>\t<method>\t<uri>[\t<body>]`, and `\n`,
+                              `\r`, `\t` and `\\` in the body are unescaped
+    --speed=<N>             : replay speed (e.g. `2` replays twice as fast;
+                              default `1`)
+    --pipeline=<N>          : keep up to <N> requests in flight on each
+                              connection with `conn:request` (default `1`)
+    --churn=<N>             : close the connection after every <N>
+                              requests and open a new one. with `--tls`,
+                              it forces a TLS handshake every <N> requests
+    --native                : run the built-in scenario with the native
+                              engine that drives the connections with epoll
+                              without calling Lua per request
+    --get=<path>            : use a fixed `GET <path>` HTTP/1.1 request as
+                              the scenario of the native engine
+    --uring                 : send and receive via io_uring with the
+                              registered buffers instead of the readiness
+                              notification (Linux only; falls back to the
+                              default if io_uring is not available)
     -t, --timeout=<time>    : send and recv timeout (default `5s`)
     --rcvtimeo=<time>       : recv timeout  (default same as `-t` value)
     --sndtimeo=<time>       : send timeout  (default same as `-t` value)
+    --sigdigs=<N>           : number of significant digits of the latency
+                              histogram in the range of `1` to `5`
+                              (default `3`)
+    --percentiles=<list>    : comma separated list of percentiles to report
+                              in ascending order (default
+                              `50,90,99,99.9,99.99`)
+    --timeline=<pathname>   : write the throughput and latency of each
+                              interval to <pathname>
+    --interval=<time>       : interval of timeline (default `1s`)
+    --clock=<source>        : clock source of latency measurement
+                              (default: `monotonic`)
     --loglevel=<level>      : set output log-level (default: `debug`)
-    -s, --script=<pathname> : scenario script
+    -s, --script=<pathname> : scenario script; the script returns the
+                              handler and optionally an array of the labels
+                              of `conn:measure(label)`
+    --corpus=<pathname>     : map the indexed corpus file once and share it
+                              with all workers; the script picks the entries
+                              via `conn.corpus`
+    --zipf=<s>              : exponent of the zipf selection of corpus
+                              entries (default `1`)
+    --bind=<addrs>          : spread the connections across the local
+                              addresses in round-robin order. <addrs> is
+                              a comma separated list of addresses or IPv4
+                              CIDR blocks (e.g. `127.0.0.2/30,10.0.0.5`)
+    --cpus=<list>           : pin each worker to a dedicated cpu of <list>
+                              in order (e.g. `2-5,8`)
+    --numa                  : spread the workers across the NUMA nodes
+                              and place the stats shard of each worker on
+                              its local node
+    --agent                 : run as an agent that listens on address
+                              and runs the scenario of the coordinator
+    --agents=<addrs>        : run as a coordinator of the comma separated
+                              list of agent addresses. the clients and
+                              rate are shared among the agents
+    --save=<pathname>       : save the result of the run to <pathname>
+    --baseline=<pathname>   : compare the result of the run with the result
+                              saved in <pathname>, and exit with status `1`
+                              if the run is regressed
+    --threshold=<N>         : regression threshold of the throughput and
+                              percentiles in percent (default `5`)
+    --find-max              : search the highest number of clients, or the
+                              highest rate up to `--rate`, that meets the
+                              SLOs by repeating the steps of the duration
+    --slo=<list>            : comma separated list of latency SLOs of
+                              find-max mode (e.g. `p99:50ms,p50:10ms`)
+    --error-budget=<N>      : maximum percentage of failed requests of
+                              find-max mode (default `1`)
     --tls                   : enable TLS connection
     --insecure              : skip certificate verification
+    --cacert=<pathname>     : verify the certificate of the server with the
+                              CA certificates in the file (e.g. the
+                              self-signed certificate of a local server)
+    --tls-resume            : resume the TLS session of the previous
+                              connection of the worker by the session ticket
+                              or session ID that the server issued
     address                 : specify target address in the following format;
-                              `[host]:port`
+                              `[host]:port`. in agent mode, it is the
+                              address to listen on
 
 NOTE:
     please specify the value of <time> in millisecond(s).
@@ -170,6 +275,15 @@ NOTE:
         h                   : hour(s), 24h equal to 1440m
         d                   : day(s), 1d equal to 24h
 
+    <source> value supports the followings;
+
+        coarse              : CLOCK_MONOTONIC_COARSE (low cost, 1-4ms ticks;
+                              not available on macOS)
+        monotonic           : CLOCK_MONOTONIC
+        raw                 : CLOCK_MONOTONIC_RAW (not available on macOS)
+        rdtsc               : invariant TSC calibrated against
+                              CLOCK_MONOTONIC (x86 only)
+
     <level> value supports the followings;
 
         debug               : output debug log and logs of following levels
@@ -183,6 +297,84 @@ NOTE:
 end
 
 
+--- interleaveNodes
+-- reorders the cpus so that the consecutive workers are placed on the
+-- different NUMA nodes
+-- @param cpus
+-- @return cpus
+local function interleaveNodes( cpus )
+    local nodes = {}
+    local ids = {}
+    local list = {}
+
+    for _, cpu in ipairs( cpus ) do
+        local node = Affinity.node( cpu )
+
+        if not nodes[node] then
+            nodes[node] = {}
+            ids[#ids + 1] = node
+        end
+        nodes[node][#nodes[node] + 1] = cpu
+    end
+    sort( ids )
+
+    for i = 1, #cpus do
+        for _, node in ipairs( ids ) do
+            local cpu = nodes[node][i]
+
+            if cpu then
+                list[#list + 1] = cpu
+            end
+        end
+        if #list == #cpus then
+            break
+        end
+    end
+
+    return list
+end
+
+
+--- parseSLO
+-- parses the comma separated list of `p<percentile>:<time>[ms|s|us]` into
+-- an array of the SLOs in ascending order of the percentile
+-- @param str
+-- @return slo
+local function parseSLO( str )
+    local slo = {}
+
+    for _, v in ipairs( strsplit( str, ',' ) ) do
+        local pct, num, unit = strmatch( v, '^p([%d%.]+):([%d%.]+)(%a*)$' )
+        local msec = tonumber( num )
+
+        pct = tonumber( pct )
+        if not pct or pct <= 0 or pct > 100 or not msec or
+           not SLO_UNITS[unit] then
+            printUsage( strformat(
+                'invalid slo option: %q must be `p<percentile>:<time>` ' ..
+                'with time-unit [ms / s / us]', v
+            ))
+        end
+        slo[#slo + 1] = {
+            pct = pct,
+            msec = msec * SLO_UNITS[unit],
+        }
+    end
+
+    sort( slo, function( a, b )
+        return a.pct < b.pct
+    end )
+    for i = 2, #slo do
+        if slo[i].pct == slo[i - 1].pct then
+            printUsage( strformat( 'invalid slo option: duplicate p%g',
+                                   slo[i].pct ) )
+        end
+    end
+
+    return slo
+end
+
+
 local function getopts( ... )
     local opts, err = getargs({
         -- <short-name> = "<long-name>[:<noarg>]"
@@ -193,15 +385,47 @@ local function getopts( ... )
         w = 'worker',
         c = 'client',
         d = 'duration',
+        'warmup',
+        'ramp',
         t = 'timeout',
         s = 'script',
+        'corpus',
+        'zipf',
         'rcvtimeo',
         'sndtimeo',
+        'sigdigs',
+        'percentiles',
+        'rate',
+        'poisson:true',
+        'replay',
+        'speed',
+        'pipeline',
+        'churn',
+        'native:true',
+        'get',
+        'uring:true',
+        'timeline',
+        'interval',
+        'clock',
         'loglevel',
+        'bind',
+        'cpus',
+        'numa:true',
+        'agent:true',
+        'agents',
+        'save',
+        'baseline',
+        'threshold',
+        'find-max:true',
+        'slo',
+        'error-budget',
         'tls:true',
         'insecure:true',
+        'cacert',
+        'tls-resume:true',
     }, ... )
     local raws = {}
+    local _
 
     if err then
         printUsage( err )
@@ -211,7 +435,7 @@ local function getopts( ... )
     end
 
     -- check worker
-    opts.worker, err = touint( opts.worker, 1 )
+    opts.worker, err = touint( opts.worker, 1, 1 )
     if err then
         printUsage( 'invalid worker option: ' .. err )
     end
@@ -231,6 +455,22 @@ local function getopts( ... )
         printUsage( 'invalid duration option: ' .. err )
     end
 
+    -- check ramp and warmup; the traffic of both phases is discarded
+    opts.ramp, err = tomsec( opts.ramp, 0, 0 )
+    if err then
+        printUsage( 'invalid ramp option: ' .. err )
+    end
+    opts.warmup, err = tomsec( opts.warmup, 0, 0 )
+    if err then
+        printUsage( 'invalid warmup option: ' .. err )
+    end
+    if opts.ramp + opts.warmup > 0 then
+        raws.warmup = strformat( '%d ms ramp-up and %d ms warm-up ' ..
+                                 '(discarded)', opts.ramp, opts.warmup )
+    else
+        raws.warmup = 'disabled'
+    end
+
     -- check timeout
     raws.timeout = opts.timeout or '1s'
     opts.timeout, err = tomsec( opts.timeout, 1000 * 1, 1000 * 1 )
@@ -252,6 +492,96 @@ local function getopts( ... )
         printUsage( 'invalid sndtimeo option: ' .. err )
     end
 
+    -- check rate
+    opts.rate, err = touint( opts.rate, nil, 1 )
+    if err then
+        printUsage( 'invalid rate option: ' .. err )
+    end
+    raws.rate = opts.rate and strformat( '%d req/s', opts.rate ) or
+                'unlimited'
+    if opts.rate and opts.poisson then
+        raws.rate = raws.rate .. ' (poisson)'
+    end
+
+    -- check pipeline
+    opts.pipeline, err = touint( opts.pipeline, 1, 1 )
+    if err then
+        printUsage( 'invalid pipeline option: ' .. err )
+    end
+    raws.pipeline = opts.pipeline
+
+    -- check churn
+    opts.churn, err = touint( opts.churn, nil, 1 )
+    if err then
+        printUsage( 'invalid churn option: ' .. err )
+    end
+    raws.churn = opts.churn and
+                 strformat( 'reconnect every %d req', opts.churn ) or
+                 'disabled'
+
+    -- check sigdigs
+    opts.sigdigs, err = touint( opts.sigdigs, 3, 1, 5 )
+    if err then
+        printUsage( 'invalid sigdigs option: ' .. err )
+    end
+    raws.sigdigs = opts.sigdigs
+
+    -- check percentiles
+    if opts.percentiles then
+        local pcts = {}
+
+        for _, v in ipairs( strsplit( opts.percentiles, ',' ) ) do
+            local p = tonumber( v )
+
+            if not p or p <= 0 or p > 100 then
+                printUsage( strformat(
+                    'invalid percentiles option: %q must be in the range ' ..
+                    'of (0, 100]', v
+                ))
+            elseif #pcts > 0 and p <= pcts[#pcts] then
+                printUsage(
+                    'invalid percentiles option: must be in ascending order'
+                )
+            end
+            pcts[#pcts + 1] = p
+        end
+
+        if #pcts > MAX_PERCENTILES then
+            printUsage( strformat(
+                'invalid percentiles option: too many percentiles (max %d)',
+                MAX_PERCENTILES
+            ))
+        end
+        opts.percentiles = pcts
+    end
+
+    -- check timeline and interval
+    raws.interval = opts.interval or '1s'
+    opts.interval, err = tomsec( opts.interval, 1000, 100 )
+    if err then
+        printUsage( 'invalid interval option: ' .. err )
+    end
+    if opts.timeline then
+        raws.timeline = strformat( '%q every %s', opts.timeline,
+                                   raws.interval )
+    else
+        raws.timeline = 'disabled'
+    end
+
+    -- check clock
+    opts.clock = opts.clock or 'monotonic'
+    if opts.clock ~= 'coarse' and opts.clock ~= 'monotonic' and
+       opts.clock ~= 'raw' and opts.clock ~= 'rdtsc' then
+        printUsage( strformat(
+            'invalid clock option: unknown clock source %q', opts.clock
+        ))
+    elseif not Clocks[opts.clock] then
+        printUsage( strformat(
+            'invalid clock option: clock source %q is not supported on ' ..
+            'this platform', opts.clock
+        ))
+    end
+
     -- check loglevel
     raws.loglevel = opts.loglevel or 'debug'
     if opts.loglevel ~= nil then
@@ -273,26 +603,287 @@ local function getopts( ... )
         printUsage( 'invalid address: ' .. err )
     end
 
-    -- check tls and insecure
+    -- check tls, insecure, cacert and tls-resume
+    opts.tlsresume = opts['tls-resume']
+    opts['tls-resume'] = nil
     if opts.tls then
+        local flags = {}
+
         opts.tlscfg = TLSConfig.new()
-        raws.tls = 'true'
         if opts.insecure then
-            raws.tls = 'true (insecure)'
+            flags[#flags + 1] = 'insecure'
             opts.tlscfg:insecure_noverifycert()
             opts.tlscfg:insecure_noverifyname()
         end
+        if opts.cacert then
+            local ok
+            ok, err = opts.tlscfg:set_ca_file( opts.cacert )
+            if not ok then
+                printUsage( 'invalid cacert option: ' .. tostring( err ) )
+            end
+            flags[#flags + 1] = strformat( 'cacert %q', opts.cacert )
+        end
+        if opts.tlsresume then
+            flags[#flags + 1] = 'session resumption'
+        end
+        raws.tls = 'true'
+        if #flags > 0 then
+            raws.tls = strformat( 'true (%s)', concat( flags, ', ' ) )
+        end
+    elseif opts.cacert or opts.tlsresume then
+        printUsage( 'invalid cacert or tls-resume option: requires tls ' ..
+                    'option' )
     else
         raws.tls = 'false'
     end
 
+    -- check bind
+    if opts.bind then
+        if opts.tls then
+            printUsage( 'invalid bind option: cannot be used with TLS' )
+        end
+
+        opts.bindaddrs, err = parseBindAddrs( opts.bind )
+        if err then
+            printUsage( 'invalid bind option: ' .. err )
+        end
+        raws.bind = strformat( '%d addresses', #opts.bindaddrs )
+    else
+        raws.bind = 'disabled'
+    end
+
+    -- check cpus and numa
+    if opts.cpus or opts.numa then
+        local allowed, cpus
+
+        if not Affinity.supported then
+            printUsage( 'invalid cpus or numa option: cpu affinity is not ' ..
+                        'supported on this platform' )
+        end
+        allowed, err = Affinity.cpus()
+        if err then
+            printUsage( 'failed to get the available cpus: ' .. err )
+        end
+
+        if opts.cpus then
+            local avail = {}
+
+            for _, cpu in ipairs( allowed ) do
+                avail[cpu] = true
+            end
+            cpus, err = Affinity.parse( opts.cpus )
+            if err then
+                printUsage( 'invalid cpus option: ' .. err )
+            end
+            for _, cpu in ipairs( cpus ) do
+                if not avail[cpu] then
+                    printUsage( strformat(
+                        'invalid cpus option: cpu %d is not available', cpu
+                    ))
+                end
+            end
+        else
+            cpus = allowed
+        end
+
+        -- interleave the cpus of each node
+        if opts.numa then
+            cpus = interleaveNodes( cpus )
+        end
+
+        if #cpus < opts.worker then
+            printUsage( strformat(
+                'invalid cpus option: %d cpus for %d workers; each worker ' ..
+                'needs a dedicated cpu', #cpus, opts.worker
+            ))
+        end
+        opts.cpus = cpus
+        raws.cpus = strformat( '%s%s', concat( cpus, ',', 1, opts.worker ),
+                               opts.numa and ' (numa)' or '' )
+    else
+        raws.cpus = 'disabled'
+    end
+
+    -- check agents
+    if opts.agents then
+        local agents = {}
+
+        for _, addr in ipairs( strsplit( opts.agents, ',' ) ) do
+            local port, host, aerr = toaddr( addr )
+
+            if aerr then
+                printUsage( strformat( 'invalid agents option: %q %s', addr,
+                                       aerr ) )
+            end
+            agents[#agents + 1] = {
+                name = addr,
+                host = host,
+                port = port,
+            }
+        end
+
+        if opts.client < #agents then
+            printUsage( 'invalid agents option: number of clients must be ' ..
+                        'greater than or equal to number of agents' )
+        elseif opts.timeline then
+            printUsage( 'invalid agents option: cannot be used with timeline' )
+        elseif opts.cpus then
+            printUsage( 'invalid agents option: cannot be used with cpus ' ..
+                        'or numa' )
+        end
+        opts.agents = agents
+        raws.agents = strformat( '%d agents', #agents )
+    else
+        raws.agents = 'disabled'
+    end
+
+    -- check threshold
+    opts.threshold, err = touint( opts.threshold, 5, 0, 100 )
+    if err then
+        printUsage( 'invalid threshold option: ' .. err )
+    end
+
+    -- check baseline
+    raws.save = opts.save and strformat( '%q', opts.save ) or 'disabled'
+    if opts.baseline then
+        raws.baseline = strformat( '%q (threshold %d %%)', opts.baseline,
+                                   opts.threshold )
+        opts.baseline, err = loadReport( opts.baseline )
+        if err then
+            printUsage( 'invalid baseline option: ' .. err )
+        end
+    else
+        raws.baseline = 'disabled'
+    end
+
+    -- check native and get
+    if opts.native then
+        if opts.script or opts.corpus then
+            printUsage( 'invalid native option: cannot be used with script ' ..
+                        'or corpus' )
+        elseif opts.tls or opts.bind or opts.rate or opts.pipeline > 1 then
+            printUsage( 'invalid native option: cannot be used with tls, ' ..
+                        'bind, rate or pipeline' )
+        elseif opts.ramp > 0 then
+            printUsage( 'invalid native option: cannot be used with ramp' )
+        end
+        if opts.get and strsub( opts.get, 1, 1 ) ~= '/' then
+            printUsage( 'invalid get option: path must start with `/`' )
+        end
+        raws.native = opts.get and strformat( 'GET %s', opts.get ) or 'echo'
+    elseif opts.get then
+        printUsage( 'invalid get option: requires native option' )
+    else
+        raws.native = 'disabled'
+    end
+
+    -- check uring
+    if opts.uring then
+        if opts.native or opts.tls then
+            printUsage( 'invalid uring option: cannot be used with native ' ..
+                        'or tls' )
+        end
+        raws.uring = 'enabled'
+    else
+        raws.uring = 'disabled'
+    end
+
+    -- check corpus
+    if opts.corpus then
+        local zipf = tonumber( opts.zipf or 1 )
+
+        if not zipf or zipf <= 0 then
+            printUsage( 'invalid zipf option: must be greater than 0' )
+        end
+        opts.zipf = zipf
+        opts.corpusmap, err = Corpus.open( opts.corpus, zipf )
+        if err then
+            printUsage( 'invalid corpus option: ' .. err )
+        end
+        raws.corpus = strformat( '%q (%d entries)', opts.corpus,
+                                 #opts.corpusmap )
+    elseif opts.zipf then
+        printUsage( 'invalid zipf option: requires corpus option' )
+    else
+        raws.corpus = 'disabled'
+    end
+
+    -- check replay and speed
+    if opts.replay then
+        local speed = tonumber( opts.speed or 1 )
+        local file, ferr = io.open( opts.replay )
+
+        if opts.script or opts.rate or opts.native or opts.corpus then
+            printUsage( 'invalid replay option: cannot be used with ' ..
+                        'script, rate, native or corpus' )
+        elseif not file then
+            printUsage( 'invalid replay option: ' .. ferr )
+        elseif not speed or speed <= 0 then
+            printUsage( 'invalid speed option: must be greater than 0' )
+        end
+        file:close()
+        opts.speed = speed
+        raws.replay = strformat( '%q at %gx speed', opts.replay, speed )
+    elseif opts.speed then
+        printUsage( 'invalid speed option: requires replay option' )
+    else
+        raws.replay = 'disabled'
+    end
+
+    -- check find-max, slo and error-budget
+    opts.findmax = opts['find-max']
+    opts['find-max'] = nil
+    if opts.findmax then
+        local budget = tonumber( opts['error-budget'] or 1 )
+        local slo = opts.slo
+
+        if opts.agents or opts.replay or opts.native or opts.timeline then
+            printUsage( 'invalid find-max option: cannot be used with ' ..
+                        'agents, replay, native or timeline' )
+        elseif opts.ramp > 0 or opts.save or opts.baseline then
+            printUsage( 'invalid find-max option: cannot be used with ' ..
+                        'ramp, save or baseline' )
+        elseif not opts.slo then
+            printUsage( 'invalid find-max option: requires slo option' )
+        elseif not budget or budget < 0 or budget > 100 then
+            printUsage( 'invalid error-budget option: must be in the ' ..
+                        'range of [0, 100]' )
+        end
+        opts.errorbudget = budget
+        opts.slo = parseSLO( opts.slo )
+        opts.slopcts = {}
+        for i = 1, #opts.slo do
+            opts.slopcts[i] = opts.slo[i].pct
+            opts.slo[i].idx = i
+        end
+        raws.findmax = strformat( '%s within %s with %g %% error budget',
+                                  opts.rate and 'rate' or 'clients',
+                                  slo, budget )
+    elseif opts.slo or opts['error-budget'] then
+        printUsage( 'invalid slo option: requires find-max option' )
+    else
+        raws.findmax = 'disabled'
+    end
+    opts['error-budget'] = nil
+
     -- check script
     if opts.script then
-        opts.chunk, err = compileFile( opts.script )
+        -- labels of measure calls are declared by the script
+        opts.chunk, opts.labels, err = compileFile( opts.script )
+        if opts.labels and #opts.labels > MAX_LABELS then
+            err = strformat( 'too many measure labels: must be ' ..
+                             'less than or equal to %d', MAX_LABELS )
+        end
+    -- built-in handler of replay mode
+    elseif opts.replay then
+        opts.script = '<USE BUILT-IN REPLAY HANDLER>'
+        opts.chunk, _, err = compileString( ReplayHandler,
+                                            'BUILT-IN REPLAY HANDLER' )
     -- specify default handler
     else
         opts.script = '<USE BUILT-IN HANDLER>'
-        opts.chunk, err = compileString( EchoHandler, 'BUILT-IN HANDLER' )
+        opts.chunk, _, err = compileString( EchoHandler,
+                                            'BUILT-IN HANDLER' )
     end
 
     if err then
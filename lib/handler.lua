@@ -11,12 +11,17 @@
 --- handleConnection
 -- @param conn
 -- @param script
-local function handleConnection( conn, script )
+-- @param sched
+local function handleConnection( conn, script, sched )
     local stats = conn.stats
     local proxy = {
+        -- shared corpus of the entries
+        corpus = conn.opts.corpusmap,
+
         --- measure
-        measure = function()
-            conn:measure()
+        -- @param label
+        measure = function( _, label )
+            conn:measure( label )
         end,
 
         --- send
@@ -44,20 +49,63 @@ local function handleConnection( conn, script )
         -- @return timeout
         recv = function()
             return conn:recv()
+        end,
+
+        --- request
+        -- @param tmpl
+        -- @param ...
+        -- @return status
+        -- @return err
+        -- @return timeout
+        request = function( _, tmpl, ... )
+            return conn:request( tmpl, ... )
+        end,
+
+        --- status
+        -- @param code
+        status = function( _, code )
+            conn:status( code )
         end
     }
 
-    assert( suspend() )
+    assert( conn:wait() )
     while conn:connect() do
         repeat
+            -- wait for the intended start time of open-loop or replay mode
+            if sched then
+                local intended, entry = sched:next()
+
+                -- replay log has been exhausted
+                if not intended then
+                    conn:close()
+                    return
+                end
+                conn:schedule( intended )
+                proxy.entry = entry
+            end
+
+            -- the responses of the pipelined requests are counted by the
+            -- connection, and the others are counted by the result of script
+            conn.pipelined = false
             if script( proxy ) == true then
-                stats:incrSuccess()
+                if not conn.pipelined then
+                    stats:incrSuccess()
+                end
+                conn:done()
             else
-                stats:incrFailure()
+                if not conn.pipelined then
+                    conn:fail()
+                end
                 conn:close()
                 break
             end
-        until conn.sock == nil or conn.aborted
+        until conn.sock == nil or conn.aborted or conn.parked
+
+        -- find-max mode: the client is parked between the steps
+        if conn.parked then
+            conn:settle()
+            conn:wait()
+        end
     end
 
     conn:close()
@@ -0,0 +1,211 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/replay.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/28
+
+--]]
+
+--- file scope variables
+local NewTemplate = require('tempest.http').template
+local ceil = math.ceil
+local strformat = string.format
+local strgsub = string.gsub
+local strmatch = string.match
+local strsub = string.sub
+local tonumber = tonumber
+--- constants
+local NSEC_PER_MSEC = 1000000
+local NSEC_PER_SEC = 1000000000
+local ENTRY_PATTERN = '^([^\t]+)\t([^\t]+)\t([^\t]+)\t?(.*)$'
+local UNESCAPE = {
+    ['\\n'] = '\n',
+    ['\\r'] = '\r',
+    ['\\t'] = '\t',
+    ['\\\\'] = '\\',
+}
+
+
+--- parse
+-- parses the line of the replay log in the format of
+-- `<timestamp>\t<method>\t<uri>[\t<body>]`. the timestamp is in seconds,
+-- and `\n`, `\r`, `\t` and `\\` in the body are unescaped.
+-- @param line
+-- @return ts
+-- @return method
+-- @return uri
+-- @return body
+local function parse( line )
+    local ts, method, uri, body = strmatch( line, ENTRY_PATTERN )
+
+    ts = tonumber( ts )
+    if not ts then
+        return
+    elseif body == '' then
+        body = nil
+    elseif body then
+        body = strgsub( body, '\\[nrt\\]', UNESCAPE )
+    end
+
+    return ts, method, uri, body
+end
+
+
+--- class
+local Replay = {}
+
+
+--- read
+-- reads the next entry of this shard. the lines of other shards are
+-- skipped without parsing.
+-- @return ts
+-- @return method
+-- @return uri
+-- @return body
+function Replay:read()
+    local file = self.file
+
+    while file do
+        local line = file:read('*l')
+
+        if not line then
+            file:close()
+            self.file = nil
+            return
+        -- skip comments and blank lines
+        elseif line ~= '' and strsub( line, 1, 1 ) ~= '#' then
+            local lineno = self.lineno + 1
+
+            self.lineno = lineno
+            if lineno % self.nshard == self.shard then
+                local ts, method, uri, body = parse( line )
+
+                if ts then
+                    return ts, method, uri, body
+                end
+                log.warn( strformat( 'invalid replay log at line %d: %q',
+                                     lineno, line ) )
+            end
+        end
+    end
+end
+
+
+--- template
+-- returns the request template of the method
+-- @param method
+-- @param hasbody
+-- @return tmpl
+-- @return err
+function Replay:template( method, hasbody )
+    local key = hasbody and method .. ' body' or method
+    local tmpl = self.tmpls[key]
+
+    if not tmpl then
+        local err
+        tmpl, err = NewTemplate( method, '${1}', {
+            Host = self.host,
+        }, hasbody and '${2}' or nil )
+        if not tmpl then
+            return nil, err
+        end
+        self.tmpls[key] = tmpl
+    end
+
+    return tmpl
+end
+
+
+--- start
+-- sets the origin of the timeline to now
+function Replay:start()
+    self.epoch = self.stats:now()
+end
+
+
+--- next
+-- waits until the scaled original time of the next entry and returns it.
+-- if the generator is behind the timeline, it returns immediately.
+-- @return nsec
+-- @return entry
+function Replay:next()
+    local ts, method, uri, body = self:read()
+
+    if not ts then
+        return
+    end
+
+    local tmpl, err = self:template( method, body ~= nil )
+    if not tmpl then
+        log.err( 'failed to create a template of replay entry:', err )
+        return
+    end
+
+    local intended = self.epoch + ( ts - self.origin ) * self.scale
+    -- act.sleep is millisecond resolution. round up to avoid starting
+    -- the request before its intended start time
+    local delay = intended - self.stats:now()
+    if delay > 0 then
+        sleep( ceil( delay / NSEC_PER_MSEC ) )
+    end
+
+    return intended, {
+        tmpl = tmpl,
+        uri = uri,
+        body = body,
+    }
+end
+
+
+--- new
+-- opens the replay log. the lines are distributed round-robin to the
+-- shards; the shard of a worker is unique across the agents.
+-- @param stats
+-- @param opts
+-- @return replay
+-- @return err
+local function new( stats, opts )
+    local file, err = io.open( opts.replay )
+    local nshard = ( opts.nagent or 1 ) * opts.worker
+    local replay
+
+    if not file then
+        return nil, err
+    end
+
+    replay = setmetatable({
+        stats = stats,
+        file = file,
+        host = strformat( '%s:%d', opts.host, opts.port ),
+        scale = NSEC_PER_SEC / opts.speed,
+        shard = ( ( opts.ragent or 1 ) - 1 ) * opts.worker + opts.wid,
+        nshard = nshard,
+        lineno = 0,
+        tmpls = {},
+        epoch = 0,
+    }, {
+        __index = Replay
+    })
+    replay.shard = replay.shard % nshard
+
+    -- timestamp of the first entry is the origin of the timeline
+    local line = file:read('*l')
+    while line and ( line == '' or strsub( line, 1, 1 ) == '#' ) do
+        line = file:read('*l')
+    end
+    replay.origin = line and parse( line )
+    if not replay.origin then
+        file:close()
+        return nil, 'replay log has no valid entry'
+    end
+    file:seek( 'set' )
+
+    return replay
+end
+
+
+return {
+    new = new
+}
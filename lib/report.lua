@@ -0,0 +1,206 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/report.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/22
+
+--]]
+
+--- file scope variables
+local isa = require('isa')
+local encode = require('act.aux.syscall').encode
+local decode = require('act.aux.syscall').decode
+local compareStats = require('tempest.stats').compare
+local open = io.open
+local concat = table.concat
+local strformat = string.format
+local tostring = tostring
+--- constants
+local VERSION = 1
+-- significance level of the latency comparison
+local ALPHA = 0.05
+
+
+local function printf( fmt, ... )
+    print( strformat( fmt, ... ) )
+end
+
+
+--- save
+-- writes the result of a run to the file
+-- @param pathname
+-- @param run
+-- @return ok
+-- @return err
+local function save( pathname, run )
+    local data, err = encode({
+        version = VERSION,
+        options = run.options,
+        elapsed = run.elapsed,
+        stats = run.stats,
+    })
+    local f, _
+
+    if not data then
+        return false, err
+    end
+
+    f, err = open( pathname, 'w' )
+    if not f then
+        return false, err
+    end
+    _, err = f:write( data )
+    f:close()
+    if err then
+        return false, err
+    end
+
+    return true
+end
+
+
+--- load
+-- reads the result of a run that saved by save function
+-- @param pathname
+-- @return run
+-- @return err
+local function load( pathname )
+    local f, err = open( pathname, 'r' )
+    local data, run, _
+
+    if not f then
+        return nil, err
+    end
+    data = f:read('*a')
+    f:close()
+
+    run, _, err = decode( data )
+    if err then
+        return nil, err
+    elseif not isa.table( run ) or run.version ~= VERSION or
+           not isa.string( run.stats ) or not isa.number( run.elapsed ) then
+        return nil, strformat( '%q is not a result of tempest', pathname )
+    end
+
+    return run
+end
+
+
+--- compare
+-- compares the current run with the baseline run. the run is regressed if
+-- the throughput drops or a percentile increases more than the threshold
+-- percent. the percentiles are regressed only if the current latency
+-- distribution is significantly slower.
+-- @param baseline
+-- @param current
+-- @param threshold
+-- @param pcts
+-- @return cmp
+-- @return err
+local function compare( baseline, current, threshold, pcts )
+    local cmp, err = compareStats( baseline.stats, current.stats, pcts )
+
+    if not cmp then
+        return nil, err
+    end
+
+    local base = cmp.baseline
+    local cur = cmp.current
+    local slower = cmp.pvalue < ALPHA and cmp.auc > 0.5
+    local regressions = {}
+
+    base.rps = base.success / baseline.elapsed
+    cur.rps = cur.success / current.elapsed
+    if cur.rps < base.rps * ( 1 - threshold / 100 ) then
+        regressions[#regressions + 1] = 'throughput'
+    end
+
+    for i = 1, #cur.latency.percentiles do
+        local b = base.latency.percentiles[i]
+        local c = cur.latency.percentiles[i]
+
+        if b and slower and c.msec > b.msec * ( 1 + threshold / 100 ) then
+            regressions[#regressions + 1] = strformat( 'p%g', c.percentile )
+        end
+    end
+
+    cmp.threshold = threshold
+    cmp.options = baseline.options
+    cmp.regressions = regressions
+
+    return cmp
+end
+
+
+--- delta
+-- @param base
+-- @param cur
+-- @return str
+local function delta( base, cur )
+    if base == 0 then
+        return '-'
+    end
+
+    return strformat( '%+.2f %%', ( cur - base ) / base * 100 )
+end
+
+
+--- printComparison
+-- @param cmp
+local function printComparison( cmp )
+    local base = cmp.baseline
+    local cur = cmp.current
+
+    printf([[
+[Comparison]
+   baseline: %s clients, %s duration, rate %s
+ regression: %s %% threshold
+%11s %15s %15s %10s
+%11s %15.2f %15.2f %10s]],
+        tostring( cmp.options and cmp.options.client ),
+        tostring( cmp.options and cmp.options.duration ),
+        tostring( cmp.options and cmp.options.rate ),
+        cmp.threshold,
+        '', 'baseline', 'current', 'delta',
+        'reqs/s', base.rps, cur.rps, delta( base.rps, cur.rps )
+    )
+    for i = 1, #cur.latency.percentiles do
+        local b = base.latency.percentiles[i]
+        local c = cur.latency.percentiles[i]
+
+        -- the baseline may have no samples or fewer percentiles
+        if b then
+            printf( '%11s %12.2f ms %12.2f ms %10s',
+                    strformat( 'p%g', c.percentile ), b.msec, c.msec,
+                    delta( b.msec, c.msec ) )
+        else
+            printf( '%11s %15s %12.2f ms %10s',
+                    strformat( 'p%g', c.percentile ), '-', c.msec, '-' )
+        end
+    end
+    printf( '%11s %12.2f ms %12.2f ms %10s', 'average', base.latency.avg or 0,
+            cur.latency.avg or 0,
+            delta( base.latency.avg or 0, cur.latency.avg or 0 ) )
+    printf([[
+
+ mann-whitney: z = %.3f, p = %.4g, P(current > baseline) = %.3f]],
+        cmp.z, cmp.pvalue, cmp.auc
+    )
+
+    if #cmp.regressions > 0 then
+        printf( '     result: REGRESSED (%s)\n',
+                concat( cmp.regressions, ', ' ) )
+    else
+        print( '     result: OK\n' )
+    end
+end
+
+
+return {
+    save = save,
+    load = load,
+    compare = compare,
+    printComparison = printComparison,
+}
@@ -0,0 +1,270 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/ring.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/26
+
+--]]
+
+--- file scope variables
+local Uring = require('tempest.uring')
+local ENOBUFS = Uring.ENOBUFS
+local ECANCELED = Uring.ECANCELED
+local strsub = string.sub
+local tremove = table.remove
+
+
+--- class RingSocket
+-- implements the methods of net.stream.inet client that used by Connection.
+-- the data are sent and received via io_uring, and it falls back to the
+-- wrapped socket if the ring has no space.
+local RingSocket = {}
+
+
+--- handshake
+-- @return ok
+function RingSocket:handshake()
+    return true
+end
+
+
+--- deadlines
+-- @param rcvtimeo
+-- @param sndtimeo
+function RingSocket:deadlines( rcvtimeo, sndtimeo )
+    self.rcvtimeo = rcvtimeo
+    self.sndtimeo = sndtimeo
+    self.sock:deadlines( rcvtimeo, sndtimeo )
+end
+
+
+--- fd
+-- @return fd
+function RingSocket:fd()
+    return self.sock:fd()
+end
+
+
+--- linger
+-- @param sec
+-- @return ok
+-- @return err
+function RingSocket:linger( sec )
+    return self.sock:linger( sec )
+end
+
+
+--- send
+-- @param str
+-- @return len
+-- @return err
+-- @return timeout
+function RingSocket:send( str )
+    local ring = self.ring
+    local len = #str
+
+    if not ring.uring:send( self.sock:fd(), str, self.sid ) then
+        return self.sock:send( str )
+    end
+
+    local ok, res, err = ring:wait( self.sid, self.sndtimeo )
+    if not ok then
+        return nil, nil, true
+    elseif res < 0 then
+        return nil, err
+    elseif res < len then
+        -- send the rest via socket
+        local n, serr, timeout = self.sock:send( strsub( str, res + 1 ) )
+        if not n then
+            return nil, serr, timeout
+        end
+    end
+
+    return len
+end
+
+
+--- writev
+-- @param iov
+-- @return len
+-- @return err
+-- @return timeout
+function RingSocket:writev( iov )
+    return self:send( iov:concat() )
+end
+
+
+--- recv
+-- @return data
+-- @return err
+-- @return timeout
+function RingSocket:recv()
+    local ring = self.ring
+    local chunks = self.chunks
+
+    while true do
+        if #chunks > 0 then
+            return tremove( chunks, 1 )
+        elseif self.err or self.eof then
+            return nil, self.err
+        elseif not self.armed then
+            if not ring.uring:recv( self.sock:fd(), self.rid ) then
+                return self.sock:recv()
+            end
+            self.armed = true
+        end
+
+        if not ring:wait( self.rid, self.rcvtimeo ) then
+            return nil, nil, true
+        end
+    end
+end
+
+
+--- close
+function RingSocket:close()
+    local ring = self.ring
+
+    -- stop the multishot recv before the descriptor is reused
+    if self.armed then
+        ring.uring:cancel( self.rid )
+    end
+    ring.socks[self.rid] = nil
+    self.sock:close()
+end
+
+
+--- class Ring
+local Ring = {}
+
+
+--- wait
+-- submits the queued requests and suspends the calling coroutine until the
+-- completion of the request is reaped.
+-- @param id
+-- @param msec
+-- @return ok
+-- @return res
+-- @return err
+function Ring:wait( id, msec )
+    local waits = self.waits
+    local ok, res, err
+
+    waits[id] = getcid()
+    self.uring:submit()
+    ok, res, err = suspend( msec )
+    waits[id] = nil
+
+    return ok, res, err
+end
+
+
+--- wrap
+-- @param sock
+-- @return sock
+function Ring:wrap( sock )
+    local rid = self.seq + 2
+    local rsock = setmetatable({
+        ring = self,
+        sock = sock,
+        sid = rid - 1,
+        rid = rid,
+        chunks = {},
+        armed = false,
+    }, {
+        __index = RingSocket
+    })
+
+    -- ids are never reused to ignore the late completions of closed socket
+    self.seq = rid
+    self.socks[rid] = rsock
+
+    return rsock
+end
+
+
+--- reaper
+-- dispatches the completions to the sockets and the waiting coroutines.
+-- @param self
+local function reaper( self )
+    local uring = self.uring
+    local efd = uring:efd()
+    local waits = self.waits
+    local socks = self.socks
+    local cqes = self.cqes
+
+    while true do
+        local ok, err = readable( efd )
+
+        if not ok then
+            log.err( 'failed to wait the completions of io_uring:', err )
+            return
+        end
+
+        for i = 1, uring:reap( cqes ) * 4, 4 do
+            local id, res, data, more = cqes[i], cqes[i + 1], cqes[i + 2],
+                                        cqes[i + 3]
+            local sock = socks[id]
+            local cid = waits[id]
+
+            -- completion of recv
+            if sock then
+                if res > 0 then
+                    sock.chunks[#sock.chunks + 1] = data
+                elseif res == 0 then
+                    sock.eof = true
+                elseif res ~= ENOBUFS and res ~= ECANCELED then
+                    sock.err = data
+                end
+                -- recv should be re-armed
+                if not more then
+                    sock.armed = false
+                end
+                if cid then
+                    resume( cid, res )
+                end
+            elseif cid then
+                resume( cid, res, data or nil )
+            end
+        end
+    end
+end
+
+
+--- new
+-- creates the io_uring of worker
+-- @return ring
+-- @return err
+local function new()
+    local uring, err = Uring.new()
+    local ring, cid
+
+    if not uring then
+        return nil, err
+    end
+
+    ring = setmetatable({
+        uring = uring,
+        seq = 0,
+        waits = {},
+        socks = {},
+        -- reused for the completions
+        cqes = {},
+    }, {
+        __index = Ring
+    })
+
+    cid, err = spawn( reaper, ring )
+    if not cid then
+        return nil, err
+    end
+
+    return ring
+end
+
+
+return {
+    new = new
+}
@@ -0,0 +1,84 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/scheduler.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/10
+
+--]]
+
+--- file scope variables
+local ceil = math.ceil
+local mlog = math.log
+local random = math.random
+--- constants
+local NSEC_PER_MSEC = 1000000
+
+
+--- class
+local Scheduler = {}
+
+
+--- start
+-- sets the first intended start time to now
+function Scheduler:start()
+    self.deadline = self.stats:now()
+end
+
+
+--- rate
+-- changes the request rate and restarts the timetable from now
+-- @param rate
+function Scheduler:rate( rate )
+    self.interval = 1000000000 / rate
+    self.deadline = self.stats:now()
+end
+
+
+--- next
+-- waits until the next intended start time that has not been taken by other
+-- clients, and returns it. if the generator is behind the timetable, it
+-- returns immediately.
+-- @return nsec
+function Scheduler:next()
+    local intended = self.deadline
+    local interval = self.interval
+
+    -- exponential inter-arrival time
+    if self.poisson then
+        interval = -mlog( 1 - random() ) * interval
+    end
+    self.deadline = intended + interval
+
+    -- act.sleep is millisecond resolution. round up to avoid starting
+    -- the request before its intended start time
+    local delay = intended - self.stats:now()
+    if delay > 0 then
+        sleep( ceil( delay / NSEC_PER_MSEC ) )
+    end
+
+    return intended
+end
+
+
+--- new
+-- @param stats
+-- @param rate
+-- @param poisson
+-- @return scheduler
+local function new( stats, rate, poisson )
+    return setmetatable({
+        stats = stats,
+        interval = 1000000000 / rate,
+        poisson = poisson == true,
+        deadline = 0,
+    }, {
+        __index = Scheduler
+    })
+end
+
+
+return {
+    new = new
+}
@@ -33,67 +33,107 @@ local function realpath( pathname )
 end
 
 
+--- checkLabels
+-- the labels of measure calls are declared by the script as the second
+-- return value, and they are looked up by their index in the stats.
+-- @param labels
+-- @return labels
+-- @return err
+local function checkLabels( labels )
+    local seen = {}
+
+    if labels == nil then
+        return nil
+    elseif type( labels ) ~= 'table' then
+        return nil, 'script returned invalid labels: must be an array'
+    end
+
+    for i = 1, #labels do
+        local label = labels[i]
+
+        if type( label ) ~= 'string' or #label == 0 then
+            return nil, strformat( 'script returned invalid labels: ' ..
+                                   'label#%d must be a non-empty string', i )
+        elseif seen[label] then
+            return nil, strformat( 'script returned invalid labels: ' ..
+                                   'label %q is duplicated', label )
+        end
+        seen[label] = true
+    end
+
+    return labels
+end
+
+
 --- eval
 -- @param chunk
 -- @return fn
+-- @return labels
 -- @return err
 local function eval( chunk )
     local fn, err = loadchunk.string( chunk, ENV )
 
     if err then
-        return nil, err
+        return nil, nil, err
     end
 
-    local ok, handler = pcall( fn )
+    local ok, handler, labels = pcall( fn )
     if not ok then
-        return nil, handler
+        return nil, nil, handler
     elseif type( handler ) ~= 'function' then
-        return nil, 'script returned an invalid handler'
+        return nil, nil, 'script returned an invalid handler'
+    end
+
+    labels, err = checkLabels( labels )
+    if err then
+        return nil, nil, err
     end
 
-    return handler
+    return handler, labels
 end
 
 
 --- compileFunc
 -- @param fn
 -- @return chunk
+-- @return labels
 -- @return err
 local function compileFunc( fn )
     local chunk, err = strdump( fn )
-    local _
+    local _, labels
 
     if err then
-        return nil, err
+        return nil, nil, err
     end
 
     -- pre-evaluate
-    _, err = eval( chunk )
+    _, labels, err = eval( chunk )
     if err then
-        return nil, err
+        return nil, nil, err
     end
 
-    return chunk
+    return chunk, labels
 end
 
 
 --- compileFile
 -- @param pathname
 -- @return chunk
+-- @return labels
 -- @return err
 local function compileFile( pathname )
     local fullpath, err = realpath( pathname )
     local fn
 
     if err then
-        return nil, err
+        return nil, nil, err
     elseif not fullpath then
-        return nil, strformat( '%q not found', pathname )
+        return nil, nil, strformat( '%q not found', pathname )
     end
 
     fn, err = loadchunk.file( fullpath )
     if err then
-        return nil, err
+        return nil, nil, err
     end
 
     return compileFunc( fn )
@@ -104,12 +144,13 @@ end
 -- @param src
 -- @param ident
 -- @return chunk
+-- @return labels
 -- @return err
 local function compileString( src, ident )
     local fn, err = loadchunk.string( src, nil, ident )
 
     if err then
-        return nil, err
+        return nil, nil, err
     end
 
     return compileFunc( fn )
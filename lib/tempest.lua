@@ -10,11 +10,24 @@
 --- file scope variables
 require('tempest.bootstrap')
 local killpg = require('signal').killpg
+local gettimeofday = require('process').gettimeofday
 local tosiunit = require('tempest.util').tosiunit
 local Stats = require('tempest.stats')
+local Timeline = require('tempest.timeline')
 local Worker = require('tempest.worker')
+local floor = math.floor
+local min = math.min
+local sort = table.sort
 local strformat = string.format
 --- constants
+-- maximum number of steps of the find-max mode
+local MAX_STEPS = 20
+-- the generator is considered as saturated if a worker used more than 90%
+-- of a cpu, or the p99 event-loop lag exceeded 1 ms and 10% of the p50
+-- latency
+local CPU_SATURATED = 0.9
+local LOOP_LAG_MIN = 1
+local LOOP_LAG_RATIO = 0.1
 local WIDTH = 0.5
 local NGRAF = 100 * WIDTH
 local HYPHENS = ''
@@ -59,6 +72,246 @@ local function toReadable( n )
 end
 
 
+--- printPercentiles
+-- @param latency
+local function printPercentiles( latency )
+    for i = 1, #latency.percentiles do
+        local p = latency.percentiles[i]
+
+        printf( '%11s: %.2f ms', strformat( 'p%g', p.percentile ), p.msec )
+    end
+end
+
+
+--- printLatencies
+-- @param name
+-- @param cols
+-- @param key field name or index of percentiles
+local function printLatencies( name, cols, key )
+    local line = strformat( '%11s:', name )
+
+    for i = 1, #cols do
+        local v = cols[i][key]
+
+        if type( key ) == 'number' then
+            v = cols[i].percentiles[key]
+            v = v and v.msec
+        end
+
+        if v then
+            line = line .. strformat( ' %9.2f ms', v )
+        else
+            line = line .. strformat( ' %12s', '-' )
+        end
+    end
+
+    print( line )
+end
+
+
+--- percentileOf
+-- @param summary
+-- @param pct
+-- @return msec
+local function percentileOf( summary, pct )
+    for i = 1, #summary.percentiles do
+        local p = summary.percentiles[i]
+
+        if p.percentile == pct then
+            return p.msec
+        end
+    end
+end
+
+
+--- printGenerator
+-- prints the cpu time per request and the event-loop lag of each worker,
+-- and warns if the generator rather than the target was the bottleneck
+-- @param stats
+local function printGenerator( stats )
+    local p50 = percentileOf( stats.latency, 50 ) or 0
+    local saturated = {}
+
+    printf( '[Generator]\n%11s %9s %12s %12s %12s %12s', 'worker', 'cpu',
+            'cpu/req', 'loop p50', 'loop p99', 'loop max' )
+    for i = 1, #stats.workers do
+        local w = stats.workers[i]
+        local line = strformat( '%11s:', strformat( '#%d', i ) )
+        local lag99
+
+        if w.utime then
+            local cpu = w.utime + w.stime
+
+            line = line .. strformat( ' %7.2f %%', cpu / w.elapsed * 100 )
+            if w.nreq > 0 then
+                line = line .. strformat( ' %9.2f us', cpu / w.nreq * 1000000 )
+            else
+                line = line .. strformat( ' %12s', '-' )
+            end
+            if cpu / w.elapsed >= CPU_SATURATED then
+                saturated[#saturated + 1] = strformat(
+                    'worker #%d used %.1f %% of a cpu', i,
+                    cpu / w.elapsed * 100
+                )
+            end
+        else
+            line = line .. strformat( ' %9s %12s', '-', '-' )
+        end
+
+        if w.loop and w.loop.nreq > 0 then
+            lag99 = percentileOf( w.loop, 99 )
+            line = line .. strformat( ' %9.2f ms %9.2f ms %9.2f ms',
+                                      percentileOf( w.loop, 50 ) or 0,
+                                      lag99 or 0, w.loop.max )
+            if lag99 and lag99 >= LOOP_LAG_MIN and
+               lag99 >= p50 * LOOP_LAG_RATIO then
+                saturated[#saturated + 1] = strformat(
+                    'worker #%d resumed the coroutines %.2f ms late at p99',
+                    i, lag99
+                )
+            end
+        else
+            line = line .. strformat( ' %12s %12s %12s', '-', '-', '-' )
+        end
+        print( line )
+    end
+    print('')
+
+    if #saturated > 0 then
+        print('WARNING: the generator was the bottleneck, and the latency ' ..
+              'includes the time waiting')
+        print('         for the worker; add workers or reduce clients')
+        for i = 1, #saturated do
+            print( '         - ' .. saturated[i] )
+        end
+        print('')
+    end
+end
+
+
+--- printLabels
+-- prints the throughput, failures and latency of each label side by side
+-- @param stats
+local function printLabels( stats )
+    local pcts = stats.latency.percentiles
+    local header = strformat( '[Labels]\n%-16s %10s %12s %10s %12s',
+                              'label', 'reqs', 'reqs/s', 'failure', 'avg' )
+
+    for i = 1, #pcts do
+        header = header .. strformat( ' %12s',
+                                      strformat( 'p%g', pcts[i].percentile ) )
+    end
+    print( header )
+
+    for i = 1, #stats.labels do
+        local label = stats.labels[i]
+        local latency = label.latency
+        local line = strformat( '%-16s %10d %12.2f %10d', label.name,
+                                latency.nreq, latency.nreq / stats.elapsed,
+                                label.failure )
+
+        if latency.nreq > 0 then
+            line = line .. strformat( ' %9.2f ms', latency.avg )
+            for j = 1, #pcts do
+                line = line .. strformat( ' %9.2f ms',
+                                          latency.percentiles[j].msec )
+            end
+        else
+            line = line .. strformat( ' %12s', '-' )
+            for _ = 1, #pcts do
+                line = line .. strformat( ' %12s', '-' )
+            end
+        end
+        print( line )
+    end
+    print('')
+end
+
+
+--- printStatus
+-- prints the number of responses by HTTP status class and code
+-- @param stats
+local function printStatus( stats )
+    local class
+
+    print('[Status]')
+    for i = 1, #stats.status do
+        local s = stats.status[i]
+        local c = floor( s.code / 100 )
+
+        if c ~= class then
+            local n = 0
+
+            class = c
+            for j = i, #stats.status do
+                if floor( stats.status[j].code / 100 ) ~= c then
+                    break
+                end
+                n = n + stats.status[j].nreq
+            end
+            printf( '%11s: %d', strformat( '%dxx', c ), n )
+        end
+        printf( '%15d: %d', s.code, s.nreq )
+    end
+    print('')
+end
+
+
+--- printFailures
+-- prints the number of failures by errno and the time until they failed
+-- @param stats
+local function printFailures( stats )
+    local failed = stats.failed
+
+    print('[Failures]')
+    for i = 1, #stats.errnos do
+        local e = stats.errnos[i]
+
+        printf( '%11s: %d (%s)', strformat( 'errno %d', e.errno ), e.nreq,
+                e.name or 'closed by peer or unknown' )
+    end
+    if failed.nreq > 0 then
+        printf( '%11s: %d failed', 'total', failed.nreq )
+        printf( '%11s: %.2f ms', 'minimum', failed.min )
+        printf( '%11s: %.2f ms', 'maximum', failed.max )
+        printf( '%11s: %.2f ms', 'average', failed.avg )
+        printPercentiles( failed )
+    end
+    print('')
+end
+
+
+--- printHandshakes
+-- prints the number, rate and latency of the full and resumed TLS
+-- handshakes side by side
+-- @param stats
+local function printHandshakes( stats )
+    local full = stats.handshake
+    local resumed = stats.resumed
+    local total = full.nreq + resumed.nreq
+    local cols = {
+        full,
+        resumed,
+    }
+
+    printf( '[Handshakes]\n%12s %12s %12s', '', 'full', 'resumed' )
+    printf( '%11s: %12d %12d', 'total', full.nreq, resumed.nreq )
+    printf( '%11s: %10.2f/s %10.2f/s', 'rate', full.nreq / stats.elapsed,
+            resumed.nreq / stats.elapsed )
+    printf( '%11s: %10.2f %% %10.2f %%', 'ratio',
+            full.nreq * 100 / total, resumed.nreq * 100 / total )
+    printLatencies( 'minimum', cols, 'min' )
+    printLatencies( 'maximum', cols, 'max' )
+    printLatencies( 'average', cols, 'avg' )
+    -- percentiles are empty if no handshake was recorded
+    local pcts = full.nreq > 0 and full.percentiles or resumed.percentiles
+    for i = 1, #pcts do
+        printLatencies( strformat( 'p%g', pcts[i].percentile ), cols, i )
+    end
+    print('')
+end
+
+
 --- printStats
 -- @param stats
 local function printStats( stats )
@@ -73,6 +326,10 @@ local function printStats( stats )
  total reqs: %d success and %d failure in %f sec
        reqs: %f/s
 
+[Connections]
+      total: %d established
+      conns: %f/s
+
 [Transfer]
  total send: %.4f %s
  total recv: %.4f %s
@@ -89,6 +346,8 @@ local function printStats( stats )
 ]],
         stats.success, stats.failure, stats.elapsed,
         stats.success / stats.elapsed,
+        stats.connect.nreq,
+        stats.connect.nreq / stats.elapsed,
         sbyte, sunit,
         rbyte, runit,
         sbyte_sec, sunit_sec,
@@ -101,26 +360,103 @@ local function printStats( stats )
         stats.einternal
     )
 
-    if #stats.latency_msec_grp > 0 then
+    if stats.binds then
+        local addrs = {}
+
+        for addr in pairs( stats.binds ) do
+            addrs[#addrs + 1] = addr
+        end
+        sort( addrs )
+
+        print('[Source Addresses]')
+        for i = 1, #addrs do
+            printf( '%39s: %d conns', addrs[i], stats.binds[addrs[i]] )
+        end
+        print('')
+    end
+
+    if stats.placement then
+        print('[Workers]')
+        for i = 1, #stats.placement do
+            local w = stats.placement[i]
+
+            printf( '%11s: pid %d on cpu %d (node %d)',
+                    strformat( '#%d', i ), w.pid, w.cpu, w.node )
+        end
+        print('')
+    end
+
+    -- per-label breakdown of multi-step scenarios
+    if stats.labels then
+        printLabels( stats )
+    end
+
+    -- TLS handshakes
+    if stats.handshake.nreq + stats.resumed.nreq > 0 then
+        printHandshakes( stats )
+    end
+
+    -- outcomes of the requests
+    if #stats.status > 0 then
+        printStatus( stats )
+    end
+    if #stats.errnos > 0 or stats.failed.nreq > 0 then
+        printFailures( stats )
+    end
+
+    -- self-diagnostics of the workers
+    if stats.workers then
+        printGenerator( stats )
+    end
+
+    if stats.latency.nreq > 0 then
+        local latency = stats.latency
+        local cols = {
+            stats.connect,
+            stats.ttfb,
+            latency,
+        }
+        local header = strformat( '[Latency]\n%12s %12s %12s %12s', '',
+                                  'connect', 'ttfb', 'ttlb' )
+
+        -- schedule lag of open-loop and replay mode next to the latency to
+        -- tell whether the generator kept up with the timetable
+        if stats.lag.nreq > 0 then
+            cols[4] = stats.lag
+            header = header .. strformat( ' %12s', 'lag' )
+        end
+
+        -- connect, ttfb, ttlb and lag side by side
+        print( header )
+        printLatencies( 'minimum', cols, 'min' )
+        printLatencies( 'maximum', cols, 'max' )
+        printLatencies( 'average', cols, 'avg' )
+        printLatencies( 'stddev', cols, 'stddev' )
+        for i = 1, #latency.percentiles do
+            printLatencies(
+                strformat( 'p%g', latency.percentiles[i].percentile ),
+                cols, i
+            )
+        end
+
+        -- latencies measured from the actual start time in open-loop mode
+        if stats.uncorrected.nreq > 0 then
+            print('')
+            print('[Percentile (uncorrected)]')
+            printPercentiles( stats.uncorrected )
+        end
         printf([[
-[Latency]
-    minimum: %.2f ms
-    maximum: %.2f ms
-    average: %.2f ms
 
 [Histogram]
     latency   #reqs  %s  percentage    time-range
 ------------+-------+%s+-------------+-----------------]],
-            stats.latency_msec[1],
-            stats.latency_msec[#stats.latency_msec],
-            stats.latency_msec.avg,
             GRAPH[0], HYPHENS
         )
 
         -- histogram
         for i = 1, #stats.latency_msec_grp do
             local mgrp = stats.latency_msec_grp[i]
-            local ratio = mgrp.nreq / stats.success
+            local ratio = mgrp.nreq / latency.nreq
             local n, sunit = tosiunit( mgrp.nreq )
 
             printf(
@@ -137,6 +473,74 @@ local function printStats( stats )
 end
 
 
+--- printFindMax
+-- prints the throughput-vs-latency curve of the steps in ascending order
+-- of the value, and the highest operating point that meets the SLOs
+-- @param result
+-- @param opts
+local function printFindMax( result, opts )
+    local steps = {}
+    local header = strformat( '[Find Max]\n%12s %12s %9s', result.unit,
+                              'reqs/s', 'failure' )
+
+    for i = 1, #opts.slo do
+        header = header .. strformat( ' %12s',
+                                      strformat( 'p%g', opts.slo[i].pct ) )
+    end
+    print( header .. '  slo' )
+
+    for i = 1, #result.steps do
+        steps[i] = result.steps[i]
+    end
+    sort( steps, function( a, b )
+        return a.value < b.value
+    end )
+
+    for i = 1, #steps do
+        local stats = steps[i].stats
+        local total = stats.success + stats.failure
+        local line = strformat( '%12d %12.2f %7.2f %%', steps[i].value,
+                                stats.success / stats.elapsed,
+                                total > 0 and stats.failure / total * 100 or 0 )
+
+        for j = 1, #opts.slo do
+            local p = stats.latency.percentiles[opts.slo[j].idx]
+
+            if p then
+                line = line .. strformat( ' %9.2f ms', p.msec )
+            else
+                line = line .. strformat( ' %12s', '-' )
+            end
+        end
+        print( line .. ( steps[i].ok and '  ok' or '  violated' ) )
+    end
+
+    print('')
+    if result.best then
+        local best = result.best
+
+        printf( '        max: %d %s at %f req/s', best.value, result.unit,
+                best.stats.success / best.stats.elapsed )
+    else
+        print('        max: no step met the SLOs')
+    end
+    print('')
+end
+
+
+--- nameLabels
+-- sets the names of the labels of measure calls to the stats
+-- @param stats
+-- @param labels
+local function nameLabels( stats, labels )
+    if stats.labels then
+        for i = 1, #stats.labels do
+            stats.labels[i].name = labels[i]
+        end
+    end
+end
+
+
 --- collectStats
 -- @param stats
 -- @param workers
@@ -154,6 +558,39 @@ local function collectStats( stats, workers, msec )
             timeout = timeout
         }
         if stat then
+            -- number of connections per local address
+            if stat.binds then
+                local binds = stats.binds or {}
+
+                for addr, n in pairs( stat.binds ) do
+                    binds[addr] = ( binds[addr] or 0 ) + n
+                end
+                stats.binds = binds
+            end
+
+            -- cpu time and event-loop lag of the worker
+            stats.workers = stats.workers or {}
+            stats.workers[#stats.workers + 1] = {
+                pid = workers[i].pid,
+                elapsed = stat.elapsed,
+                nreq = stat.nreq,
+                utime = stat.utime,
+                stime = stat.stime,
+                loop = stat.loop,
+            }
+
+            -- placement of the worker
+            if stat.cpu then
+                local placement = stats.placement or {}
+
+                placement[#placement + 1] = {
+                    pid = workers[i].pid,
+                    cpu = stat.cpu,
+                    node = stat.node,
+                }
+                stats.placement = placement
+            end
+
             if stats.started == 0 or stats.started > stat.started then
                 stats.started = stat.started
             end
@@ -178,17 +615,63 @@ local function closeWorkers( workers )
 end
 
 
---- class
-local Tempest = {}
+--- writeTimeline
+-- writes the per-interval snapshots that are drained from the stats into
+-- the timeline
+-- @param stats
+-- @param timeline
+-- @param flush
+-- @return ok
+-- @return err
+local function writeTimeline( stats, timeline, flush )
+    local rows, err = stats:drain( flush )
 
+    if not rows then
+        return false, err
+    end
 
---- execute
+    return timeline:write( rows )
+end
+
+
+--- sigwaitTimeline
+-- waits for the duration while writing the per-interval snapshots into the
+-- timeline at every interval
+-- @param stats
+-- @param timeline
 -- @param opts
--- @param msec
--- @return stats
+-- @return signo
 -- @return err
 -- @return timeout
-function Tempest:execute( opts, msec )
+local function sigwaitTimeline( stats, timeline, opts )
+    local deadline = gettimeofday() + opts.duration / 1000
+    local remain = opts.duration
+
+    while remain > 0 do
+        local signo, err, timeout = sigwait( min( opts.interval, remain ),
+                                             SIGINT )
+
+        if not timeout then
+            return signo, err, timeout
+        end
+
+        local ok, werr = writeTimeline( stats, timeline )
+        if not ok then
+            return nil, 'failed to write timeline: ' .. tostring( werr )
+        end
+        remain = floor( ( deadline - gettimeofday() ) * 1000 )
+    end
+
+    return nil, nil, true
+end
+
+
+--- createWorkers
+-- @param self
+-- @param opts
+-- @return workers
+-- @return err
+local function createWorkers( self, opts )
     local workers = {}
     local client = opts.client
     local surplus = client % self.nworker
@@ -203,7 +686,13 @@ function Tempest:execute( opts, msec )
             opts.nclient = nclient
         end
 
-        -- create worker
+        -- open-loop mode: share the request rate among workers
+        if opts.rate then
+            opts.wrate = opts.rate / self.nworker
+        end
+
+        -- create worker that records into the i-th shard of stats
+        opts.wid = i
         local w, err, again = Worker.new( self.stats, opts )
 
         if not w then
@@ -217,40 +706,298 @@ function Tempest:execute( opts, msec )
         workers[i] = w
     end
 
-    -- start all workers
-    sleep(500)
+    return workers
+end
+
+
+--- runStep
+-- runs a step of the find-max mode with the number of active clients and
+-- the request rate. the stats is reset at the beginning of each step.
+-- @param self
+-- @param workers
+-- @param opts
+-- @param nclient
+-- @param rate
+-- @return stats
+-- @return err
+local function runStep( self, workers, opts, nclient, rate )
+    local nworker = #workers
+    local surplus = nclient % nworker
+    local share = ( nclient - surplus ) / nworker
+    local _, err, timeout, started, stopped
+
+    self.stats:reset()
+    for i = 1, nworker do
+        local ok
+        ok, err, timeout = workers[i]:request({
+            nclient = i <= surplus and share + 1 or share,
+            rate = rate and rate / nworker,
+        }, 1000 )
+        if not ok then
+            return nil, strformat( 'failed to start a step: %s',
+                                   tostring( err or timeout and 'timeout' ) )
+        end
+    end
+
+    if opts.warmup > 0 then
+        _, err, timeout = sigwait( opts.warmup, SIGINT )
+        if err or not timeout then
+            return nil, err or 'aborted'
+        end
+    end
+    started = self.stats:start()
+    _, err, timeout = sigwait( opts.duration, SIGINT )
+    stopped = self.stats:stop()
+    if err or not timeout then
+        return nil, err or 'aborted'
+    end
+
+    local stats = self.stats:data( opts.slopcts )
+    stats.elapsed = ( stopped - started ) / 1000000000
+    return stats
+end
+
+
+--- checkStep
+-- returns true if the step meets the error budget and the latency SLOs
+-- @param stats
+-- @param opts
+-- @return ok
+local function checkStep( stats, opts )
+    local total = stats.success + stats.failure
+
+    if total == 0 or
+       stats.failure / total * 100 > opts.errorbudget then
+        return false
+    end
+
+    for i = 1, #opts.slo do
+        local p = stats.latency.percentiles[opts.slo[i].idx]
+
+        if not p or p.msec > opts.slo[i].msec then
+            return false
+        end
+    end
+
+    return true
+end
+
+
+--- class
+local Tempest = {}
+
+
+--- clock
+-- @param name
+-- @return resolution
+-- @return overhead
+-- @return err
+function Tempest:clock( name )
+    local resolution, overhead = self.stats:clock( name )
+
+    if not resolution then
+        return nil, nil, overhead
+    end
+
+    return resolution, overhead
+end
+
+
+--- execute
+-- @param opts
+-- @param msec
+-- @return stats
+-- @return err
+-- @return timeout
+function Tempest:execute( opts, msec )
+    local workers, timeline, werr
+
+    if opts.timeline then
+        local err
+
+        timeline, err = Timeline.new( opts.timeline, opts.interval )
+        if not timeline then
+            return nil, err
+        end
+    end
+
+    workers, werr = createWorkers( self, opts )
+    if not workers then
+        if timeline then
+            timeline:close()
+        end
+        return nil, werr
+    end
+
+    -- start all workers at the shared start time in distributed mode
+    if opts.startat then
+        local delay = floor( ( opts.startat - gettimeofday() ) * 1000 )
+
+        if delay > 0 then
+            sleep( delay )
+        end
+    else
+        sleep(500)
+    end
+
+    -- the recordings are discarded until the stats is started, so the
+    -- ramp-up and warm-up traffic is excluded from the results
+    local lead = opts.ramp + opts.warmup
+    if lead == 0 then
+        self.stats:start()
+    end
     local ok, err = killpg( SIGUSR1 )
     if not ok then
         closeWorkers( workers )
+        if timeline then
+            timeline:close()
+        end
         return nil, err
     end
 
+    local _, serr, timeout
+    if lead > 0 then
+        _, serr, timeout = sigwait( lead, SIGINT )
+        if serr or not timeout then
+            closeWorkers( workers )
+            if timeline then
+                timeline:close()
+            end
+            return nil, serr or 'aborted'
+        end
+        self.stats:start()
+    end
+
     -- wait
-    local _, serr, timeout = sigwait( opts.duration, SIGINT )
+    if timeline then
+        _, serr, timeout = sigwaitTimeline( self.stats, timeline, opts )
+    else
+        _, serr, timeout = sigwait( opts.duration, SIGINT )
+    end
 
-    if serr then
-        closeWorkers( workers )
-        return nil, err
-    elseif not timeout then
+    if serr or not timeout then
         closeWorkers( workers )
-        return nil, 'aborted'
+        if timeline then
+            timeline:close()
+        end
+        return nil, serr or 'aborted'
     end
 
-    -- collect stats
-    local stats = collectStats( self.stats:data(), workers, msec )
+    if timeline then
+        -- write the last interval before the recordings are stopped
+        local ok, werr = writeTimeline( self.stats, timeline, true )
+        if not ok then
+            log.err( 'failed to write timeline:', werr )
+        end
+        timeline:close()
+    end
+    -- collect stats after the recordings are stopped so that the counters
+    -- and the histograms agree with each other
+    self.stats:stop()
+    local stats = collectStats( self.stats:data( opts.percentiles ), workers,
+                                msec )
     closeWorkers( workers )
+    nameLabels( stats, opts.labels )
 
     return stats
 end
 
 
+--- findMax
+-- searches the highest number of clients, or the highest request rate in
+-- open-loop mode, that meets the SLOs. the value is doubled until the
+-- SLOs are violated and then the knee is bisected. the workers are forked
+-- once and reused across the steps.
+-- @param opts
+-- @return result
+-- @return err
+function Tempest:findMax( opts )
+    -- search the request rate with all clients in open-loop mode
+    local upper = opts.rate or opts.client
+    local value = floor( upper / 64 )
+    local steps = {}
+    local lo, hi, best, err, workers
+
+    if value < 1 then
+        value = 1
+    end
+
+    -- workers wait for the steps without the start signal
+    workers, err = createWorkers( self, opts )
+    if not workers then
+        return nil, err
+    end
+
+    while value and #steps < MAX_STEPS do
+        local stats
+
+        if opts.rate then
+            stats, err = runStep( self, workers, opts, opts.client, value )
+        else
+            stats, err = runStep( self, workers, opts, value )
+        end
+        if not stats then
+            closeWorkers( workers )
+            return nil, err
+        end
+
+        local ok = checkStep( stats, opts )
+        steps[#steps + 1] = {
+            value = value,
+            ok = ok,
+            stats = stats,
+        }
+        if ok then
+            lo = value
+            if not best or stats.success / stats.elapsed >
+                           best.stats.success / best.stats.elapsed then
+                best = steps[#steps]
+            end
+        else
+            hi = value
+        end
+
+        -- double until violated, then bisect the knee within 5 percent
+        if not hi then
+            value = value < upper and min( value * 2, upper ) or nil
+        else
+            local low = lo or 0
+            local mid = floor( ( low + hi ) / 2 )
+
+            value = nil
+            if hi - low > 1 and hi - low > low * 0.05 and mid > low then
+                value = mid
+            end
+        end
+    end
+    closeWorkers( workers )
+
+    return {
+        unit = opts.rate and 'req/s' or 'clients',
+        steps = steps,
+        best = best,
+    }
+end
+
+
+--- encode
+-- @return str
+-- @return err
+function Tempest:encode()
+    return self.stats:encode()
+end
+
+
 --- new
 -- @param nworker
 -- @param msec
+-- @param sigdigs
+-- @param interval
+-- @param nlabel
 -- @return tempest
 -- @return err
-local function new( nworker, msec )
-    local stats, err = Stats.new( msec )
+local function new( nworker, msec, sigdigs, interval, nlabel )
+    local stats, err = Stats.new( msec, sigdigs, nworker, interval, nlabel )
 
     if err then
         return nil, err
@@ -267,6 +1014,8 @@ end
 
 return {
     new = new,
+    nameLabels = nameLabels,
+    printFindMax = printFindMax,
     printStats = printStats,
 }
 
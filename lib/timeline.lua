@@ -0,0 +1,80 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  lib/timeline.lua
+  tempest
+  Created by Masatoshi Fukunaga on 18/09/12
+
+--]]
+
+--- file scope variables
+local open = io.open
+local strformat = string.format
+--- constants
+local HEADER = '#elapsed\tsuccess\tfailure\tbytes_sent\tbytes_recv' ..
+               '\tp50\tp90\tp99\tp99.9\tp99.99\tmax\n'
+local ROWFMT = '%.3f\t%d\t%d\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n'
+
+
+--- class
+local Timeline = {}
+
+
+--- write
+-- @param rows
+-- @return ok
+-- @return err
+function Timeline:write( rows )
+    local file = self.file
+
+    for i = 1, #rows do
+        local row = rows[i]
+        local ok, err = file:write( strformat( ROWFMT,
+            row.elapsed, row.success, row.failure, row.bytesSent,
+            row.bytesRecv, row.p50, row.p90, row.p99, row.p999, row.p9999,
+            row.max
+        ))
+
+        if not ok then
+            return false, err
+        end
+    end
+
+    return true
+end
+
+
+--- close
+function Timeline:close()
+    self.file:close()
+end
+
+
+--- new
+-- @param pathname
+-- @param interval
+-- @return timeline
+-- @return err
+local function new( pathname, interval )
+    local file, err = open( pathname, 'w' )
+
+    if not file then
+        return nil, err
+    end
+
+    -- latencies are written in milliseconds
+    file:setvbuf( 'line' )
+    file:write( strformat( '#interval: %d ms\n', interval ), HEADER )
+
+    return setmetatable({
+        file = file,
+    }, {
+        __index = Timeline
+    })
+end
+
+
+return {
+    new = new
+}
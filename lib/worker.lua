@@ -12,22 +12,78 @@ local kill = require('signal').kill
 local gettimeofday = require('process').gettimeofday
 local eval = require('tempest.script').eval
 local IPC = require('tempest.ipc')
+local Affinity = require('tempest.affinity')
+local Binder = require('tempest.binder')
 local Connection = require('tempest.connection')
+local Socket = require('tempest.socket')
 local Handler = require('tempest.handler')
+local Replay = require('tempest.replay')
+local Scheduler = require('tempest.scheduler')
+local rusage = require('tempest.timer').rusage
+local floor = math.floor
+local strformat = string.format
+local tostring = tostring
+--- constants
+-- message of the built-in echo handler
+local ECHO_MESSAGE = 'hello!'
+-- interval of the event-loop lag probe in milliseconds
+local PROBE_INTERVAL = 10
+local NSEC_PER_MSEC = 1000000
+
+
+--- probeLoop
+-- records the event-loop lag, how late the coroutine is resumed after its
+-- timer expired. it is the time that the handlers of this worker wait in
+-- the run queue of the event loop, which is included in their latency.
+-- @param stats
+local function probeLoop( stats )
+    while true do
+        local deadline = stats:now() + PROBE_INTERVAL * NSEC_PER_MSEC
+        local lag
+
+        sleep( PROBE_INTERVAL )
+        lag = stats:now() - deadline
+        stats:recordLoopLag( lag > 0 and lag or 0 )
+    end
+end
+
+
+--- rampUp
+-- releases the clients linearly over the ramp time. the clients of the
+-- workers are interleaved to spread the connection storm evenly.
+-- @param cids
+-- @param opts
+local function rampUp( cids, opts )
+    local n = #cids * opts.worker
+    local started = gettimeofday()
+
+    for i = 1, #cids do
+        local at = opts.ramp * ( ( i - 1 ) * opts.worker + opts.wid - 1 ) / n
+        local delay = floor( at - ( gettimeofday() - started ) * 1000 )
+
+        if delay > 0 then
+            sleep( delay )
+        end
+        resume( cids[i].cid )
+    end
+end
 
 
 --- spawnHandler
 -- @param stats
 -- @param opts
+-- @param sched
+-- @param binder
+-- @param ring
 -- @return cids
 -- @return err
-local function spawnHandler( stats, opts )
+local function spawnHandler( stats, opts, sched, binder, ring )
     local cids = {}
 
     -- create clients
     for i = 1, opts.nclient do
-        local conn = Connection.new( stats, opts )
-        local cid, err = spawn( Handler, conn, opts.script )
+        local conn = Connection.new( stats, opts, binder, ring )
+        local cid, err = spawn( Handler, conn, opts.script, sched )
 
         if err then
             return nil, err
@@ -42,23 +98,161 @@ local function spawnHandler( stats, opts )
 end
 
 
+--- newEngine
+-- creates the native engine of the built-in echo or fixed GET scenario
+-- @param stats
+-- @param opts
+-- @return engine
+-- @return err
+local function newEngine( stats, opts )
+    -- native engine is only available on linux
+    local Engine = require('tempest.engine')
+    local host, err = Socket.resolve( opts.host )
+    local req = ECHO_MESSAGE
+
+    if not host then
+        return nil, err
+    elseif opts.get then
+        req = strformat( 'GET %s HTTP/1.1\r\nHost: %s:%d\r\n\r\n', opts.get,
+                         opts.host, opts.port )
+    end
+
+    return Engine.new( stats, {
+        host = host,
+        port = opts.port,
+        request = req,
+        nclient = opts.nclient,
+        http = opts.get ~= nil,
+        churn = opts.churn,
+        rcvtimeo = opts.rcvtimeo,
+        sndtimeo = opts.sndtimeo,
+    })
+end
+
+
+--- handleSteps
+-- changes the number of active clients and the request rate at each step
+-- of the find-max mode until the parent closes the channel.
+-- @param ipc
+-- @param cids
+-- @param sched
+-- @return err
+local function handleSteps( ipc, cids, sched )
+    while true do
+        local req, err = ipc:accept()
+        local ok, timeout
+
+        -- closed by parent
+        if not req then
+            return err
+        end
+
+        -- the first nclient clients are active in this step
+        for i = 1, #cids do
+            if i <= req.nclient then
+                cids[i].conn:activate()
+            else
+                cids[i].conn:park()
+            end
+        end
+        if sched and req.rate then
+            sched:rate( req.rate )
+        end
+
+        ok, err, timeout = ipc:ok( 1000 )
+        if not ok then
+            return 'failed to reply to parent: ' ..
+                   tostring( err or timeout and 'timeout' or
+                             'closed by peer' )
+        end
+    end
+end
+
+
 --- handleRequest
 -- @param ipc
 -- @param stats
 -- @param opts
 -- @return err
 local function handleRequest( ipc, stats, opts )
-    local cids, err = spawnHandler( stats, opts )
     local wstat = {}
+    local sched, binder, ring, engine, cids, err
+
+    -- used for the reconnection backoff and the poisson arrivals
+    math.randomseed( floor( gettimeofday() * 1000 ) + opts.wid )
+    -- open-loop mode: clients share the timetable of this worker
+    if opts.wrate then
+        sched = Scheduler.new( stats, opts.wrate, opts.poisson )
+    -- replay mode: clients share the shard of the replay log
+    elseif opts.replay then
+        sched, err = Replay.new( stats, opts )
+        if not sched then
+            return 'failed to open replay log: ' .. err
+        end
+    end
+
+    -- each worker starts the sequential selection at the different entry
+    if opts.corpusmap then
+        opts.corpusmap:seed( opts.wid, floor( ( opts.wid - 1 ) *
+                                              #opts.corpusmap / opts.worker ) )
+    end
+
+    -- clients of this worker resume the TLS session that is stored into the
+    -- session file of this worker
+    if opts.tlsresume then
+        local fd, ok
+        fd, err = Socket.tmpfd()
+        if not fd then
+            return 'failed to create a TLS session file: ' .. err
+        end
+        ok, err = opts.tlscfg:set_session_fd( fd )
+        if not ok then
+            return 'failed to set a TLS session file: ' .. tostring( err )
+        end
+    end
+
+    -- spread the connections across the local addresses
+    if opts.bindaddrs then
+        binder = Binder.new( opts.bindaddrs, opts.wid - 1 )
+    end
+
+    -- clients of this worker share the io_uring
+    if opts.uring then
+        ring, err = require('tempest.ring').new()
+        if not ring then
+            log.warn( 'io_uring is not available, fallback to default:', err )
+        end
+    end
+
+    -- native engine drives the connections without handlers
+    if opts.native then
+        cids = {}
+        engine, err = newEngine( stats, opts )
+    else
+        cids, err = spawnHandler( stats, opts, sched, binder, ring )
+    end
 
     if err then
         return err
+    -- native engine does not yield to the event loop while running
+    elseif not engine then
+        local _
+        _, err = spawn( probeLoop, stats )
+        if err then
+            return err
+        end
     end
 
     local ok
     ok, err = ipc:pong()
     if not ok then
         return err
+    -- find-max mode: the parent drives the steps
+    elseif opts.findmax then
+        if sched then
+            sched:start()
+        end
+        return handleSteps( ipc, cids, sched )
     end
 
     -- wait signal
@@ -72,14 +266,67 @@ local function handleRequest( ipc, stats, opts )
     end
 
     -- resume all handlers
-    for i = 1, #cids do
-        resume( cids[i].cid )
+    if sched then
+        sched:start()
+    end
+    if opts.ramp > 0 and #cids > 0 then
+        local _
+        _, err = spawn( rampUp, cids, opts )
+        if err then
+            return err
+        end
+    else
+        for i = 1, #cids do
+            resume( cids[i].cid )
+        end
     end
 
-    wstat.started = gettimeofday()
-    signo, err = sigwait( opts.duration, SIGQUIT )
+    -- the measurement starts after the ramp-up and warm-up phase
+    local lead = opts.ramp + opts.warmup
+    local utime, stime
+    wstat.started = gettimeofday() + lead / 1000
+    if engine then
+        local _
+        -- cpu time of the native engine includes the warm-up
+        utime, stime = rusage()
+        _, err = engine:run( lead + opts.duration )
+        if err == 'aborted' then
+            signo, err = SIGQUIT, nil
+        end
+    else
+        if lead > 0 then
+            signo, err = sigwait( lead, SIGQUIT )
+        end
+        if not err and signo ~= SIGQUIT then
+            utime, stime = rusage()
+            signo, err = sigwait( opts.duration, SIGQUIT )
+        end
+    end
     wstat.stopped = gettimeofday()
     wstat.elapsed = wstat.stopped - wstat.started
+    -- cpu time and event-loop lag of this worker
+    if utime then
+        local u, s = rusage()
+
+        wstat.utime = u - utime
+        wstat.stime = s - stime
+    end
+    -- failed requests also cost the cpu time of this worker
+    do
+        local nsucc, nfail = stats:counts()
+
+        wstat.nreq = nsucc + nfail
+    end
+    wstat.loop = stats:hist('loop')
+    -- number of connections per local address
+    if binder then
+        wstat.binds = binder.nconn
+    end
+    -- placement of this worker
+    if opts.cpus then
+        wstat.cpu = opts.cpus[opts.wid]
+        wstat.node = Affinity.node( wstat.cpu )
+    end
 
     -- abort all connections
     for i = 1, #cids do
@@ -113,9 +360,32 @@ end
 -- @param stats
 -- @param opts
 local function handleWorker( ipc, stats, opts )
-    local err
+    local err, _
+
+    -- pin to the dedicated cpu before touching the shard of stats
+    if opts.cpus then
+        local ok, perr = Affinity.pin( opts.cpus[opts.wid] )
+
+        if not ok then
+            err = 'failed to pin to cpu: ' .. perr
+        end
+    end
+
+    if not err then
+        -- labels are declared by the script and resolved by the parent
+        opts.script, _, err = eval( opts.chunk )
+    end
+    -- labels are recorded by their index in the stats
+    if not err and opts.labels then
+        opts.labelids = {}
+        for id = 1, #opts.labels do
+            opts.labelids[opts.labels[id]] = id
+        end
+    end
+    if not err and not stats:shard( opts.wid ) then
+        err = 'failed to select a shard of stats'
+    end
 
-    opts.script, err = eval( opts.chunk )
     if not err then
         err = handleRequest( ipc, stats, opts )
     end
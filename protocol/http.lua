@@ -9,6 +9,7 @@
 --]]
 --- file-scope variables
 local HttpRequest = require('net.http.request')
+local Http = require('tempest.http')
 local setmetatable = setmetatable
 local getmetatable = getmetatable
 local HttpRequestSendto
@@ -17,16 +18,27 @@ local HttpRequestSendto
 --- sendto
 -- @param req
 -- @param conn
--- @param res
--- @param err
--- @param timeout
+-- @return res
+-- @return err
+-- @return timeout
 local function sendto( req, conn )
+    local res, err, timeout
+
     conn:measure()
-    return HttpRequestSendto( req, conn )
+    res, err, timeout = HttpRequestSendto( req, conn )
+    -- count the status code of the response
+    if res and res.status then
+        conn:status( res.status )
+    end
+
+    return res, err, timeout
 end
 
 
-return setmetatable({}, {
+return setmetatable({
+    -- pre-serialized request template for conn:request
+    template = Http.template,
+}, {
     __index = function( _, method )
         local fn = HttpRequest[method]
 
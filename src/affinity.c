@@ -0,0 +1,253 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/affinity.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/24.
+ */
+
+#define _GNU_SOURCE
+#include "tempest.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/**
+ * node_lua
+ *  returns the NUMA node of the cpu, or 0 if the system does not expose
+ *  the NUMA topology.
+ */
+static int node_lua( lua_State *L )
+{
+    uint32_t cpu = lauxh_checkuint32( L, 1 );
+    char path[PATH_MAX];
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+    int node = 0;
+
+    snprintf( path, PATH_MAX, "/sys/devices/system/cpu/cpu%u", cpu );
+    if( ( dir = opendir( path ) ) )
+    {
+        // the directory contains a link named "node<N>"
+        while( ( entry = readdir( dir ) ) ){
+            if( sscanf( entry->d_name, "node%d", &node ) == 1 ){
+                break;
+            }
+            node = 0;
+        }
+        closedir( dir );
+    }
+    lua_pushinteger( L, node );
+
+    return 1;
+}
+
+
+#if defined(__linux__)
+
+/**
+ * parse_cpulist
+ *  parses the list of cpus in the format of "0-3,8,10-11" into set.
+ *  returns -1 if the list is malformed or out of range.
+ */
+static int parse_cpulist( const char *str, cpu_set_t *set )
+{
+    const char *p = str;
+
+    CPU_ZERO( set );
+    while( *p && *p != '\n' )
+    {
+        char *end = NULL;
+        unsigned long head = strtoul( p, &end, 10 );
+        unsigned long tail = head;
+
+        if( end == p || head >= CPU_SETSIZE ){
+            return -1;
+        }
+        else if( *end == '-' ){
+            p = end + 1;
+            tail = strtoul( p, &end, 10 );
+            if( end == p || tail < head || tail >= CPU_SETSIZE ){
+                return -1;
+            }
+        }
+
+        for(; head <= tail; head++ ){
+            CPU_SET( head, set );
+        }
+
+        if( *end == ',' ){
+            end++;
+        }
+        else if( *end && *end != '\n' ){
+            return -1;
+        }
+        p = end;
+    }
+
+    return 0;
+}
+
+
+/**
+ * push_cpuset
+ *  pushes an array of the cpus in ascending order.
+ */
+static void push_cpuset( lua_State *L, cpu_set_t *set )
+{
+    int i = 0;
+    int n = 0;
+
+    lua_createtable( L, CPU_COUNT( set ), 0 );
+    for(; i < CPU_SETSIZE; i++ ){
+        if( CPU_ISSET( i, set ) ){
+            n++;
+            lauxh_pushnum2arr( L, n, i );
+        }
+    }
+}
+
+
+/**
+ * parse_lua
+ *  returns an array of the cpus of the list.
+ */
+static int parse_lua( lua_State *L )
+{
+    const char *str = lauxh_checkstring( L, 1 );
+    cpu_set_t set;
+
+    if( parse_cpulist( str, &set ) || CPU_COUNT( &set ) == 0 ){
+        lua_pushnil( L );
+        lua_pushfstring( L, "invalid cpu list %q", str );
+        return 2;
+    }
+    push_cpuset( L, &set );
+
+    return 1;
+}
+
+
+/**
+ * cpus_lua
+ *  returns an array of the cpus that the process is allowed to run on.
+ */
+static int cpus_lua( lua_State *L )
+{
+    cpu_set_t set;
+
+    if( sched_getaffinity( 0, sizeof( set ), &set ) == -1 ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    push_cpuset( L, &set );
+
+    return 1;
+}
+
+
+/**
+ * pin_lua
+ *  binds the calling process to the cpu.
+ */
+static int pin_lua( lua_State *L )
+{
+    uint32_t cpu = lauxh_checkuint32( L, 1 );
+    cpu_set_t set;
+
+    if( cpu >= CPU_SETSIZE ){
+        return lauxh_argerror( L, 1, "cpu must be less than %d",
+                               CPU_SETSIZE );
+    }
+
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    if( sched_setaffinity( 0, sizeof( set ), &set ) == -1 ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+/**
+ * current_lua
+ *  returns the cpu that the calling process is running on.
+ */
+static int current_lua( lua_State *L )
+{
+    int cpu = sched_getcpu();
+
+    if( cpu == -1 ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    lua_pushinteger( L, cpu );
+
+    return 1;
+}
+
+#define AFFINITY_SUPPORTED  1
+
+#else
+
+/**
+ * unsupported_lua
+ *  the cpu affinity of a process is only supported on linux.
+ */
+static int unsupported_lua( lua_State *L )
+{
+    lua_pushnil( L );
+    lua_pushliteral( L, "cpu affinity is not supported on this platform" );
+    return 2;
+}
+
+#define parse_lua           unsupported_lua
+#define cpus_lua            unsupported_lua
+#define pin_lua             unsupported_lua
+#define current_lua         unsupported_lua
+#define AFFINITY_SUPPORTED  0
+
+#endif
+
+
+LUALIB_API int luaopen_tempest_affinity( lua_State *L )
+{
+    // create module table
+    lua_newtable( L );
+    lauxh_pushbool2tbl( L, "supported", AFFINITY_SUPPORTED );
+    lauxh_pushfn2tbl( L, "parse", parse_lua );
+    lauxh_pushfn2tbl( L, "cpus", cpus_lua );
+    lauxh_pushfn2tbl( L, "node", node_lua );
+    lauxh_pushfn2tbl( L, "pin", pin_lua );
+    lauxh_pushfn2tbl( L, "current", current_lua );
+
+    return 1;
+}
@@ -28,11 +28,65 @@
 #include "tempest.h"
 
 
+#define ARRAY_MAGIC     "TMPA"
+
+
+/**
+ * decode_header
+ *  checks the magic and version, and returns the length of the array.
+ */
+static int decode_header( tempest_dec_t *d, uint64_t *len )
+{
+    if( d->end - d->cur < TEMPEST_ENC_MAGICLEN + 1 ||
+        memcmp( d->cur, ARRAY_MAGIC, TEMPEST_ENC_MAGICLEN ) != 0 ||
+        d->cur[TEMPEST_ENC_MAGICLEN] != TEMPEST_ENC_VERSION ){
+        return -1;
+    }
+    d->cur += TEMPEST_ENC_MAGICLEN + 1;
+
+    return tempest_dec_varint( d, len );
+}
+
+
+/**
+ * merge_lua
+ *  adds the counters of other array or encoded string to the array. the
+ *  encoded string is merged without decoding into a dense array.
+ */
 static int merge_lua( lua_State *L )
 {
     tempest_array_t *arr = lauxh_checkudata( L, 1, TEMPEST_ARRAY_MT );
 
-    if( arr->data ){
+    if( !arr->data ){
+        lua_pushboolean( L, 0 );
+    }
+    else if( lua_type( L, 2 ) == LUA_TSTRING )
+    {
+        size_t nbyte = 0;
+        const uint8_t *str = (const uint8_t*)lua_tolstring( L, 2, &nbyte );
+        tempest_dec_t d = {
+            .cur = str,
+            .end = str + nbyte
+        };
+        uint64_t len = 0;
+        tempest_dec_t body;
+
+        if( decode_header( &d, &len ) || len != arr->len ){
+            lua_pushboolean( L, 0 );
+            lua_pushliteral( L, "invalid encoded array" );
+            return 2;
+        }
+        // validate before merging to avoid partial update
+        body = d;
+        if( tempest_dec_sparse( &d, NULL, sizeof( uint32_t ), len ) ){
+            lua_pushboolean( L, 0 );
+            lua_pushliteral( L, "invalid encoded array" );
+            return 2;
+        }
+        tempest_dec_sparse( &body, arr->data, sizeof( uint32_t ), len );
+        lua_pushboolean( L, 1 );
+    }
+    else {
         tempest_array_t *src = lauxh_checkudata( L, 2, TEMPEST_ARRAY_MT );
         size_t i = 0;
 
@@ -42,23 +96,41 @@ static int merge_lua( lua_State *L )
 
         lua_pushboolean( L, 1 );
     }
-    else {
-        lua_pushboolean( L, 0 );
-    }
 
     return 1;
 }
 
 
+/**
+ * encode_lua
+ *  returns the sparse encoded string of the array.
+ */
 static int encode_lua( lua_State *L )
 {
     tempest_array_t *arr = lauxh_checkudata( L, 1, TEMPEST_ARRAY_MT );
 
-    if( arr->data ){
-        lua_settop( L, 0 );
-        lua_pushlstring( L, (char*)&arr->len, sizeof( size_t ) );
-        lua_pushlstring( L, (char*)arr->data, arr->len * sizeof( uint32_t ) );
-        lua_concat( L, 2 );
+    if( arr->data )
+    {
+        size_t nnz = tempest_enc_nnz( arr->data, sizeof( uint32_t ),
+                                      arr->len );
+        size_t nbyte = TEMPEST_ENC_MAGICLEN + 1 + TEMPEST_VARINT_MAXLEN +
+                       ( nnz * 2 + 1 ) * TEMPEST_VARINT_MAXLEN;
+        uint8_t *buf = malloc( nbyte );
+
+        if( !buf ){
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            return 2;
+        }
+
+        memcpy( buf, ARRAY_MAGIC, TEMPEST_ENC_MAGICLEN );
+        nbyte = TEMPEST_ENC_MAGICLEN;
+        buf[nbyte++] = TEMPEST_ENC_VERSION;
+        nbyte += tempest_enc_varint( buf + nbyte, arr->len );
+        nbyte += tempest_enc_sparse( buf + nbyte, arr->data,
+                                     sizeof( uint32_t ), arr->len, nnz );
+        lua_pushlstring( L, (const char*)buf, nbyte );
+        free( (void*)buf );
     }
     else {
         lua_pushnil( L );
@@ -181,28 +253,30 @@ static int new_lua( lua_State *L )
 static int decode_lua( lua_State *L )
 {
     size_t nbyte = 0;
-    const char *data = lauxh_checklstring( L, 1, &nbyte );
+    const uint8_t *str = (const uint8_t*)lauxh_checklstring( L, 1, &nbyte );
+    tempest_dec_t d = {
+        .cur = str,
+        .end = str + nbyte
+    };
+    tempest_dec_t body;
     tempest_array_t *arr = NULL;
-    size_t len = 0;
+    uint64_t len = 0;
 
-    if( nbyte < sizeof( size_t ) ){
+    if( decode_header( &d, &len ) || len > SIZE_MAX / sizeof( uint32_t ) ){
         lua_pushnil( L );
         return 1;
     }
-
-    len = *(size_t*)data;
-    nbyte -= sizeof( size_t );
-    data += sizeof( size_t );
-    if( nbyte != len * sizeof( uint32_t ) ){
+    body = d;
+    if( tempest_dec_sparse( &d, NULL, sizeof( uint32_t ), len ) ){
         lua_pushnil( L );
         return 1;
     }
 
     arr = lua_newuserdata( L, sizeof( tempest_array_t ) );
     arr->len = len;
-    arr->data = malloc( nbyte );
+    arr->data = calloc( len, sizeof( uint32_t ) );
     if( arr->data ){
-        memcpy( (void*)arr->data, (void*)data, nbyte );
+        tempest_dec_sparse( &body, arr->data, sizeof( uint32_t ), len );
         lauxh_setmetatable( L, TEMPEST_ARRAY_MT );
         return 1;
     }
@@ -0,0 +1,546 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/corpus.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/27.
+ */
+
+#include "tempest.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**
+ * zipf sampler
+ *  rejection-inversion sampling of Hörmann and Derflinger; it draws a rank
+ *  in constant time without the table of cumulative probabilities.
+ */
+
+static inline double zipf_helper1( double x )
+{
+    if( fabs( x ) > 1e-8 ){
+        return log1p( x ) / x;
+    }
+    return 1 - x * ( 0.5 - x * ( 1.0 / 3.0 - 0.25 * x ) );
+}
+
+
+static inline double zipf_helper2( double x )
+{
+    if( fabs( x ) > 1e-8 ){
+        return expm1( x ) / x;
+    }
+    return 1 + x * 0.5 * ( 1 + x / 3.0 * ( 1 + 0.25 * x ) );
+}
+
+
+static inline double zipf_h( double s, double x )
+{
+    return exp( -s * log( x ) );
+}
+
+
+static inline double zipf_hintegral( double s, double x )
+{
+    double lx = log( x );
+    return zipf_helper2( ( 1 - s ) * lx ) * lx;
+}
+
+
+static inline double zipf_hintegral_inv( double s, double x )
+{
+    double t = x * ( 1 - s );
+
+    if( t < -1 ){
+        t = -1;
+    }
+    return exp( zipf_helper1( t ) * x );
+}
+
+
+static void zipf_init( tempest_corpus_t *c, double s )
+{
+    c->exponent = s;
+    c->hx1 = zipf_hintegral( s, 1.5 ) - 1;
+    c->hn = zipf_hintegral( s, (double)c->nentry + 0.5 );
+    c->sv = 2 - zipf_hintegral_inv( s, zipf_hintegral( s, 2.5 ) -
+                                       zipf_h( s, 2 ) );
+}
+
+
+/**
+ * rand01
+ *  returns a uniform random number in [0, 1) by xorshift64*.
+ */
+static inline double rand01( tempest_corpus_t *c )
+{
+    uint64_t x = c->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    c->rng = x;
+
+    return (double)( ( x * 0x2545F4914F6CDD1DULL ) >> 11 ) * 0x1.0p-53;
+}
+
+
+/**
+ * zipf_next
+ *  returns the 0-based index whose rank is zipf-distributed.
+ */
+static size_t zipf_next( tempest_corpus_t *c )
+{
+    double s = c->exponent;
+
+    while( 1 )
+    {
+        double u = c->hn + rand01( c ) * ( c->hx1 - c->hn );
+        double x = zipf_hintegral_inv( s, u );
+        double k = floor( x + 0.5 );
+
+        if( k < 1 ){
+            k = 1;
+        }
+        else if( k > (double)c->nentry ){
+            k = (double)c->nentry;
+        }
+
+        if( k - x <= c->sv ||
+            u >= zipf_hintegral( s, k + 0.5 ) - zipf_h( s, k ) ){
+            return (size_t)k - 1;
+        }
+    }
+}
+
+
+/**
+ * push_entry
+ *  sets the entry of index to the userdata at idx, or to a new userdata if
+ *  it is not specified.
+ */
+static int push_entry( lua_State *L, tempest_corpus_t *c, size_t i, int idx )
+{
+    tempest_corpus_entry_t *e = NULL;
+
+    if( lua_isnoneornil( L, idx ) ){
+        e = lua_newuserdata( L, sizeof( tempest_corpus_entry_t ) );
+        e->ref = LUA_NOREF;
+        e->corpus = NULL;
+        lauxh_setmetatable( L, TEMPEST_CORPUS_ENTRY_MT );
+    }
+    else {
+        e = lauxh_checkudata( L, idx, TEMPEST_CORPUS_ENTRY_MT );
+        lua_settop( L, idx );
+    }
+
+    // retain the corpus while the entry refers to it
+    if( e->corpus != c ){
+        lauxh_unref( L, e->ref );
+        lua_pushvalue( L, 1 );
+        e->ref = lauxh_ref( L );
+        e->corpus = c;
+    }
+    e->data = c->data + c->offs[i];
+    e->len = c->offs[i + 1] - c->offs[i];
+
+    return 1;
+}
+
+
+static int next_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+    size_t i = c->seq;
+
+    c->seq = ( i + 1 ) % c->nentry;
+
+    return push_entry( L, c, i, 2 );
+}
+
+
+static int uniform_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+    size_t i = (size_t)( rand01( c ) * (double)c->nentry );
+
+    return push_entry( L, c, i, 2 );
+}
+
+
+static int zipf_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+
+    return push_entry( L, c, zipf_next( c ), 2 );
+}
+
+
+/**
+ * get_lua
+ *  returns the entry of 1-based index.
+ */
+static int get_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+    uint64_t i = lauxh_checkuint64( L, 2 );
+
+    if( i < 1 || i > c->nentry ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    return push_entry( L, c, i - 1, 3 );
+}
+
+
+/**
+ * seed_lua
+ *  sets the seed of random selection and the start index of sequential
+ *  selection of the calling process.
+ */
+static int seed_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+    uint64_t seed = lauxh_checkuint64( L, 2 );
+    uint64_t start = lauxh_optuint64( L, 3, 0 );
+
+    // splitmix64 to avoid the zero state
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = ( seed ^ ( seed >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+    seed = ( seed ^ ( seed >> 27 ) ) * 0x94D049BB133111EBULL;
+    c->rng = ( seed ^ ( seed >> 31 ) ) | 1;
+    c->seq = start % c->nentry;
+
+    return 0;
+}
+
+
+static int len_lua( lua_State *L )
+{
+    tempest_corpus_t *c = lauxh_checkudata( L, 1, TEMPEST_CORPUS_MT );
+
+    lua_pushinteger( L, c->nentry );
+
+    return 1;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_CORPUS_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int gc_lua( lua_State *L )
+{
+    tempest_corpus_t *c = (tempest_corpus_t*)lua_touserdata( L, 1 );
+
+    if( c->addr ){
+        munmap( c->addr, c->size );
+    }
+
+    return 0;
+}
+
+
+static int entry_len_lua( lua_State *L )
+{
+    tempest_corpus_entry_t *e = lauxh_checkudata( L, 1,
+                                                  TEMPEST_CORPUS_ENTRY_MT );
+
+    lua_pushinteger( L, e->len );
+
+    return 1;
+}
+
+
+/**
+ * entry_data_lua
+ *  returns a copy of the entry as string.
+ */
+static int entry_data_lua( lua_State *L )
+{
+    tempest_corpus_entry_t *e = lauxh_checkudata( L, 1,
+                                                  TEMPEST_CORPUS_ENTRY_MT );
+
+    lua_pushlstring( L, e->data, e->len );
+
+    return 1;
+}
+
+
+static int entry_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_CORPUS_ENTRY_MT ": %p",
+                     lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int entry_gc_lua( lua_State *L )
+{
+    tempest_corpus_entry_t *e = (tempest_corpus_entry_t*)lua_touserdata( L,
+                                                                        1 );
+
+    lauxh_unref( L, e->ref );
+
+    return 0;
+}
+
+
+/**
+ * verify
+ *  checks the header and the index of the mapped file.
+ */
+static const char *verify( tempest_corpus_t *c )
+{
+    const tempest_corpus_hdr_t *hdr = (const tempest_corpus_hdr_t*)c->addr;
+    size_t dlen = 0;
+    size_t i = 0;
+
+    if( c->size < sizeof( tempest_corpus_hdr_t ) ||
+        memcmp( hdr->magic, TEMPEST_CORPUS_MAGIC,
+                sizeof( TEMPEST_CORPUS_MAGIC ) ) ){
+        return "not a corpus file";
+    }
+    else if( hdr->version != TEMPEST_CORPUS_VERSION ){
+        return "unsupported version of corpus file";
+    }
+    else if( hdr->nentry == 0 ){
+        return "corpus file has no entry";
+    }
+    else if( hdr->nentry > ( c->size - sizeof( tempest_corpus_hdr_t ) ) /
+                           sizeof( uint64_t ) - 1 ){
+        return "corpus file is truncated";
+    }
+
+    c->nentry = hdr->nentry;
+    c->offs = (const uint64_t*)( hdr + 1 );
+    c->data = (const char*)( c->offs + c->nentry + 1 );
+    dlen = c->size - (size_t)( c->data - (const char*)c->addr );
+    if( c->offs[0] != 0 ){
+        return "corpus file has a broken index";
+    }
+    for(; i < c->nentry; i++ ){
+        if( c->offs[i + 1] < c->offs[i] || c->offs[i + 1] > dlen ){
+            return "corpus file has a broken index";
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * open_lua
+ *  maps the corpus file. the pages are populated at this time to avoid the
+ *  page faults during the measurement, and the mapping is inherited by the
+ *  forked workers.
+ */
+static int open_lua( lua_State *L )
+{
+    const char *path = lauxh_checkstring( L, 1 );
+    double s = lauxh_optnumber( L, 2, 1.0 );
+    tempest_corpus_t *c = NULL;
+    const char *errmsg = NULL;
+    struct stat st;
+    int fd = 0;
+
+    if( s <= 0 ){
+        return lauxh_argerror( L, 2, "exponent must be greater than 0" );
+    }
+
+    c = lua_newuserdata( L, sizeof( tempest_corpus_t ) );
+    memset( (void*)c, 0, sizeof( tempest_corpus_t ) );
+    lauxh_setmetatable( L, TEMPEST_CORPUS_MT );
+
+    if( ( fd = open( path, O_RDONLY|O_CLOEXEC ) ) == -1 ){
+        errmsg = strerror( errno );
+    }
+    else if( fstat( fd, &st ) == -1 ){
+        errmsg = strerror( errno );
+    }
+    else if( st.st_size < (off_t)sizeof( tempest_corpus_hdr_t ) ){
+        errmsg = "not a corpus file";
+    }
+    else if( ( c->addr = mmap( NULL, (size_t)st.st_size, PROT_READ,
+                               MAP_SHARED|MAP_POPULATE, fd,
+                               0 ) ) == MAP_FAILED ){
+        c->addr = NULL;
+        errmsg = strerror( errno );
+    }
+    else {
+        c->size = (size_t)st.st_size;
+        errmsg = verify( c );
+    }
+    if( fd != -1 ){
+        close( fd );
+    }
+
+    if( errmsg ){
+        lua_pushnil( L );
+        lua_pushstring( L, errmsg );
+        return 2;
+    }
+    c->rng = 1;
+    zipf_init( c, s );
+
+    return 1;
+}
+
+
+/**
+ * build_lua
+ *  writes the array of strings to the pathname as an indexed corpus file.
+ */
+static int build_lua( lua_State *L )
+{
+    const char *path = lauxh_checkstring( L, 1 );
+    tempest_corpus_hdr_t hdr = {
+        .magic = TEMPEST_CORPUS_MAGIC,
+        .version = TEMPEST_CORPUS_VERSION,
+    };
+    uint64_t off = 0;
+    size_t len = 0;
+    size_t i = 1;
+    FILE *fp = NULL;
+    int rc = 0;
+
+    lauxh_checktable( L, 2 );
+    hdr.nentry = lua_objlen( L, 2 );
+    for(; i <= hdr.nentry; i++ ){
+        lua_rawgeti( L, 2, (int)i );
+        if( lua_type( L, -1 ) != LUA_TSTRING ){
+            return lauxh_argerror( L, 2, "entry#%d must be string", (int)i );
+        }
+        lua_pop( L, 1 );
+    }
+
+    if( !( fp = fopen( path, "w" ) ) ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    // header and index
+    rc = fwrite( &hdr, sizeof( hdr ), 1, fp ) != 1 ||
+         fwrite( &off, sizeof( off ), 1, fp ) != 1;
+    for( i = 1; !rc && i <= hdr.nentry; i++ ){
+        lua_rawgeti( L, 2, (int)i );
+        lua_tolstring( L, -1, &len );
+        lua_pop( L, 1 );
+        off += len;
+        rc = fwrite( &off, sizeof( off ), 1, fp ) != 1;
+    }
+    // data
+    for( i = 1; !rc && i <= hdr.nentry; i++ ){
+        const char *str = NULL;
+
+        lua_rawgeti( L, 2, (int)i );
+        str = lua_tolstring( L, -1, &len );
+        rc = len && fwrite( str, len, 1, fp ) != 1;
+        lua_pop( L, 1 );
+    }
+
+    if( fclose( fp ) || rc ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+static void createmt( lua_State *L, const char *tname, struct luaL_Reg mmethod[],
+                      struct luaL_Reg method[] )
+{
+    // create metatable
+    if( luaL_newmetatable( L, tname ) )
+    {
+        struct luaL_Reg *ptr = mmethod;
+
+        // metamethods
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        // methods
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        ptr = method;
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        lua_rawset( L, -3 );
+    }
+    lua_pop( L, 1 );
+}
+
+
+LUALIB_API int luaopen_tempest_corpus( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", gc_lua },
+        { "__len", len_lua },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "len", len_lua },
+        { "seed", seed_lua },
+        { "get", get_lua },
+        { "next", next_lua },
+        { "uniform", uniform_lua },
+        { "zipf", zipf_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg entry_mmethod[] = {
+        { "__gc", entry_gc_lua },
+        { "__len", entry_len_lua },
+        { "__tostring", entry_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg entry_method[] = {
+        { "len", entry_len_lua },
+        { "data", entry_data_lua },
+        { NULL, NULL }
+    };
+
+    createmt( L, TEMPEST_CORPUS_MT, mmethod, method );
+    createmt( L, TEMPEST_CORPUS_ENTRY_MT, entry_mmethod, entry_method );
+
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "open", open_lua );
+    lauxh_pushfn2tbl( L, "build", build_lua );
+
+    return 1;
+}
@@ -0,0 +1,681 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/engine.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/25.
+ */
+
+#include "tempest.h"
+#include <netdb.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// the native engine is driven by epoll(7)
+#if defined(__linux__)
+#include <sys/epoll.h>
+
+
+#define ENGINE_NEVENT       256
+// interval of checking the timeouts and signal in nanoseconds
+#define ENGINE_TICK         10000000ULL
+// range of the backoff time of reconnection in nanoseconds
+#define ENGINE_BACKOFF_MIN  10000000ULL
+#define ENGINE_BACKOFF_MAX  1000000000ULL
+// receive buffer of echo mode
+#define ENGINE_RCVSIZE      16384
+
+
+// update the per-interval snapshot as well
+#define engine_count(e,field,now) do{ \
+    tempest_stats_slot_t *slot = tempest_stats_slot( (e)->stats, (now) ); \
+    if( tempest_stats_measuring( (e)->stats ) ){ \
+        (e)->stats->data->field++; \
+    } \
+    if( slot ){ \
+        slot->field++; \
+    } \
+}while(0)
+
+
+#define engine_add(e,field,now,v) do{ \
+    tempest_stats_slot_t *slot = tempest_stats_slot( (e)->stats, (now) ); \
+    if( tempest_stats_measuring( (e)->stats ) ){ \
+        (e)->stats->data->field += (v); \
+    } \
+    if( slot ){ \
+        slot->field += (v); \
+    } \
+}while(0)
+
+
+static void conn_connect( tempest_engine_t *e, tempest_engine_conn_t *c,
+                          uint64_t now );
+static void conn_request( tempest_engine_t *e, tempest_engine_conn_t *c,
+                          uint64_t now );
+
+
+static inline void set_events( tempest_engine_t *e, tempest_engine_conn_t *c,
+                               uint32_t events )
+{
+    if( c->events != events ){
+        struct epoll_event ev = {
+            .events = events,
+            .data.u32 = (uint32_t)( c - e->conns )
+        };
+
+        epoll_ctl( e->epfd, EPOLL_CTL_MOD, c->fd, &ev );
+        c->events = events;
+    }
+}
+
+
+static inline void conn_close( tempest_engine_conn_t *c )
+{
+    if( c->fd != -1 ){
+        close( c->fd );
+        c->fd = -1;
+    }
+    c->state = TEMPEST_ENGINE_IDLE;
+    c->events = 0;
+    c->deadline = 0;
+    tempest_http_reset( &c->parser, 0, 1 );
+}
+
+
+/**
+ * conn_backoff
+ *  closes the connection that failed to connect, and waits for the
+ *  jittered exponential backoff time before reconnecting.
+ */
+static void conn_backoff( tempest_engine_t *e, tempest_engine_conn_t *c,
+                          uint64_t now )
+{
+    conn_close( c );
+    if( tempest_stats_measuring( e->stats ) ){
+        e->stats->data->econnect++;
+    }
+    if( !c->backoff ){
+        c->backoff = ENGINE_BACKOFF_MIN;
+    }
+    else if( ( c->backoff <<= 1 ) > ENGINE_BACKOFF_MAX ){
+        c->backoff = ENGINE_BACKOFF_MAX;
+    }
+
+    // xorshift64
+    e->seed ^= e->seed << 13;
+    e->seed ^= e->seed >> 7;
+    e->seed ^= e->seed << 17;
+    c->deadline = now + c->backoff / 2 + e->seed % ( c->backoff / 2 + 1 );
+}
+
+
+/**
+ * conn_fail
+ *  counts the failed request by errno, records the time until it failed,
+ *  and reconnects.
+ */
+#define conn_fail(e,c,field,now,err) do{ \
+    if( tempest_stats_measuring( (e)->stats ) ){ \
+        (e)->stats->data->field++; \
+    } \
+    tempest_stats_errno( (e)->stats, (err) ); \
+    tempest_stats_record( (e)->stats, TEMPEST_HIST_FAILURE, \
+                          (now) - (c)->since ); \
+    engine_count( e, failure, now ); \
+    conn_close( c ); \
+    conn_connect( e, c, now ); \
+}while(0)
+
+
+static void conn_connect( tempest_engine_t *e, tempest_engine_conn_t *c,
+                          uint64_t now )
+{
+    struct epoll_event ev = {
+        .events = EPOLLOUT,
+        .data.u32 = (uint32_t)( c - e->conns )
+    };
+    int opt = 1;
+
+    c->fd = socket( e->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                    0 );
+    if( c->fd == -1 ){
+        conn_backoff( e, c, now );
+        return;
+    }
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof( opt ) );
+    // avoid TIME_WAIT of the connections that are closed in churn mode
+    if( e->churn ){
+        struct linger l = {
+            .l_onoff = 1,
+            .l_linger = 0
+        };
+        setsockopt( c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof( l ) );
+    }
+
+    if( ( connect( c->fd, (struct sockaddr*)&e->addr, e->addrlen ) == -1 &&
+          errno != EINPROGRESS ) ||
+        epoll_ctl( e->epfd, EPOLL_CTL_ADD, c->fd, &ev ) == -1 ){
+        conn_backoff( e, c, now );
+        return;
+    }
+    c->state = TEMPEST_ENGINE_CONNECTING;
+    c->events = EPOLLOUT;
+    c->since = now;
+    c->deadline = now + e->sndtimeo;
+}
+
+
+static void conn_connected( tempest_engine_t *e, tempest_engine_conn_t *c,
+                            uint64_t now )
+{
+    int err = 0;
+    socklen_t len = sizeof( err );
+
+    if( getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len ) == -1 || err ){
+        conn_backoff( e, c, now );
+        return;
+    }
+    tempest_stats_record( e->stats, TEMPEST_HIST_CONNECT, now - c->since );
+    c->backoff = 0;
+    c->nreq = 0;
+    conn_request( e, c, now );
+}
+
+
+static void conn_send( tempest_engine_t *e, tempest_engine_conn_t *c,
+                       uint64_t now )
+{
+    while( c->sent < e->reqlen )
+    {
+        ssize_t n = write( c->fd, e->req + c->sent, e->reqlen - c->sent );
+
+        if( n > 0 ){
+            c->sent += n;
+        }
+        else if( errno == EINTR ){
+            continue;
+        }
+        else if( errno == EAGAIN || errno == EWOULDBLOCK ){
+            c->state = TEMPEST_ENGINE_SENDING;
+            c->deadline = now + e->sndtimeo;
+            set_events( e, c, EPOLLOUT );
+            return;
+        }
+        else {
+            conn_fail( e, c, esend, now, errno );
+            return;
+        }
+    }
+
+    engine_add( e, bytes_sent, now, e->reqlen );
+    c->state = TEMPEST_ENGINE_RECEIVING;
+    c->deadline = now + e->rcvtimeo;
+    set_events( e, c, EPOLLIN );
+}
+
+
+static void conn_request( tempest_engine_t *e, tempest_engine_conn_t *c,
+                          uint64_t now )
+{
+    c->since = now;
+    c->ttfb = 0;
+    c->sent = 0;
+    c->nrecv = 0;
+    tempest_http_reset( &c->parser, 0, 0 );
+    conn_send( e, c, now );
+}
+
+
+static void conn_complete( tempest_engine_t *e, tempest_engine_conn_t *c,
+                           uint64_t now )
+{
+    tempest_stats_record( e->stats, TEMPEST_HIST_LATENCY, now - c->since );
+    tempest_stats_record_slot( e->stats, now, now - c->since );
+    if( c->ttfb ){
+        tempest_stats_record( e->stats, TEMPEST_HIST_TTFB, c->ttfb - c->since );
+    }
+    if( e->http ){
+        tempest_stats_status( e->stats, c->parser.status );
+    }
+    engine_count( e, success, now );
+
+    // reconnect every churn requests or if the server closes
+    c->nreq++;
+    if( ( e->churn && c->nreq >= e->churn ) ||
+        ( e->http && !c->parser.keepalive ) ){
+        conn_close( c );
+        conn_connect( e, c, now );
+    }
+    else {
+        conn_request( e, c, now );
+    }
+}
+
+
+static void conn_recv( tempest_engine_t *e, tempest_engine_conn_t *c,
+                       uint64_t now )
+{
+    static char rbuf[ENGINE_RCVSIZE];
+    tempest_http_parser_t *p = &c->parser;
+
+    while( 1 )
+    {
+        ssize_t n = 0;
+
+        if( e->http )
+        {
+            if( tempest_http_prepare( p, TEMPEST_HTTP_BUFSIZE / 2 ) ){
+                conn_fail( e, c, einternal, now, errno );
+                return;
+            }
+            n = read( c->fd, p->buf + p->len, p->cap - p->len );
+        }
+        else {
+            n = read( c->fd, rbuf, ENGINE_RCVSIZE );
+        }
+
+        if( n > 0 )
+        {
+            if( !c->ttfb ){
+                c->ttfb = now;
+            }
+            engine_add( e, bytes_recv, now, (uint64_t)n );
+            if( !e->http ){
+                // echo mode: response has the same length as request
+                if( ( c->nrecv += n ) >= e->reqlen ){
+                    conn_complete( e, c, now );
+                    return;
+                }
+                continue;
+            }
+
+            p->len += n;
+            switch( tempest_http_parse( p ) ){
+                case 0:
+                    continue;
+                case 1:
+                    conn_complete( e, c, now );
+                    return;
+                default:
+                    conn_fail( e, c, erecv, now, EPROTO );
+                    return;
+            }
+        }
+        else if( n == 0 )
+        {
+            // response that is terminated by closing connection
+            if( e->http && p->state == TEMPEST_HTTP_BODY_UNTIL_CLOSE ){
+                p->state = TEMPEST_HTTP_DONE;
+                conn_complete( e, c, now );
+                return;
+            }
+            // closed by peer
+            conn_fail( e, c, erecv, now, 0 );
+            return;
+        }
+        else if( errno == EINTR ){
+            continue;
+        }
+        else if( errno != EAGAIN && errno != EWOULDBLOCK ){
+            conn_fail( e, c, erecv, now, errno );
+        }
+        return;
+    }
+}
+
+
+/**
+ * sweep
+ *  reconnects the connections that finished the backoff, and fails the
+ *  requests that timed out.
+ */
+static void sweep( tempest_engine_t *e, uint64_t now )
+{
+    size_t i = 0;
+
+    for(; i < e->nconn; i++ )
+    {
+        tempest_engine_conn_t *c = e->conns + i;
+
+        if( !c->deadline || now < c->deadline ){
+            continue;
+        }
+
+        switch( c->state ){
+            case TEMPEST_ENGINE_IDLE:
+                c->deadline = 0;
+                conn_connect( e, c, now );
+            break;
+            case TEMPEST_ENGINE_CONNECTING:
+                conn_backoff( e, c, now );
+            break;
+            case TEMPEST_ENGINE_SENDING:
+                conn_fail( e, c, esend_timeo, now, ETIMEDOUT );
+            break;
+            case TEMPEST_ENGINE_RECEIVING:
+                conn_fail( e, c, erecv_timeo, now, ETIMEDOUT );
+            break;
+        }
+    }
+}
+
+
+static inline int is_aborted( void )
+{
+    sigset_t set;
+
+    // SIGQUIT is blocked and kept pending for the caller
+    return sigpending( &set ) == 0 && sigismember( &set, SIGQUIT ) == 1;
+}
+
+
+/**
+ * run_lua
+ *  drives the connections for the duration in milliseconds. the in-flight
+ *  requests at the end of the duration are discarded. returns false and
+ *  "aborted" if the SIGQUIT is pending.
+ */
+static int run_lua( lua_State *L )
+{
+    tempest_engine_t *e = lauxh_checkudata( L, 1, TEMPEST_ENGINE_MT );
+    uint64_t msec = lauxh_checkuint32( L, 2 );
+    struct epoll_event evs[ENGINE_NEVENT];
+    uint64_t now = tempest_stats_now( e->stats );
+    uint64_t deadline = now + msec * 1000000;
+    uint64_t tick = now + ENGINE_TICK;
+    int aborted = 0;
+    size_t i = 0;
+
+    for(; i < e->nconn; i++ ){
+        if( e->conns[i].fd == -1 ){
+            conn_connect( e, e->conns + i, now );
+        }
+    }
+
+    while( now < deadline )
+    {
+        int timeout = (int)( ( ( tick < deadline ? tick : deadline ) - now ) /
+                             1000000 ) + 1;
+        int n = epoll_wait( e->epfd, evs, ENGINE_NEVENT, timeout );
+        int j = 0;
+
+        if( n == -1 && errno != EINTR ){
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            return 2;
+        }
+
+        for(; j < n; j++ )
+        {
+            tempest_engine_conn_t *c = e->conns + evs[j].data.u32;
+
+            now = tempest_stats_now( e->stats );
+            switch( c->state ){
+                case TEMPEST_ENGINE_CONNECTING:
+                    conn_connected( e, c, now );
+                break;
+                case TEMPEST_ENGINE_SENDING:
+                    conn_send( e, c, now );
+                break;
+                case TEMPEST_ENGINE_RECEIVING:
+                    conn_recv( e, c, now );
+                break;
+                default:
+                break;
+            }
+        }
+
+        now = tempest_stats_now( e->stats );
+        if( now >= tick ){
+            if( ( aborted = is_aborted() ) ){
+                break;
+            }
+            sweep( e, now );
+            tick = now + ENGINE_TICK;
+        }
+    }
+
+    // discard in-flight requests
+    for( i = 0; i < e->nconn; i++ ){
+        conn_close( e->conns + i );
+        e->conns[i].backoff = 0;
+    }
+
+    if( aborted ){
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "aborted" );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_ENGINE_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int gc_lua( lua_State *L )
+{
+    tempest_engine_t *e = (tempest_engine_t*)lua_touserdata( L, 1 );
+    size_t i = 0;
+
+    if( e->conns ){
+        for(; i < e->nconn; i++ ){
+            conn_close( e->conns + i );
+            if( e->conns[i].parser.buf ){
+                free( (void*)e->conns[i].parser.buf );
+            }
+        }
+        free( (void*)e->conns );
+    }
+    if( e->req ){
+        free( (void*)e->req );
+    }
+    if( e->epfd != -1 ){
+        close( e->epfd );
+    }
+    lauxh_unref( L, e->ref );
+
+    return 0;
+}
+
+
+static uint32_t optfield( lua_State *L, const char *k, uint32_t def )
+{
+    uint32_t v = def;
+
+    lua_getfield( L, 2, k );
+    if( !lua_isnil( L, -1 ) ){
+        if( !lua_isnumber( L, -1 ) || lua_tonumber( L, -1 ) < 0 ){
+            return luaL_error( L, "%s must be unsigned integer", k );
+        }
+        v = (uint32_t)lua_tonumber( L, -1 );
+    }
+    lua_pop( L, 1 );
+
+    return v;
+}
+
+
+/**
+ * new_lua
+ *  creates the engine of the fixed scenario. the opts table contains the
+ *  following fields;
+ *
+ *  host     : numeric host
+ *  port     : port number
+ *  request  : request message
+ *  nclient  : number of connections
+ *  http     : true if the response is HTTP, otherwise the response is the
+ *             echo of the request
+ *  churn    : reconnect after every churn requests
+ *  rcvtimeo : recv timeout in milliseconds
+ *  sndtimeo : send timeout in milliseconds
+ */
+static int new_lua( lua_State *L )
+{
+    tempest_stats_t *stats = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    const char *host = NULL;
+    const char *port = NULL;
+    const char *req = NULL;
+    size_t reqlen = 0;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV
+    };
+    struct addrinfo *res = NULL;
+    tempest_engine_t *e = NULL;
+    size_t i = 0;
+    int rc = 0;
+
+    lauxh_checktable( L, 2 );
+    lua_settop( L, 2 );
+    lua_getfield( L, 2, "host" );
+    host = lauxh_checkstring( L, 3 );
+    lua_getfield( L, 2, "port" );
+    lauxh_checkinteger( L, 4 );
+    port = lua_tostring( L, 4 );
+    lua_getfield( L, 2, "request" );
+    req = lauxh_checklstring( L, 5, &reqlen );
+    if( !reqlen ){
+        return lauxh_argerror( L, 2, "request must not be empty" );
+    }
+    else if( ( rc = getaddrinfo( host, port, &hints, &res ) ) ){
+        lua_pushnil( L );
+        lua_pushfstring( L, "%s: %s", host, gai_strerror( rc ) );
+        return 2;
+    }
+
+    e = lua_newuserdata( L, sizeof( tempest_engine_t ) );
+    memset( (void*)e, 0, sizeof( tempest_engine_t ) );
+    e->epfd = -1;
+    e->ref = LUA_NOREF;
+    lauxh_setmetatable( L, TEMPEST_ENGINE_MT );
+
+    memcpy( (void*)&e->addr, res->ai_addr, res->ai_addrlen );
+    e->addrlen = res->ai_addrlen;
+    freeaddrinfo( res );
+    e->stats = stats;
+    e->nconn = optfield( L, "nclient", 1 );
+    e->churn = optfield( L, "churn", 0 );
+    e->rcvtimeo = (uint64_t)optfield( L, "rcvtimeo", 5000 ) * 1000000;
+    e->sndtimeo = (uint64_t)optfield( L, "sndtimeo", 5000 ) * 1000000;
+    lua_getfield( L, 2, "http" );
+    e->http = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+    e->seed = (uint64_t)getpid() << 32 | tempest_stats_now( stats );
+    if( !e->seed ){
+        e->seed = 1;
+    }
+
+    if( !e->nconn ||
+        ( e->epfd = epoll_create1( EPOLL_CLOEXEC ) ) == -1 ||
+        !( e->req = malloc( reqlen ) ) ||
+        !( e->conns = calloc( e->nconn, sizeof( tempest_engine_conn_t ) ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( e->nconn ? errno : EINVAL ) );
+        return 2;
+    }
+    memcpy( e->req, req, reqlen );
+    e->reqlen = reqlen;
+    for(; i < e->nconn; i++ ){
+        e->conns[i].fd = -1;
+        // the fixed request is never HEAD
+        tempest_http_reset( &e->conns[i].parser, 0, 1 );
+    }
+
+    // keep the stats alive while the engine is alive
+    lua_pushvalue( L, 1 );
+    e->ref = lauxh_ref( L );
+
+    return 1;
+}
+
+
+LUALIB_API int luaopen_tempest_engine( lua_State *L )
+{
+    // create metatable
+    if( luaL_newmetatable( L, TEMPEST_ENGINE_MT ) )
+    {
+        struct luaL_Reg mmethod[] = {
+            { "__gc", gc_lua },
+            { "__tostring", tostring_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg method[] = {
+            { "run", run_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg *ptr = mmethod;
+
+        // metamethods
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        // methods
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        ptr = method;
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        lua_rawset( L, -3 );
+    }
+    lua_settop( L, 0 );
+
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "new", new_lua );
+
+    return 1;
+}
+
+#else
+
+static int new_lua( lua_State *L )
+{
+    lua_pushnil( L );
+    lua_pushliteral( L, "native engine is not supported on this platform" );
+    return 2;
+}
+
+
+LUALIB_API int luaopen_tempest_engine( lua_State *L )
+{
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "new", new_lua );
+
+    return 1;
+}
+
+#endif
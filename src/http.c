@@ -0,0 +1,691 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/http.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/14.
+ */
+
+#include "tempest.h"
+#include <stdio.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+
+#define TEMPEST_HTTP_MAXSEG     64
+
+
+/**
+ * request template
+ */
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+
+static int strbuf_add( strbuf_t *b, const char *str, size_t len )
+{
+    if( b->len + len > b->cap )
+    {
+        size_t cap = b->cap ? b->cap : 256;
+        char *data = NULL;
+
+        while( cap < b->len + len ){
+            cap *= 2;
+        }
+        if( !( data = realloc( b->data, cap ) ) ){
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy( b->data + b->len, str, len );
+    b->len += len;
+
+    return 0;
+}
+
+#define strbuf_addliteral(b, str) strbuf_add( b, str, sizeof(str) - 1 )
+
+
+static int has_slot( const char *str, size_t len )
+{
+    size_t i = 0;
+
+    for(; i + 3 < len; i++ ){
+        if( str[i] == '$' && str[i+1] == '{' && str[i+2] >= '1' &&
+            str[i+2] <= '9' && str[i+3] == '}' ){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * add_seg
+ *  appends a segment to the template.
+ */
+static int add_seg( tempest_http_tmpl_t *t, int slot, size_t off, size_t len )
+{
+    if( t->nseg >= TEMPEST_HTTP_MAXSEG ){
+        errno = E2BIG;
+        return -1;
+    }
+    else if( slot == TEMPEST_HTTP_SEG_LITERAL && !len ){
+        return 0;
+    }
+    t->segs[t->nseg++] = (tempest_http_seg_t){
+        .slot = slot,
+        .off = off,
+        .len = len
+    };
+
+    return 0;
+}
+
+
+/**
+ * compile
+ *  splits the range of buf into literal segments and `${N}` slot segments.
+ */
+static int compile( tempest_http_tmpl_t *t, size_t off, size_t len )
+{
+    const char *str = t->buf;
+    size_t tail = off + len;
+    size_t head = off;
+    size_t i = off;
+
+    while( i + 3 < tail )
+    {
+        if( str[i] == '$' && str[i+1] == '{' && str[i+2] >= '1' &&
+            str[i+2] <= '9' && str[i+3] == '}' ){
+            if( add_seg( t, TEMPEST_HTTP_SEG_LITERAL, head, i - head ) ||
+                add_seg( t, str[i+2] - '0', 0, 0 ) ){
+                return -1;
+            }
+            i += 4;
+            head = i;
+        }
+        else {
+            i++;
+        }
+    }
+
+    return add_seg( t, TEMPEST_HTTP_SEG_LITERAL, head, tail - head );
+}
+
+
+/**
+ * segment_str
+ *  returns the string of segment. arguments of slots start at index argidx.
+ *  the corpus entry argument refers to the mapped data without copying.
+ */
+static inline const char *segment_str( lua_State *L, tempest_http_tmpl_t *t,
+                                       tempest_http_seg_t *seg, int argidx,
+                                       size_t *len )
+{
+    int idx = argidx + seg->slot - 1;
+    tempest_corpus_entry_t *e = NULL;
+    const char *str = NULL;
+
+    if( seg->slot == TEMPEST_HTTP_SEG_LITERAL ){
+        *len = seg->len;
+        return t->buf + seg->off;
+    }
+    else if( ( e = tempest_corpus_toentry( L, idx ) ) ){
+        *len = e->len;
+        return e->data;
+    }
+    else if( ( str = lua_tolstring( L, idx, len ) ) ){
+        return str;
+    }
+    *len = 0;
+
+    return "";
+}
+
+
+/**
+ * bodylen
+ *  calculates the length of the body that contains the slots.
+ */
+static inline size_t bodylen( lua_State *L, tempest_http_tmpl_t *t,
+                              int argidx )
+{
+    size_t nbyte = 0;
+    size_t len = 0;
+    size_t i = t->body;
+
+    for(; i < t->nseg; i++ ){
+        segment_str( L, t, t->segs + i, argidx, &len );
+        nbyte += len;
+    }
+
+    return nbyte;
+}
+
+
+static int tmpl_writev_lua( lua_State *L )
+{
+    tempest_http_tmpl_t *t = lauxh_checkudata( L, 1, TEMPEST_HTTP_TEMPLATE_MT );
+    int fd = (int)lauxh_checkinteger( L, 2 );
+    struct iovec iov[TEMPEST_HTTP_MAXSEG];
+    char clen[32];
+    size_t total = 0;
+    size_t i = 0;
+    ssize_t rv = 0;
+
+    for(; i < t->nseg; i++ )
+    {
+        tempest_http_seg_t *seg = t->segs + i;
+
+        if( seg->slot == TEMPEST_HTTP_SEG_BODYLEN ){
+            iov[i].iov_len = snprintf( clen, sizeof( clen ), "%zu",
+                                       bodylen( L, t, 3 ) );
+            iov[i].iov_base = (void*)clen;
+        }
+        else {
+            iov[i].iov_base = (void*)segment_str( L, t, seg, 3,
+                                                  &iov[i].iov_len );
+        }
+        total += iov[i].iov_len;
+    }
+
+    while( ( rv = writev( fd, iov, (int)t->nseg ) ) == -1 && errno == EINTR ){
+        continue;
+    }
+    if( rv == -1 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK ){
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            return 2;
+        }
+        rv = 0;
+    }
+
+    // number of bytes sent and the length of the request
+    lua_pushinteger( L, rv );
+    lua_pushinteger( L, total );
+
+    return 2;
+}
+
+
+static int tmpl_render_lua( lua_State *L )
+{
+    tempest_http_tmpl_t *t = lauxh_checkudata( L, 1, TEMPEST_HTTP_TEMPLATE_MT );
+    luaL_Buffer b;
+    char clen[32];
+    size_t len = 0;
+    size_t i = 0;
+
+    luaL_buffinit( L, &b );
+    for(; i < t->nseg; i++ )
+    {
+        tempest_http_seg_t *seg = t->segs + i;
+
+        if( seg->slot == TEMPEST_HTTP_SEG_BODYLEN ){
+            len = snprintf( clen, sizeof( clen ), "%zu", bodylen( L, t, 2 ) );
+            luaL_addlstring( &b, clen, len );
+        }
+        else {
+            const char *str = segment_str( L, t, seg, 2, &len );
+            luaL_addlstring( &b, str, len );
+        }
+    }
+    luaL_pushresult( &b );
+
+    return 1;
+}
+
+
+static int tmpl_ishead_lua( lua_State *L )
+{
+    tempest_http_tmpl_t *t = lauxh_checkudata( L, 1, TEMPEST_HTTP_TEMPLATE_MT );
+
+    lua_pushboolean( L, t->head );
+
+    return 1;
+}
+
+
+static int tmpl_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_HTTP_TEMPLATE_MT ": %p",
+                     lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int tmpl_gc_lua( lua_State *L )
+{
+    tempest_http_tmpl_t *t = (tempest_http_tmpl_t*)lua_touserdata( L, 1 );
+
+    if( t->buf ){
+        free( (void*)t->buf );
+    }
+    if( t->segs ){
+        free( (void*)t->segs );
+    }
+
+    return 0;
+}
+
+
+/**
+ * template_lua
+ *  creates a request template from the method, uri, headers and body.
+ *  `${1}` to `${9}` in the uri, header values and body are substituted with
+ *  the arguments of writev and render methods. the content-length header is
+ *  added automatically if the body is specified.
+ */
+static int template_lua( lua_State *L )
+{
+    size_t mlen = 0;
+    size_t ulen = 0;
+    size_t blen = 0;
+    const char *method = lauxh_checklstring( L, 1, &mlen );
+    const char *uri = lauxh_checklstring( L, 2, &ulen );
+    const char *body = lauxh_optlstring( L, 4, NULL, &blen );
+    strbuf_t b = { 0 };
+    tempest_http_tmpl_t *t = NULL;
+    size_t hlen = 0;
+    int rc = 0;
+
+    if( !lua_isnoneornil( L, 3 ) ){
+        lauxh_checktable( L, 3 );
+    }
+    lua_settop( L, 4 );
+
+    // request-line
+    rc = strbuf_add( &b, method, mlen ) || strbuf_addliteral( &b, " " ) ||
+         strbuf_add( &b, uri, ulen ) ||
+         strbuf_addliteral( &b, " HTTP/1.1\r\n" );
+
+    // headers
+    if( !rc && lua_type( L, 3 ) == LUA_TTABLE )
+    {
+        lua_pushnil( L );
+        while( !rc && lua_next( L, 3 ) )
+        {
+            size_t klen = 0;
+            size_t vlen = 0;
+            const char *val = NULL;
+
+            if( lua_type( L, -1 ) == LUA_TSTRING ||
+                lua_type( L, -1 ) == LUA_TNUMBER ){
+                val = lua_tolstring( L, -1, &vlen );
+                // "name: value" string
+                if( lua_type( L, -2 ) == LUA_TNUMBER ){
+                    rc = strbuf_add( &b, val, vlen ) ||
+                         strbuf_addliteral( &b, "\r\n" );
+                }
+                else if( lua_type( L, -2 ) == LUA_TSTRING ){
+                    const char *key = lua_tolstring( L, -2, &klen );
+
+                    rc = strbuf_add( &b, key, klen ) ||
+                         strbuf_addliteral( &b, ": " ) ||
+                         strbuf_add( &b, val, vlen ) ||
+                         strbuf_addliteral( &b, "\r\n" );
+                }
+            }
+            lua_pop( L, 1 );
+        }
+        lua_settop( L, 4 );
+    }
+
+    t = lua_newuserdata( L, sizeof( tempest_http_tmpl_t ) );
+    memset( (void*)t, 0, sizeof( tempest_http_tmpl_t ) );
+    lauxh_setmetatable( L, TEMPEST_HTTP_TEMPLATE_MT );
+    t->head = mlen == 4 && strncasecmp( method, "HEAD", 4 ) == 0;
+    if( rc || !( t->segs = calloc( TEMPEST_HTTP_MAXSEG,
+                                   sizeof( tempest_http_seg_t ) ) ) ){
+        free( (void*)b.data );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    // static body
+    if( body && !has_slot( body, blen ) )
+    {
+        char clen[64];
+        size_t len = snprintf( clen, sizeof( clen ),
+                               "Content-Length: %zu\r\n\r\n", blen );
+
+        rc = strbuf_add( &b, clen, len ) || strbuf_add( &b, body, blen );
+        t->buf = b.data;
+        t->len = b.len;
+        rc = rc || compile( t, 0, t->len );
+        t->body = t->nseg;
+    }
+    // body that contains the slots
+    else if( body )
+    {
+        hlen = b.len;
+        rc = strbuf_addliteral( &b, "Content-Length: " ) ||
+             strbuf_addliteral( &b, "\r\n\r\n" ) ||
+             strbuf_add( &b, body, blen );
+        t->buf = b.data;
+        t->len = b.len;
+        rc = rc || compile( t, 0, hlen + 16 ) ||
+             add_seg( t, TEMPEST_HTTP_SEG_BODYLEN, 0, 0 ) ||
+             add_seg( t, TEMPEST_HTTP_SEG_LITERAL, hlen + 16, 4 );
+        t->body = t->nseg;
+        rc = rc || compile( t, hlen + 20, blen );
+    }
+    else {
+        rc = strbuf_addliteral( &b, "\r\n" );
+        t->buf = b.data;
+        t->len = b.len;
+        rc = rc || compile( t, 0, t->len );
+        t->body = t->nseg;
+    }
+
+    if( rc ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    return 1;
+}
+
+
+/**
+ * response parser
+ */
+
+static inline int push_result( lua_State *L, tempest_http_parser_t *p,
+                               int rc )
+{
+    if( rc == 1 ){
+        lua_pushinteger( L, p->status );
+        return 1;
+    }
+    else if( rc == 0 ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+
+    lua_pushnil( L );
+    lua_pushliteral( L, "malformed response" );
+    return 2;
+}
+
+
+/**
+ * readfrom_lua
+ *  reads the response from fd until it is completed or would block.
+ *  returns the status code if completed, false if more data is needed, or
+ *  nil and error message. the number of bytes read is always returned as
+ *  the third value.
+ */
+static int parser_readfrom_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+    int fd = (int)lauxh_checkinteger( L, 2 );
+    size_t nread = 0;
+    int rc = tempest_http_parse( p );
+
+    while( rc == 0 )
+    {
+        ssize_t n = 0;
+
+        if( tempest_http_prepare( p, TEMPEST_HTTP_BUFSIZE / 2 ) ){
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            lua_pushinteger( L, nread );
+            return 3;
+        }
+
+        n = read( fd, p->buf + p->len, p->cap - p->len );
+        if( n > 0 ){
+            p->len += n;
+            nread += n;
+            rc = tempest_http_parse( p );
+            continue;
+        }
+        else if( n == 0 )
+        {
+            // response that is terminated by closing connection
+            if( p->state == TEMPEST_HTTP_BODY_UNTIL_CLOSE ){
+                p->state = TEMPEST_HTTP_DONE;
+                rc = 1;
+                break;
+            }
+            lua_pushnil( L );
+            lua_pushliteral( L, "connection closed by peer" );
+            lua_pushinteger( L, nread );
+            return 3;
+        }
+        else if( errno == EINTR ){
+            continue;
+        }
+        else if( errno == EAGAIN || errno == EWOULDBLOCK ){
+            break;
+        }
+
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        lua_pushinteger( L, nread );
+        return 3;
+    }
+
+    if( push_result( L, p, rc ) == 2 ){
+        lua_pushinteger( L, nread );
+        return 3;
+    }
+    lua_pushnil( L );
+    lua_pushinteger( L, nread );
+
+    return 3;
+}
+
+
+/**
+ * feed_lua
+ *  parses the received data. returns the status code if completed, false
+ *  if more data is needed, or nil and error message.
+ */
+static int parser_feed_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+    size_t len = 0;
+    const char *data = lauxh_checklstring( L, 2, &len );
+
+    if( tempest_http_prepare( p, len ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    memcpy( p->buf + p->len, data, len );
+    p->len += len;
+
+    return push_result( L, p, tempest_http_parse( p ) );
+}
+
+
+/**
+ * eof_lua
+ *  notifies that the connection has been closed by peer. returns the status
+ *  code if the response is terminated by closing connection.
+ */
+static int parser_eof_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+
+    if( p->state == TEMPEST_HTTP_BODY_UNTIL_CLOSE ){
+        p->state = TEMPEST_HTTP_DONE;
+    }
+
+    return push_result( L, p, p->state == TEMPEST_HTTP_DONE ? 1 : -1 );
+}
+
+
+/**
+ * reset_lua
+ *  prepares for the next response. the bytes that follow the previous
+ *  response are kept unless discard is true.
+ */
+static int parser_reset_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+    int head = lauxh_optboolean( L, 2, 0 );
+    int discard = lauxh_optboolean( L, 3, 0 );
+
+    tempest_http_reset( p, head, discard );
+
+    return 0;
+}
+
+
+static int parser_keepalive_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+
+    lua_pushboolean( L, p->keepalive );
+
+    return 1;
+}
+
+
+static int parser_bodylen_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lauxh_checkudata( L, 1,
+                                                 TEMPEST_HTTP_PARSER_MT );
+
+    lua_pushnumber( L, p->nbody );
+
+    return 1;
+}
+
+
+static int parser_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_HTTP_PARSER_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int parser_gc_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = (tempest_http_parser_t*)lua_touserdata( L, 1 );
+
+    if( p->buf ){
+        free( (void*)p->buf );
+    }
+
+    return 0;
+}
+
+
+static int parser_lua( lua_State *L )
+{
+    tempest_http_parser_t *p = lua_newuserdata( L,
+                                                sizeof( tempest_http_parser_t ) );
+
+    memset( (void*)p, 0, sizeof( tempest_http_parser_t ) );
+    p->state = TEMPEST_HTTP_STATUS;
+    p->keepalive = 1;
+    lauxh_setmetatable( L, TEMPEST_HTTP_PARSER_MT );
+
+    return 1;
+}
+
+
+static void createmt( lua_State *L, const char *tname, struct luaL_Reg mmethod[],
+                      struct luaL_Reg method[] )
+{
+    // create metatable
+    if( luaL_newmetatable( L, tname ) )
+    {
+        struct luaL_Reg *ptr = mmethod;
+
+        // metamethods
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        // methods
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        ptr = method;
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        lua_rawset( L, -3 );
+    }
+    lua_pop( L, 1 );
+}
+
+
+LUALIB_API int luaopen_tempest_http( lua_State *L )
+{
+    struct luaL_Reg tmpl_mmethod[] = {
+        { "__gc", tmpl_gc_lua },
+        { "__tostring", tmpl_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg tmpl_method[] = {
+        { "writev", tmpl_writev_lua },
+        { "render", tmpl_render_lua },
+        { "ishead", tmpl_ishead_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg parser_mmethod[] = {
+        { "__gc", parser_gc_lua },
+        { "__tostring", parser_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg parser_method[] = {
+        { "reset", parser_reset_lua },
+        { "readfrom", parser_readfrom_lua },
+        { "feed", parser_feed_lua },
+        { "eof", parser_eof_lua },
+        { "keepalive", parser_keepalive_lua },
+        { "bodylen", parser_bodylen_lua },
+        { NULL, NULL }
+    };
+
+    createmt( L, TEMPEST_HTTP_TEMPLATE_MT, tmpl_mmethod, tmpl_method );
+    createmt( L, TEMPEST_HTTP_PARSER_MT, parser_mmethod, parser_method );
+
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "template", template_lua );
+    lauxh_pushfn2tbl( L, "parser", parser_lua );
+
+    return 1;
+}
@@ -0,0 +1,374 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/socket.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/18.
+ */
+
+#include "tempest.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+#define TEMPEST_SOCKET_RCVSIZE  16384
+
+
+static int fd_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+
+    lua_pushinteger( L, s->fd );
+
+    return 1;
+}
+
+
+/**
+ * sockerror_lua
+ *  returns the error of non-blocking connect.
+ */
+static int sockerror_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+    int err = 0;
+    socklen_t len = sizeof( err );
+
+    if( getsockopt( s->fd, SOL_SOCKET, SO_ERROR, &err, &len ) == -1 ){
+        err = errno;
+    }
+    if( err ){
+        lua_pushstring( L, strerror( err ) );
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int linger_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+    struct linger l = {
+        .l_onoff = 1,
+        .l_linger = (int)lauxh_checkinteger( L, 2 )
+    };
+
+    if( setsockopt( s->fd, SOL_SOCKET, SO_LINGER, &l, sizeof( l ) ) == -1 ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+/**
+ * write_lua
+ *  returns the number of bytes written, 0 if it would block, or nil and
+ *  error message.
+ */
+static int write_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+    size_t len = 0;
+    const char *str = lauxh_checklstring( L, 2, &len );
+    ssize_t rv = 0;
+
+    while( ( rv = send( s->fd, str, len, MSG_NOSIGNAL ) ) == -1 &&
+           errno == EINTR ){
+        continue;
+    }
+    if( rv == -1 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK ){
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            return 2;
+        }
+        rv = 0;
+    }
+    lua_pushinteger( L, rv );
+
+    return 1;
+}
+
+
+/**
+ * read_lua
+ *  returns the received data, false if it would block, nil if closed by
+ *  peer, or nil and error message.
+ */
+static int read_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+    char buf[TEMPEST_SOCKET_RCVSIZE];
+    ssize_t rv = 0;
+
+    while( ( rv = recv( s->fd, buf, sizeof( buf ), 0 ) ) == -1 &&
+           errno == EINTR ){
+        continue;
+    }
+    if( rv > 0 ){
+        lua_pushlstring( L, buf, rv );
+        return 1;
+    }
+    else if( rv == 0 ){
+        lua_pushnil( L );
+        return 1;
+    }
+    else if( errno == EAGAIN || errno == EWOULDBLOCK ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( errno ) );
+
+    return 2;
+}
+
+
+static int close_lua( lua_State *L )
+{
+    tempest_socket_t *s = lauxh_checkudata( L, 1, TEMPEST_SOCKET_MT );
+
+    if( s->fd != -1 ){
+        close( s->fd );
+        s->fd = -1;
+    }
+
+    return 0;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_SOCKET_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int gc_lua( lua_State *L )
+{
+    tempest_socket_t *s = (tempest_socket_t*)lua_touserdata( L, 1 );
+
+    if( s->fd != -1 ){
+        close( s->fd );
+    }
+
+    return 0;
+}
+
+
+static struct addrinfo *getaddr( const char *host, const char *port,
+                                 int family, int flags, int *rc )
+{
+    struct addrinfo hints = {
+        .ai_family = family,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = flags
+    };
+    struct addrinfo *res = NULL;
+
+    *rc = getaddrinfo( host, port, &hints, &res );
+
+    return res;
+}
+
+
+/**
+ * resolve_lua
+ *  returns the numeric host of the first address of the host.
+ */
+static int resolve_lua( lua_State *L )
+{
+    const char *host = lauxh_checkstring( L, 1 );
+    char numhost[NI_MAXHOST];
+    int rc = 0;
+    struct addrinfo *res = getaddr( host, NULL, AF_UNSPEC, 0, &rc );
+
+    if( !res ){
+        lua_pushnil( L );
+        lua_pushstring( L, gai_strerror( rc ) );
+        return 2;
+    }
+
+    rc = getnameinfo( res->ai_addr, res->ai_addrlen, numhost, NI_MAXHOST,
+                      NULL, 0, NI_NUMERICHOST );
+    freeaddrinfo( res );
+    if( rc ){
+        lua_pushnil( L );
+        lua_pushstring( L, gai_strerror( rc ) );
+        return 2;
+    }
+    lua_pushstring( L, numhost );
+
+    return 1;
+}
+
+
+/**
+ * connect_lua
+ *  creates a non-blocking socket bound to the local address and starts
+ *  connecting to the numeric host. the local port is assigned at connect
+ *  time with IP_BIND_ADDRESS_NO_PORT, so the same port can be shared with
+ *  connections to different destinations.
+ */
+static int connect_lua( lua_State *L )
+{
+    const char *host = lauxh_checkstring( L, 1 );
+    const char *port = NULL;
+    const char *bindaddr = lauxh_checkstring( L, 3 );
+    int flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo *raddr = NULL;
+    struct addrinfo *laddr = NULL;
+    tempest_socket_t *s = NULL;
+    int rc = 0;
+    int fd = -1;
+    int opt = 1;
+
+    lauxh_checkinteger( L, 2 );
+    port = lua_tostring( L, 2 );
+    if( !( laddr = getaddr( bindaddr, "0", AF_UNSPEC, flags | AI_PASSIVE,
+                            &rc ) ) ){
+        lua_pushnil( L );
+        lua_pushfstring( L, "%s: %s", bindaddr, gai_strerror( rc ) );
+        return 2;
+    }
+    else if( !( raddr = getaddr( host, port, laddr->ai_family, flags,
+                                 &rc ) ) ){
+        freeaddrinfo( laddr );
+        lua_pushnil( L );
+        lua_pushfstring( L, "%s: %s", host, gai_strerror( rc ) );
+        return 2;
+    }
+
+    fd = socket( laddr->ai_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                 0 );
+    if( fd == -1 ){
+        goto FAILED;
+    }
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+    setsockopt( fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &opt, sizeof( opt ) );
+#endif
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof( opt ) );
+    if( bind( fd, laddr->ai_addr, laddr->ai_addrlen ) == -1 ||
+        ( connect( fd, raddr->ai_addr, raddr->ai_addrlen ) == -1 &&
+          errno != EINPROGRESS ) ){
+        goto FAILED;
+    }
+    freeaddrinfo( laddr );
+    freeaddrinfo( raddr );
+
+    s = lua_newuserdata( L, sizeof( tempest_socket_t ) );
+    s->fd = fd;
+    lauxh_setmetatable( L, TEMPEST_SOCKET_MT );
+
+    return 1;
+
+FAILED:
+    rc = errno;
+    if( fd != -1 ){
+        close( fd );
+    }
+    freeaddrinfo( laddr );
+    freeaddrinfo( raddr );
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( rc ) );
+
+    return 2;
+}
+
+
+/**
+ * tmpfd_lua
+ *  returns the descriptor of an unlinked temporary file that only the owner
+ *  can read and write. it is used to store the TLS session of the worker.
+ */
+static int tmpfd_lua( lua_State *L )
+{
+    char path[] = "/tmp/tempest.XXXXXX";
+    int fd = mkstemp( path );
+
+    if( fd == -1 ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    unlink( path );
+    lua_pushinteger( L, fd );
+
+    return 1;
+}
+
+
+LUALIB_API int luaopen_tempest_socket( lua_State *L )
+{
+    // create metatable
+    if( luaL_newmetatable( L, TEMPEST_SOCKET_MT ) )
+    {
+        struct luaL_Reg mmethod[] = {
+            { "__gc", gc_lua },
+            { "__tostring", tostring_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg method[] = {
+            { "fd", fd_lua },
+            { "sockerror", sockerror_lua },
+            { "linger", linger_lua },
+            { "write", write_lua },
+            { "read", read_lua },
+            { "close", close_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg *ptr = mmethod;
+
+        // metamethods
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        // methods
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        ptr = method;
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        lua_rawset( L, -3 );
+    }
+    lua_settop( L, 0 );
+
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "resolve", resolve_lua );
+    lauxh_pushfn2tbl( L, "connect", connect_lua );
+    lauxh_pushfn2tbl( L, "tmpfd", tmpfd_lua );
+
+    return 1;
+}
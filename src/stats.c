@@ -26,21 +26,58 @@
  */
 
 #include "tempest.h"
+#include <stddef.h>
 #include <sys/mman.h>
+#if defined(TEMPEST_HAVE_TSC)
+#include <cpuid.h>
+#endif
 #include <math.h>
 
 
+// the recordings before the measurement phase are discarded
 #define tempest_stats_add(field) do{ \
     tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT ); \
     uint64_t v = (uint64_t)lauxh_checkuint64( L, 2 ); \
-    __atomic_fetch_add( &(s->data->field), v, __ATOMIC_RELAXED ); \
+    if( tempest_stats_measuring( s ) ){ \
+        s->data->field += v; \
+    } \
     return 0; \
 }while(0)
 
 
 #define tempest_stats_incr(field) do{ \
     tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT ); \
-    __atomic_fetch_add( &(s->data->field), 1, __ATOMIC_RELAXED ); \
+    if( tempest_stats_measuring( s ) ){ \
+        s->data->field++; \
+    } \
+    return 0; \
+}while(0)
+
+
+// update the per-interval snapshot as well
+#define tempest_stats_add_slot(field) do{ \
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT ); \
+    uint64_t v = (uint64_t)lauxh_checkuint64( L, 2 ); \
+    tempest_stats_slot_t *slot = tempest_stats_slot( s, tempest_stats_now( s ) ); \
+    if( tempest_stats_measuring( s ) ){ \
+        s->data->field += v; \
+    } \
+    if( slot ){ \
+        slot->field += v; \
+    } \
+    return 0; \
+}while(0)
+
+
+#define tempest_stats_incr_slot(field) do{ \
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT ); \
+    tempest_stats_slot_t *slot = tempest_stats_slot( s, tempest_stats_now( s ) ); \
+    if( tempest_stats_measuring( s ) ){ \
+        s->data->field++; \
+    } \
+    if( slot ){ \
+        slot->field++; \
+    } \
     return 0; \
 }while(0)
 
@@ -64,124 +101,1337 @@ static int incr_econnect_lua( lua_State *L ){
     tempest_stats_incr( econnect );
 }
 static int add_bytes_recv_lua( lua_State *L ){
-    tempest_stats_add( bytes_recv );
+    tempest_stats_add_slot( bytes_recv );
 }
 static int add_bytes_sent_lua( lua_State *L ){
-    tempest_stats_add( bytes_sent );
+    tempest_stats_add_slot( bytes_sent );
 }
 static int incr_failure_lua( lua_State *L ){
-    tempest_stats_incr( failure );
+    tempest_stats_incr_slot( failure );
+}
+static int add_failure_lua( lua_State *L ){
+    tempest_stats_add_slot( failure );
 }
 static int incr_success_lua( lua_State *L ){
-    tempest_stats_incr( success );
+    tempest_stats_incr_slot( success );
 }
 
+static int record_loop_lag_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
 
-static int data_lua( lua_State *L )
+    tempest_stats_record( s, TEMPEST_HIST_LOOP,
+                          (uint64_t)lauxh_checkuint64( L, 2 ) );
+
+    return 0;
+}
+
+
+/**
+ * incr_errno_lua
+ *  counts the failure by errno. the error can be the errno or its message,
+ *  and it is counted as ETIMEDOUT if timeout is true. the message is looked
+ *  up in the table of the upvalue that maps the strerror messages to the
+ *  errnos, and the unknown message is counted as 0.
+ */
+static int incr_errno_lua( lua_State *L )
 {
     tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    int err = 0;
 
-    if( s->pid != getpid() || !s->data ){
-        lua_pushnil( L );
+    if( lauxh_optboolean( L, 3, 0 ) ){
+        err = ETIMEDOUT;
+    }
+    else if( lua_type( L, 2 ) == LUA_TNUMBER ){
+        err = (int)lua_tointeger( L, 2 );
+    }
+    else if( lua_type( L, 2 ) == LUA_TSTRING ){
+        lua_settop( L, 2 );
+        lua_rawget( L, lua_upvalueindex( 1 ) );
+        err = (int)lua_tointeger( L, -1 );
+    }
+    tempest_stats_errno( s, err );
+
+    return 0;
+}
+
+
+/**
+ * push_errnos
+ *  pushes the table that maps the strerror messages to the errnos of the
+ *  platform. it is built once at load time of the module.
+ */
+static void push_errnos( lua_State *L )
+{
+    int err = 1;
+
+    lua_createtable( L, 0, TEMPEST_STATS_NERRNO );
+    for(; err < TEMPEST_STATS_NERRNO; err++ ){
+        lua_pushstring( L, strerror( err ) );
+        lua_pushinteger( L, err );
+        lua_rawset( L, -3 );
     }
-    else
+}
+
+
+static int incr_status_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+
+    tempest_stats_status( s, (int)lauxh_checkinteger( L, 2 ) );
+
+    return 0;
+}
+
+
+static const char *HIST_NAMES[TEMPEST_NHIST] = {
+    [TEMPEST_HIST_LATENCY] = "latency",
+    [TEMPEST_HIST_UNCORRECTED] = "uncorrected",
+    [TEMPEST_HIST_TTFB] = "ttfb",
+    [TEMPEST_HIST_CONNECT] = "connect",
+    [TEMPEST_HIST_LAG] = "lag",
+    [TEMPEST_HIST_LOOP] = "loop",
+    // "failure" is the number of failed requests
+    [TEMPEST_HIST_FAILURE] = "failed",
+    [TEMPEST_HIST_HANDSHAKE] = "handshake",
+    [TEMPEST_HIST_RESUMED] = "resumed"
+};
+
+
+static const double PERCENTILES[] = {
+    50.0, 90.0, 99.0, 99.9, 99.99
+};
+#define NPERCENTILE (sizeof( PERCENTILES ) / sizeof( double ))
+
+
+/**
+ * snapshot_nword
+ *  returns the number of counters of a shard.
+ */
+static inline size_t snapshot_nword( tempest_hist_t *hist, size_t nlabel )
+{
+    return offsetof( tempest_stats_data_t, latency ) / sizeof( uint64_t ) +
+           hist->len * TEMPEST_NHIST + ( hist->len + 1 ) * nlabel +
+           TEMPEST_STATS_NOUTCOME;
+}
+
+
+/**
+ * snapshot_fill
+ *  copies the sum of all shards into the snapshot. the counters are read
+ *  with relaxed atomic loads while the workers keep recording, so each
+ *  counter is never torn and the snapshot does not block the workers. the
+ *  counters of an in-flight request may not agree with each other until
+ *  the stats is stopped, so the final snapshot must be taken after stop.
+ */
+static void snapshot_fill( tempest_stats_t *s, tempest_snapshot_t *snap )
+{
+    size_t ncounter = offsetof( tempest_stats_data_t, latency ) /
+                      sizeof( uint64_t );
+    size_t len = snap->hist.len;
+    uint64_t *dst = snap->words;
+    size_t i = 0;
+    size_t j = 0;
+    size_t h = 0;
+
+    memset( (void*)dst, 0, snap->nword * sizeof( uint64_t ) );
+    memset( (void*)snap->total, 0, sizeof( snap->total ) );
+    for(; i < s->region->nshard; i++ )
     {
-        tempest_stats_data_t *data = s->data;
-        uint64_t *latency = &data->latency;
-        int idx_msec = 0;
-        int idx_mgrp = 0;
-        int idx_nreq = 0;
-        double msecf = 0.0;
-        double prev_msec = 0.0;
-        double prev_msecf = 0.0;
-        uint64_t nreqs = 0;
-        uint64_t min_nreq = UINT64_MAX;
-        uint64_t max_nreq = 0;
-        size_t avg = 0;
-        size_t i = 0;
-        size_t k = 0;
-        size_t g = 0;
+        uint64_t *src = (uint64_t*)tempest_stats_shard( s, i );
 
-        lua_settop( L, 0 );
-        lua_createtable( L, 0, 12 );
-        lauxh_pushnum2tbl( L, "success", data->success );
-        lauxh_pushnum2tbl( L, "failure", data->failure );
-        lauxh_pushnum2tbl( L, "bytesSent", data->bytes_sent );
-        lauxh_pushnum2tbl( L, "bytesRecv", data->bytes_recv );
-        lauxh_pushnum2tbl( L, "econnect", data->econnect );
-        lauxh_pushnum2tbl( L, "erecv", data->erecv );
-        lauxh_pushnum2tbl( L, "erecvTimeo", data->erecv_timeo );
-        lauxh_pushnum2tbl( L, "esend", data->esend );
-        lauxh_pushnum2tbl( L, "esendTimeo", data->esend_timeo );
-        lauxh_pushnum2tbl( L, "einternal", data->einternal );
-
-        lua_pushliteral( L, "latency_msec_grp" );
-        lua_newtable( L );
-        idx_mgrp = lua_gettop( L );
-        lua_pushliteral( L, "latency_msec" );
-        lua_newtable( L );
-        idx_msec = lua_gettop( L );
-        lua_pushliteral( L, "latency_nreq" );
-        lua_newtable( L );
-        idx_nreq = lua_gettop( L );
-        for(; i < data->len; i++ )
+        for( j = 0; j < ncounter; j++ ){
+            dst[j] += __atomic_load_n( src + j, __ATOMIC_RELAXED );
+        }
+        for( h = 0; h < TEMPEST_NHIST; h++ )
         {
-            if( latency[i] )
-            {
-                uint64_t nreq = latency[i];
-                double msec = (double)i / 100;
-
-                msecf = floor( msec );
-                k++;
-                avg += i;
-                lauxh_pushnum2arrat( L, k, msec, idx_msec );
-                lauxh_pushnum2arrat( L, k, nreq, idx_nreq );
-                if( min_nreq > nreq ){
-                    min_nreq = nreq;
-                }
-                if( max_nreq < nreq ){
-                    max_nreq = nreq;
-                }
+            uint64_t *hsrc = src + ncounter + h * len;
+            uint64_t *hdst = dst + ncounter + h * len;
+            uint64_t total = 0;
 
-                // grouping by integer msec
-                if( g == 0 ){
-                    g = 1;
-                    nreqs = nreq;
-                    prev_msecf = msecf;
-                    lua_newtable( L );
-                    lauxh_pushnum2tbl( L, "msec", msecf );
-                    lauxh_pushnum2tbl( L, "min", msec );
-                }
-                else if( msecf != prev_msecf ){
+            for( j = 0; j < len; j++ ){
+                uint64_t v = __atomic_load_n( hsrc + j, __ATOMIC_RELAXED );
+
+                hdst[j] += v;
+                total += v;
+            }
+            snap->total[h] += total;
+        }
+        // labels and outcome counters
+        for( j = ncounter + TEMPEST_NHIST * len; j < snap->nword; j++ ){
+            dst[j] += __atomic_load_n( src + j, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+
+/**
+ * snapshot_alloc
+ *  returns the snapshot of stats. the returned value must be released by
+ *  free().
+ */
+static tempest_snapshot_t *snapshot_alloc( tempest_stats_t *s )
+{
+    size_t nword = snapshot_nword( &s->region->hist, s->region->nlabel );
+    tempest_snapshot_t *snap = malloc( sizeof( tempest_snapshot_t ) +
+                                       nword * sizeof( uint64_t ) );
+
+    if( snap ){
+        snap->hist = s->region->hist;
+        snap->nword = nword;
+        snap->nlabel = s->region->nlabel;
+        snapshot_fill( s, snap );
+    }
+
+    return snap;
+}
+
+
+/**
+ * check_percentiles
+ *  reads the array of percentiles at idx into pcts in ascending order, or
+ *  uses the default percentiles. returns the number of percentiles.
+ */
+static size_t check_percentiles( lua_State *L, int idx, double *pcts )
+{
+    size_t npct = 0;
+    size_t i = 0;
+
+    if( lua_isnoneornil( L, idx ) ){
+        memcpy( (void*)pcts, (void*)PERCENTILES, sizeof( PERCENTILES ) );
+        return NPERCENTILE;
+    }
+
+    lauxh_checktable( L, idx );
+    npct = lua_objlen( L, idx );
+    if( npct > TEMPEST_SNAPSHOT_MAXPCT ){
+        lauxh_argerror( L, idx, "number of percentiles must be less than "
+                                "or equal to %d", TEMPEST_SNAPSHOT_MAXPCT );
+    }
+    for(; i < npct; i++ )
+    {
+        double p = 0;
+        size_t j = i;
+
+        lua_rawgeti( L, idx, i + 1 );
+        p = lua_tonumber( L, -1 );
+        lua_pop( L, 1 );
+        if( !( p > 0.0 && p <= 100.0 ) ){
+            lauxh_argerror( L, idx, "percentile must be in the range of "
+                                    "(0, 100]" );
+        }
+        // insertion sort
+        for(; j > 0 && pcts[j - 1] > p; j-- ){
+            pcts[j] = pcts[j - 1];
+        }
+        pcts[j] = p;
+    }
+
+    return npct;
+}
+
+
+/**
+ * push_summary
+ *  pushes a table that contains the summary of the histogram, and returns
+ *  the lowest and highest recorded values into vmin and vmax.
+ */
+static void push_summary( lua_State *L, tempest_hist_t *hist,
+                          uint64_t *counts, uint64_t total,
+                          const double *pcts, size_t npct, uint64_t *vmin,
+                          uint64_t *vmax )
+{
+    uint64_t rank[TEMPEST_SNAPSHOT_MAXPCT] = { 0 };
+    int idx_pct = 0;
+    double sum = 0.0;
+    double sqsum = 0.0;
+    double mean = 0.0;
+    uint64_t nseen = 0;
+    size_t p = 0;
+    size_t i = 0;
+
+    *vmin = *vmax = 0;
+    // rank of percentiles
+    for( p = 0; p < npct; p++ ){
+        rank[p] = (uint64_t)ceil( pcts[p] / 100.0 * total );
+        if( rank[p] == 0 ){
+            rank[p] = 1;
+        }
+    }
+
+    lua_createtable( L, 0, 7 );
+    lua_pushliteral( L, "percentiles" );
+    lua_createtable( L, npct, 0 );
+    idx_pct = lua_gettop( L );
+    for( i = 0, p = 0; i < hist->len && nseen < total; i++ )
+    {
+        if( counts[i] )
+        {
+            uint64_t nreq = counts[i];
+            uint64_t width = 0;
+            uint64_t v = tempest_hist_value( hist, i, &width );
+            double median = (double)( v + ( width >> 1 ) );
+
+            if( !nseen ){
+                *vmin = v;
+            }
+            *vmax = v + width - 1;
+            sum += median * nreq;
+            sqsum += median * median * nreq;
+            nseen += nreq;
+
+            // percentiles: highest value equivalent to the ranked bucket
+            for(; p < npct && rank[p] <= nseen; p++ ){
+                lua_createtable( L, 0, 2 );
+                lauxh_pushnum2tbl( L, "percentile", pcts[p] );
+                lauxh_pushnum2tbl( L, "msec", (double)*vmax / 1000000.0 );
+                lua_rawseti( L, idx_pct, p + 1 );
+            }
+        }
+    }
+    lua_rawset( L, -3 );
+
+    if( total ){
+        mean = sum / (double)total;
+        lauxh_pushnum2tbl( L, "min", (double)*vmin / 1000000.0 );
+        lauxh_pushnum2tbl( L, "max", (double)*vmax / 1000000.0 );
+        lauxh_pushnum2tbl( L, "avg", mean / 1000000.0 );
+        lauxh_pushnum2tbl( L, "stddev",
+            sqrt( fabs( sqsum / (double)total - mean * mean ) ) / 1000000.0
+        );
+    }
+    lauxh_pushnum2tbl( L, "nreq", total );
+    lauxh_pushnum2tbl( L, "sigdigs", hist->sigdigs );
+}
+
+
+/**
+ * push_groups
+ *  pushes an array of the histogram rows grouped by msec. the width of
+ *  group is doubled from 1 msec until the number of rows between vmin and
+ *  vmax fits in maxrows. maxrows 0 means unlimited.
+ */
+static void push_groups( lua_State *L, tempest_hist_t *hist, uint64_t *counts,
+                         uint64_t vmin, uint64_t vmax, size_t maxrows )
+{
+    uint64_t gwidth = 1000000;
+    uint64_t grp = UINT64_MAX;
+    uint64_t nreqs = 0;
+    double prev_msec = 0.0;
+    int idx_mgrp = 0;
+    size_t i = 0;
+    size_t g = 0;
+
+    if( maxrows ){
+        while( vmax / gwidth - vmin / gwidth + 1 > maxrows ){
+            gwidth <<= 1;
+        }
+    }
+
+    lua_newtable( L );
+    idx_mgrp = lua_gettop( L );
+    for(; i < hist->len; i++ )
+    {
+        if( counts[i] )
+        {
+            uint64_t v = tempest_hist_value( hist, i, NULL );
+            double msec = (double)v / 1000000.0;
+
+            if( v / gwidth != grp )
+            {
+                if( g ){
                     lauxh_pushnum2tbl( L, "max", prev_msec );
                     lauxh_pushnum2tbl( L, "nreq", nreqs );
                     lua_rawseti( L, idx_mgrp, g );
-
-                    g++;
-                    prev_msecf = msecf;
-                    nreqs = nreq;
-                    lua_newtable( L );
-                    lauxh_pushnum2tbl( L, "msec", msecf );
-                    lauxh_pushnum2tbl( L, "min", msec );
                 }
-                else {
-                    nreqs += nreq;
+                g++;
+                grp = v / gwidth;
+                nreqs = 0;
+                lua_createtable( L, 0, 4 );
+                lauxh_pushnum2tbl( L, "msec",
+                                   (double)( grp * gwidth / 1000000 ) );
+                lauxh_pushnum2tbl( L, "min", msec );
+            }
+            nreqs += counts[i];
+            prev_msec = msec;
+        }
+    }
+
+    if( g ){
+        lauxh_pushnum2tbl( L, "max", prev_msec );
+        lauxh_pushnum2tbl( L, "nreq", nreqs );
+        lua_rawseti( L, idx_mgrp, g );
+    }
+}
+
+
+/**
+ * push_outcome
+ *  sets the "errnos" and "status" arrays of the non-zero outcome counters
+ *  in ascending order into the table at the top.
+ */
+static void push_outcome( lua_State *L, tempest_stats_outcome_t *outcome )
+{
+    int n = 0;
+    int i = 0;
+
+    lua_pushliteral( L, "errnos" );
+    lua_newtable( L );
+    for(; i < TEMPEST_STATS_NERRNO; i++ ){
+        if( outcome->errnos[i] ){
+            lua_createtable( L, 0, 3 );
+            lauxh_pushint2tbl( L, "errno", i );
+            if( i ){
+                lauxh_pushstr2tbl( L, "name", strerror( i ) );
+            }
+            lauxh_pushnum2tbl( L, "nreq", outcome->errnos[i] );
+            lua_rawseti( L, -2, ++n );
+        }
+    }
+    lua_rawset( L, -3 );
+
+    lua_pushliteral( L, "status" );
+    lua_newtable( L );
+    for( i = 0, n = 0; i < TEMPEST_STATS_NSTATUS; i++ ){
+        if( outcome->status[i] ){
+            lua_createtable( L, 0, 2 );
+            lauxh_pushint2tbl( L, "code", i + 100 );
+            lauxh_pushnum2tbl( L, "nreq", outcome->status[i] );
+            lua_rawseti( L, -2, ++n );
+        }
+    }
+    lua_rawset( L, -3 );
+}
+
+
+/**
+ * push_data
+ *  pushes a table of the counters and the summaries of the histograms.
+ */
+static void push_data( lua_State *L, tempest_snapshot_t *snap,
+                       const double *pcts, size_t npct, size_t maxrows )
+{
+    tempest_stats_data_t *data = (tempest_stats_data_t*)snap->words;
+    tempest_hist_t *hist = &snap->hist;
+    uint64_t vmin = 0;
+    uint64_t vmax = 0;
+    int idx = 0;
+    int h = 0;
+
+    lua_createtable( L, 0, 16 );
+    idx = lua_gettop( L );
+    lauxh_pushnum2tbl( L, "success", data->success );
+    lauxh_pushnum2tbl( L, "failure", data->failure );
+    lauxh_pushnum2tbl( L, "bytesSent", data->bytes_sent );
+    lauxh_pushnum2tbl( L, "bytesRecv", data->bytes_recv );
+    lauxh_pushnum2tbl( L, "econnect", data->econnect );
+    lauxh_pushnum2tbl( L, "erecv", data->erecv );
+    lauxh_pushnum2tbl( L, "erecvTimeo", data->erecv_timeo );
+    lauxh_pushnum2tbl( L, "esend", data->esend );
+    lauxh_pushnum2tbl( L, "esendTimeo", data->esend_timeo );
+    lauxh_pushnum2tbl( L, "einternal", data->einternal );
+
+    for(; h < TEMPEST_NHIST; h++ )
+    {
+        uint64_t *counts = tempest_stats_hist( data, hist, h );
+
+        lua_pushstring( L, HIST_NAMES[h] );
+        push_summary( L, hist, counts, snap->total[h], pcts, npct, &vmin,
+                      &vmax );
+        lua_rawset( L, idx );
+        if( h == TEMPEST_HIST_LATENCY ){
+            lua_pushliteral( L, "latency_msec_grp" );
+            push_groups( L, hist, counts, vmin, vmax, maxrows );
+            lua_rawset( L, idx );
+        }
+    }
+
+    // labels in order of id
+    if( snap->nlabel ){
+        size_t i = 0;
+        size_t j = 0;
+
+        lua_pushliteral( L, "labels" );
+        lua_createtable( L, snap->nlabel, 0 );
+        for(; i < snap->nlabel; i++ )
+        {
+            tempest_stats_label_t *label = tempest_stats_label( data, hist, i );
+            uint64_t total = 0;
+
+            for( j = 0; j < hist->len; j++ ){
+                total += (&label->latency)[j];
+            }
+            lua_createtable( L, 0, 2 );
+            lauxh_pushnum2tbl( L, "failure", label->failure );
+            lua_pushliteral( L, "latency" );
+            push_summary( L, hist, &label->latency, total, pcts, npct, &vmin,
+                          &vmax );
+            lua_rawset( L, -3 );
+            lua_rawseti( L, -2, i + 1 );
+        }
+        lua_rawset( L, idx );
+    }
+
+    push_outcome( L, tempest_stats_outcome( data, hist, snap->nlabel ) );
+}
+
+
+/**
+ * snapshot_data_lua
+ *  returns the counters and the summaries of the snapshot with the
+ *  specified percentiles and maximum number of histogram rows.
+ */
+static int snapshot_data_lua( lua_State *L )
+{
+    tempest_snapshot_t *snap = lauxh_checkudata( L, 1, TEMPEST_SNAPSHOT_MT );
+    double pcts[TEMPEST_SNAPSHOT_MAXPCT];
+    size_t npct = check_percentiles( L, 2, pcts );
+    size_t maxrows = (size_t)lauxh_optuint32( L, 3,
+                                              TEMPEST_SNAPSHOT_MAXROWS );
+
+    push_data( L, snap, pcts, npct, maxrows );
+
+    return 1;
+}
+
+
+static int snapshot_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_SNAPSHOT_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+/**
+ * snapshot_reuse
+ *  returns the snapshot at idx if it has the same layout as the stats, or
+ *  pushes a new snapshot onto the stack.
+ */
+static tempest_snapshot_t *snapshot_reuse( lua_State *L, tempest_stats_t *s,
+                                           int idx )
+{
+    size_t nword = snapshot_nword( &s->region->hist, s->region->nlabel );
+    tempest_snapshot_t *snap = NULL;
+
+    if( !lua_isnoneornil( L, idx ) ){
+        snap = lauxh_checkudata( L, idx, TEMPEST_SNAPSHOT_MT );
+        if( snap->nword == nword &&
+            snap->hist.sigdigs == s->region->hist.sigdigs ){
+            return snap;
+        }
+    }
+
+    snap = lua_newuserdata( L, sizeof( tempest_snapshot_t ) +
+                               nword * sizeof( uint64_t ) );
+    snap->hist = s->region->hist;
+    snap->nword = nword;
+    snap->nlabel = s->region->nlabel;
+    lauxh_setmetatable( L, TEMPEST_SNAPSHOT_MT );
+
+    return snap;
+}
+
+
+/**
+ * snapshot_lua
+ *  copies the stats into the snapshot. the snapshot of the argument is
+ *  reused if it has the same layout, so repeated snapshots do not allocate.
+ */
+static int snapshot_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    tempest_snapshot_t *snap = NULL;
+
+    if( !s->region ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_settop( L, 2 );
+    snap = snapshot_reuse( L, s, 2 );
+    snapshot_fill( s, snap );
+
+    return 1;
+}
+
+
+/**
+ * hist_lua
+ *  returns the summary of the named histogram of the current shard. the
+ *  worker reports its own measurements with it.
+ */
+static int hist_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    const char *name = lauxh_checkstring( L, 2 );
+    double pcts[TEMPEST_SNAPSHOT_MAXPCT];
+    size_t npct = check_percentiles( L, 3, pcts );
+    uint64_t *counts = NULL;
+    uint64_t total = 0;
+    uint64_t vmin = 0;
+    uint64_t vmax = 0;
+    size_t i = 0;
+    int h = 0;
+
+    while( h < TEMPEST_NHIST && strcmp( name, HIST_NAMES[h] ) != 0 ){
+        h++;
+    }
+    if( h == TEMPEST_NHIST ){
+        return lauxh_argerror( L, 2, "unknown histogram %s", name );
+    }
+    else if( !s->region || !s->data ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    counts = tempest_stats_hist( s->data, &s->region->hist, h );
+    for(; i < s->region->hist.len; i++ ){
+        total += counts[i];
+    }
+    lua_settop( L, 0 );
+    push_summary( L, &s->region->hist, counts, total, pcts, npct, &vmin,
+                  &vmax );
+
+    return 1;
+}
+
+
+/**
+ * counts_lua
+ *  returns the number of the succeeded and the failed requests of the
+ *  current shard.
+ */
+static int counts_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+
+    if( !s->region || !s->data ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_pushnumber( L, s->data->success );
+    lua_pushnumber( L, s->data->failure );
+
+    return 2;
+}
+
+
+/**
+ * data_lua
+ *  returns the counters and the summaries of the current stats. the
+ *  arguments are the same as snapshot:data. the stats are copied into the
+ *  snapshot that is retained by the stats, so repeated calls do not
+ *  allocate.
+ */
+static int data_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    double pcts[TEMPEST_SNAPSHOT_MAXPCT];
+    size_t npct = check_percentiles( L, 2, pcts );
+    size_t maxrows = (size_t)lauxh_optuint32( L, 3,
+                                              TEMPEST_SNAPSHOT_MAXROWS );
+    tempest_snapshot_t *snap = NULL;
+
+    if( s->pid != getpid() || !s->region ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_settop( L, 1 );
+    lauxh_pushref( L, s->snapref );
+    snap = snapshot_reuse( L, s, 2 );
+    if( lua_gettop( L ) > 2 ){
+        lauxh_unref( L, s->snapref );
+        s->snapref = lauxh_ref( L );
+    }
+    snapshot_fill( s, snap );
+    lua_settop( L, 0 );
+    push_data( L, snap, pcts, npct, maxrows );
+
+    return 1;
+}
+
+
+#define STATS_MAGIC     "TMPS"
+
+
+/**
+ * encode_lua
+ *  returns the merged counters and histograms as a sparse encoded string
+ *  that can be merged into the stats of other process by merge method.
+ *  the header consists of highest, sigdigs, number of histograms and
+ *  number of counters.
+ */
+static int encode_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    tempest_snapshot_t *snap = NULL;
+    size_t nword = 0;
+    size_t nnz = 0;
+    size_t nbyte = 0;
+    uint8_t *buf = NULL;
+
+    if( s->pid != getpid() || !s->region ){
+        lua_pushnil( L );
+        return 1;
+    }
+    else if( !( snap = snapshot_alloc( s ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    nword = snap->nword;
+    nnz = tempest_enc_nnz( snap->words, sizeof( uint64_t ), nword );
+    nbyte = TEMPEST_ENC_MAGICLEN + 1 + TEMPEST_VARINT_MAXLEN * 4 +
+            ( nnz * 2 + 1 ) * TEMPEST_VARINT_MAXLEN;
+    if( !( buf = malloc( nbyte ) ) ){
+        free( (void*)snap );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    memcpy( buf, STATS_MAGIC, TEMPEST_ENC_MAGICLEN );
+    nbyte = TEMPEST_ENC_MAGICLEN;
+    buf[nbyte++] = TEMPEST_ENC_VERSION;
+    nbyte += tempest_enc_varint( buf + nbyte, s->region->hist.highest );
+    nbyte += tempest_enc_varint( buf + nbyte, s->region->hist.sigdigs );
+    nbyte += tempest_enc_varint( buf + nbyte, TEMPEST_NHIST );
+    nbyte += tempest_enc_varint( buf + nbyte, nword );
+    nbyte += tempest_enc_sparse( buf + nbyte, snap->words, sizeof( uint64_t ),
+                                 nword, nnz );
+    free( (void*)snap );
+    lua_settop( L, 0 );
+    lua_pushlstring( L, (const char*)buf, nbyte );
+    free( (void*)buf );
+
+    return 1;
+}
+
+
+/**
+ * decode_header
+ *  validates the magic and version of the encoded stats and reads the
+ *  header into hdr. the decoder points to the body on success.
+ */
+static int decode_header( tempest_dec_t *d, uint64_t hdr[4] )
+{
+    size_t len = (size_t)( d->end - d->cur );
+    size_t i = 0;
+
+    if( len < TEMPEST_ENC_MAGICLEN + 1 ||
+        memcmp( d->cur, STATS_MAGIC, TEMPEST_ENC_MAGICLEN ) != 0 ||
+        d->cur[TEMPEST_ENC_MAGICLEN] != TEMPEST_ENC_VERSION ){
+        return -1;
+    }
+
+    d->cur += TEMPEST_ENC_MAGICLEN + 1;
+    for(; i < 4; i++ ){
+        if( tempest_dec_varint( d, hdr + i ) ){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * merge_lua
+ *  adds the encoded stats to the current shard without decoding into a
+ *  dense array. returns false and error message if the layout of the
+ *  histograms does not match.
+ */
+static int merge_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    size_t len = 0;
+    const uint8_t *str = (const uint8_t*)lauxh_checklstring( L, 2, &len );
+    tempest_dec_t d = {
+        .cur = str,
+        .end = str + len
+    };
+    tempest_dec_t body;
+    uint64_t hdr[4] = { 0 };
+
+    if( !s->region ){
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "stats has been disposed" );
+        return 2;
+    }
+    else if( decode_header( &d, hdr ) ){
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "invalid encoded stats" );
+        return 2;
+    }
+    else if( hdr[0] != s->region->hist.highest ||
+             hdr[1] != s->region->hist.sigdigs || hdr[2] != TEMPEST_NHIST ||
+             hdr[3] != snapshot_nword( &s->region->hist,
+                                       s->region->nlabel ) ){
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "layout of encoded stats does not match" );
+        return 2;
+    }
+
+    // validate before merging to avoid partial update
+    body = d;
+    if( tempest_dec_sparse( &d, NULL, sizeof( uint64_t ), hdr[3] ) ){
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "invalid encoded stats" );
+        return 2;
+    }
+    tempest_dec_sparse( &body, s->data, sizeof( uint64_t ), hdr[3] );
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+/**
+ * decode_snapshot
+ *  decodes the encoded stats at idx into a snapshot. the returned value
+ *  must be released by free(). the stats encoded with fewer histograms are
+ *  accepted, and the missing histograms are empty. the number of labels is
+ *  derived from the number of counters, and the labels and the outcome
+ *  counters of the older layout are moved after the missing histograms. the
+ *  outcome counters were added along with the failure histogram, so they are
+ *  empty in the layout without it.
+ */
+static tempest_snapshot_t *decode_snapshot( lua_State *L, int idx,
+                                            const char **errmsg )
+{
+    size_t len = 0;
+    const uint8_t *str = (const uint8_t*)lauxh_checklstring( L, idx, &len );
+    tempest_dec_t d = {
+        .cur = str,
+        .end = str + len
+    };
+    tempest_dec_t body;
+    uint64_t hdr[4] = { 0 };
+    tempest_hist_t hist;
+    tempest_snapshot_t *snap = NULL;
+    tempest_stats_data_t *data = NULL;
+    size_t nword = 0;
+    size_t nmissing = 0;
+    size_t nlabel = 0;
+    size_t h = 0;
+    size_t i = 0;
+
+    *errmsg = "invalid encoded stats";
+    if( decode_header( &d, hdr ) || hdr[2] < 1 || hdr[2] > TEMPEST_NHIST ||
+        hdr[1] < 1 || hdr[1] > 5 ||
+        tempest_hist_init( &hist, hdr[0], hdr[1] ) != 0 ){
+        return NULL;
+    }
+    // number of counters without labels in the encoded layout
+    nmissing = hist.len * ( TEMPEST_NHIST - hdr[2] );
+    nword = snapshot_nword( &hist, 0 ) - nmissing;
+    if( hdr[2] <= TEMPEST_HIST_FAILURE ){
+        nword -= TEMPEST_STATS_NOUTCOME;
+    }
+    if( hdr[3] < nword || ( hdr[3] - nword ) % ( hist.len + 1 ) ||
+        ( nlabel = ( hdr[3] - nword ) / ( hist.len + 1 ) ) >
+        TEMPEST_STATS_MAXLABEL ){
+        return NULL;
+    }
+    nword = snapshot_nword( &hist, nlabel );
+
+    body = d;
+    if( tempest_dec_sparse( &d, NULL, sizeof( uint64_t ), hdr[3] ) ){
+        return NULL;
+    }
+    else if( !( snap = calloc( 1, sizeof( tempest_snapshot_t ) +
+                                  nword * sizeof( uint64_t ) ) ) ){
+        *errmsg = strerror( errno );
+        return NULL;
+    }
+
+    snap->hist = hist;
+    snap->nword = nword;
+    snap->nlabel = nlabel;
+    tempest_dec_sparse( &body, snap->words, sizeof( uint64_t ), hdr[3] );
+    data = (tempest_stats_data_t*)snap->words;
+    if( nmissing ){
+        uint64_t *tail = tempest_stats_hist( data, &hist, hdr[2] );
+        size_t ntail = hdr[3] - (size_t)( tail - snap->words );
+
+        memmove( (void*)( tail + nmissing ), (void*)tail,
+                 ntail * sizeof( uint64_t ) );
+        memset( (void*)tail, 0, nmissing * sizeof( uint64_t ) );
+    }
+    for(; h < TEMPEST_NHIST; h++ ){
+        uint64_t *counts = tempest_stats_hist( data, &hist, h );
+
+        for( i = 0; i < hist.len; i++ ){
+            snap->total[h] += counts[i];
+        }
+    }
+
+    return snap;
+}
+
+
+/**
+ * mann_whitney
+ *  performs the two-sided Mann-Whitney U test on the bucketed latency of
+ *  the two histograms of the same layout, with the tie correction for the
+ *  samples that share a bucket. returns the z-score, p-value and the
+ *  probability that a request of b is slower than a request of a.
+ */
+static void mann_whitney( size_t len, const uint64_t *a, uint64_t na,
+                          const uint64_t *b, uint64_t nb, double *z,
+                          double *pvalue, double *auc )
+{
+    double n1 = (double)na;
+    double n2 = (double)nb;
+    double n = n1 + n2;
+    double below = 0.0;
+    double u = 0.0;
+    double ties = 0.0;
+    double mean = 0.0;
+    double var = 0.0;
+    size_t i = 0;
+
+    *z = 0.0;
+    *pvalue = 1.0;
+    *auc = 0.5;
+    if( !na || !nb ){
+        return;
+    }
+
+    for(; i < len; i++ )
+    {
+        double t = (double)a[i] + (double)b[i];
+
+        if( t > 0.0 ){
+            // b[i] is greater than a[j < i] and ties with a[i]
+            u += (double)b[i] * ( below + (double)a[i] / 2.0 );
+            below += (double)a[i];
+            ties += t * t * t - t;
+        }
+    }
+
+    mean = n1 * n2 / 2.0;
+    var = n1 * n2 / 12.0 * ( ( n + 1.0 ) - ties / ( n * ( n - 1.0 ) ) );
+    *auc = u / ( n1 * n2 );
+    if( var > 0.0 ){
+        *z = ( u - mean ) / sqrt( var );
+        *pvalue = erfc( fabs( *z ) / M_SQRT2 );
+    }
+}
+
+
+/**
+ * push_result
+ *  pushes a table of the request counters and the latency summary.
+ */
+static void push_result( lua_State *L, tempest_snapshot_t *snap,
+                         const double *pcts, size_t npct )
+{
+    tempest_stats_data_t *data = (tempest_stats_data_t*)snap->words;
+    uint64_t vmin = 0;
+    uint64_t vmax = 0;
+
+    lua_createtable( L, 0, 3 );
+    lauxh_pushnum2tbl( L, "success", data->success );
+    lauxh_pushnum2tbl( L, "failure", data->failure );
+    lua_pushliteral( L, "latency" );
+    push_summary( L, &snap->hist,
+                  tempest_stats_hist( data, &snap->hist,
+                                      TEMPEST_HIST_LATENCY ),
+                  snap->total[TEMPEST_HIST_LATENCY], pcts, npct, &vmin,
+                  &vmax );
+    lua_rawset( L, -3 );
+}
+
+
+/**
+ * compare_lua
+ *  compares the latency distribution of the encoded current stats with
+ *  the encoded baseline stats. both must be recorded with the same timeout
+ *  and sigdigs.
+ */
+static int compare_lua( lua_State *L )
+{
+    double pcts[TEMPEST_SNAPSHOT_MAXPCT];
+    size_t npct = check_percentiles( L, 3, pcts );
+    const char *errmsg = NULL;
+    tempest_snapshot_t *base = NULL;
+    tempest_snapshot_t *cur = NULL;
+    double z = 0.0;
+    double pvalue = 0.0;
+    double auc = 0.0;
+
+    if( !( base = decode_snapshot( L, 1, &errmsg ) ) ){
+        lua_pushnil( L );
+        lua_pushfstring( L, "baseline: %s", errmsg );
+        return 2;
+    }
+    else if( !( cur = decode_snapshot( L, 2, &errmsg ) ) ){
+        free( (void*)base );
+        lua_pushnil( L );
+        lua_pushstring( L, errmsg );
+        return 2;
+    }
+    else if( base->hist.highest != cur->hist.highest ||
+             base->hist.sigdigs != cur->hist.sigdigs ){
+        free( (void*)base );
+        free( (void*)cur );
+        lua_pushnil( L );
+        lua_pushliteral( L, "layout of baseline does not match; use the same "
+                            "timeout and sigdigs" );
+        return 2;
+    }
+
+    mann_whitney( base->hist.len,
+                  tempest_stats_hist( (tempest_stats_data_t*)base->words,
+                                      &base->hist, TEMPEST_HIST_LATENCY ),
+                  base->total[TEMPEST_HIST_LATENCY],
+                  tempest_stats_hist( (tempest_stats_data_t*)cur->words,
+                                      &cur->hist, TEMPEST_HIST_LATENCY ),
+                  cur->total[TEMPEST_HIST_LATENCY], &z, &pvalue, &auc );
+
+    lua_settop( L, 0 );
+    lua_createtable( L, 0, 5 );
+    lua_pushliteral( L, "baseline" );
+    push_result( L, base, pcts, npct );
+    lua_rawset( L, -3 );
+    lua_pushliteral( L, "current" );
+    push_result( L, cur, pcts, npct );
+    lua_rawset( L, -3 );
+    lauxh_pushnum2tbl( L, "z", z );
+    lauxh_pushnum2tbl( L, "pvalue", pvalue );
+    lauxh_pushnum2tbl( L, "auc", auc );
+    free( (void*)base );
+    free( (void*)cur );
+
+    return 1;
+}
+
+
+/**
+ * hist_percentiles
+ *  calculates the values of PERCENTILES into vals and returns the highest
+ *  recorded value.
+ */
+static uint64_t hist_percentiles( tempest_hist_t *hist, uint64_t *counts,
+                                  uint64_t total, uint64_t *vals )
+{
+    uint64_t nseen = 0;
+    uint64_t vmax = 0;
+    size_t p = 0;
+    size_t i = 0;
+
+    for(; i < hist->len; i++ )
+    {
+        if( counts[i] )
+        {
+            uint64_t width = 0;
+            uint64_t v = tempest_hist_value( hist, i, &width );
+
+            vmax = v + width - 1;
+            nseen += counts[i];
+            for(; p < NPERCENTILE &&
+                  ceil( PERCENTILES[p] / 100.0 * total ) <= nseen; p++ ){
+                vals[p] = vmax;
+            }
+        }
+    }
+
+    return vmax;
+}
+
+
+/**
+ * drain_lua
+ *  returns an array of the snapshots of completed intervals that have not
+ *  been drained yet. if flush is true, the current interval is included.
+ */
+static int drain_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    int flush = lauxh_optboolean( L, 2, 0 );
+    tempest_stats_region_t *r = s->region;
+    size_t nword = 0;
+    tempest_stats_slot_t *slot = NULL;
+    uint64_t cur = 0;
+    uint64_t seq = 0;
+    int idx = 0;
+
+    lua_settop( L, 1 );
+    if( !r || s->pid != getpid() || !r->nslot || !r->epoch ){
+        lua_newtable( L );
+        return 1;
+    }
+
+    // current interval
+    cur = ( tempest_stats_now( s ) - r->epoch ) / r->interval + 1;
+    if( flush ){
+        cur++;
+    }
+
+    // intervals that have already been overwritten
+    if( cur > r->nslot && s->drained < cur - r->nslot ){
+        s->drained = cur - r->nslot;
+    }
+
+    nword = ( offsetof( tempest_stats_slot_t, latency ) -
+              offsetof( tempest_stats_slot_t, success ) ) / sizeof( uint64_t ) +
+            r->slot_hist.len;
+    if( !( slot = malloc( r->slot_nbyte ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    lua_newtable( L );
+    for( seq = s->drained + 1; seq < cur; seq++ )
+    {
+        uint64_t *sum = &slot->success;
+        uint64_t vals[NPERCENTILE] = { 0 };
+        uint64_t total = 0;
+        uint64_t vmax = 0;
+        size_t i = 0;
+        size_t j = 0;
+
+        // merge the slots of all shards
+        memset( (void*)sum, 0, nword * sizeof( uint64_t ) );
+        for(; i < r->nshard; i++ )
+        {
+            tempest_stats_slot_t *src = tempest_stats_ring(
+                s, tempest_stats_shard( s, i ), seq
+            );
+
+            if( __atomic_load_n( &src->seq, __ATOMIC_ACQUIRE ) == seq ){
+                uint64_t *words = &src->success;
+
+                for( j = 0; j < nword; j++ ){
+                    sum[j] += words[j];
                 }
-                prev_msec = msec;
             }
         }
 
-        if( g ){
-            lauxh_pushnum2tbl( L, "max", prev_msec );
-            lauxh_pushnum2tbl( L, "nreq", nreqs );
-            lua_rawseti( L, idx_mgrp, g );
+        for( i = 0; i < r->slot_hist.len; i++ ){
+            total += (&slot->latency)[i];
+        }
+        vmax = hist_percentiles( &r->slot_hist, &slot->latency, total, vals );
+
+        lua_createtable( L, 0, 12 );
+        lauxh_pushnum2tbl( L, "elapsed",
+                           (double)( ( seq - 1 ) * r->interval ) / 1000000000.0 );
+        lauxh_pushnum2tbl( L, "success", slot->success );
+        lauxh_pushnum2tbl( L, "failure", slot->failure );
+        lauxh_pushnum2tbl( L, "bytesSent", slot->bytes_sent );
+        lauxh_pushnum2tbl( L, "bytesRecv", slot->bytes_recv );
+        lauxh_pushnum2tbl( L, "nreq", total );
+        lauxh_pushnum2tbl( L, "p50", (double)vals[0] / 1000000.0 );
+        lauxh_pushnum2tbl( L, "p90", (double)vals[1] / 1000000.0 );
+        lauxh_pushnum2tbl( L, "p99", (double)vals[2] / 1000000.0 );
+        lauxh_pushnum2tbl( L, "p999", (double)vals[3] / 1000000.0 );
+        lauxh_pushnum2tbl( L, "p9999", (double)vals[4] / 1000000.0 );
+        lauxh_pushnum2tbl( L, "max", (double)vmax / 1000000.0 );
+        lua_rawseti( L, -2, ++idx );
+    }
+    s->drained = cur - 1;
+    free( (void*)slot );
+
+    return 1;
+}
+
+
+static int start_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+
+    if( s->region ){
+        uint64_t epoch = tempest_stats_now( s );
+
+        s->drained = 0;
+        __atomic_store_n( &s->region->epoch, epoch, __ATOMIC_RELEASE );
+        lua_pushnumber( L, epoch );
+    }
+    else {
+        lua_pushnil( L );
+    }
+
+    return 1;
+}
+
+
+/**
+ * stop_lua
+ *  ends the measurement phase. the recordings are discarded until the
+ *  stats is started again. returns the stop time.
+ */
+static int stop_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+
+    if( s->region ){
+        __atomic_store_n( &s->region->epoch, 0, __ATOMIC_RELEASE );
+        lua_pushnumber( L, tempest_stats_now( s ) );
+    }
+    else {
+        lua_pushnil( L );
+    }
+
+    return 1;
+}
+
+
+/**
+ * clock_init
+ *  initializes the clock source of name. the TSC is calibrated against
+ *  CLOCK_MONOTONIC over 50ms, and it is available only if the CPU supports
+ *  the invariant TSC. the clock sources that the platform does not provide
+ *  are rejected with ENOTSUP.
+ */
+static int clock_init( tempest_clock_t *c, const char *name )
+{
+    memset( (void*)c, 0, sizeof( tempest_clock_t ) );
+    if( strcmp( name, "monotonic" ) == 0 ){
+        c->id = TEMPEST_CLOCK_MONOTONIC;
+        c->clkid = CLOCK_MONOTONIC;
+        return 0;
+    }
+#if defined(TEMPEST_HAVE_CLOCK_COARSE)
+    else if( strcmp( name, "coarse" ) == 0 ){
+        c->id = TEMPEST_CLOCK_COARSE;
+        c->clkid = CLOCK_MONOTONIC_COARSE;
+        return 0;
+    }
+#endif
+#if defined(TEMPEST_HAVE_CLOCK_RAW)
+    else if( strcmp( name, "raw" ) == 0 ){
+        c->id = TEMPEST_CLOCK_RAW;
+        c->clkid = CLOCK_MONOTONIC_RAW;
+        return 0;
+    }
+#endif
+    else if( strcmp( name, "coarse" ) == 0 || strcmp( name, "raw" ) == 0 ){
+        errno = ENOTSUP;
+        return -1;
+    }
+#if defined(TEMPEST_HAVE_TSC)
+    else if( strcmp( name, "rdtsc" ) == 0 )
+    {
+        tempest_clock_t mono = { .id = TEMPEST_CLOCK_MONOTONIC,
+                                 .clkid = CLOCK_MONOTONIC };
+        struct timespec delay = { .tv_sec = 0, .tv_nsec = 50000000 };
+        unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+        uint64_t tsc = 0;
+        uint64_t nsec = 0;
+
+        // invariant TSC: CPUID.80000007H:EDX[8]
+        if( !__get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) ||
+            !( edx & ( 1 << 8 ) ) ){
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        c->nsec_base = tempest_clock_gettime( &mono );
+        c->tsc_base = __rdtsc();
+        nanosleep( &delay, NULL );
+        nsec = tempest_clock_gettime( &mono ) - c->nsec_base;
+        tsc = __rdtsc() - c->tsc_base;
+        if( !tsc || !nsec ){
+            errno = EINVAL;
+            return -1;
         }
-        lauxh_pushnum2tblat( L, "avg", (double)avg / (double)k / 100.0, idx_msec );
-        lauxh_pushnum2tblat( L, "min", min_nreq, idx_nreq );
-        lauxh_pushnum2tblat( L, "max", max_nreq, idx_nreq );
-        lua_rawset( L, 1 );
-        lua_rawset( L, 1 );
-        lua_rawset( L, 1 );
+        c->id = TEMPEST_CLOCK_TSC;
+        c->clkid = CLOCK_MONOTONIC;
+        c->tsc_mult = (uint64_t)( ( (unsigned __int128)nsec <<
+                                    TEMPEST_TSC_SHIFT ) / tsc );
+        return 0;
+    }
+#endif
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+/**
+ * clock_lua
+ *  selects the clock source and returns the resolution and the overhead per
+ *  call in nanoseconds measured by the self-test.
+ */
+static int clock_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    const char *name = lauxh_optstring( L, 2, "monotonic" );
+    tempest_clock_t mono = { .id = TEMPEST_CLOCK_MONOTONIC,
+                             .clkid = CLOCK_MONOTONIC };
+    tempest_clock_t c;
+    uint64_t resolution = UINT64_MAX;
+    uint64_t elapsed = 0;
+    uint64_t prev = 0;
+    uint64_t cur = 0;
+    int i = 0;
+
+    if( !s->region ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( EBADF ) );
+        return 2;
+    }
+    else if( clock_init( &c, name ) != 0 ){
+        lua_pushnil( L );
+        lua_pushfstring( L, "%s: %s", name, strerror( errno ) );
+        return 2;
+    }
+
+    // resolution: smallest observed step of 10 ticks
+    for(; i < 10; i++ )
+    {
+        prev = tempest_clock_gettime( &c );
+        while( ( cur = tempest_clock_gettime( &c ) ) == prev ){
+            continue;
+        }
+        if( cur - prev < resolution ){
+            resolution = cur - prev;
+        }
+    }
+
+    // overhead: average time per call
+    elapsed = tempest_clock_gettime( &mono );
+    for( i = 0; i < 1000000; i++ ){
+        prev += tempest_clock_gettime( &c );
+    }
+    elapsed = tempest_clock_gettime( &mono ) - elapsed;
+
+    s->region->clock = c;
+    lua_pushnumber( L, resolution );
+    lua_pushnumber( L, (double)elapsed / 1000000.0 );
+
+    return 2;
+}
+
+
+static int now_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+
+    lua_pushnumber( L, tempest_stats_now( s ) );
+
+    return 1;
+}
+
+
+static int shard_lua( lua_State *L )
+{
+    tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
+    size_t idx = lauxh_checkuint32( L, 2 );
+
+    if( !s->region || idx < 1 || idx > s->region->nshard ){
+        lua_pushboolean( L, 0 );
+    }
+    else {
+        s->data = tempest_stats_shard( s, idx - 1 );
+        // first-touch the shard from the calling worker
+        memset( (void*)s->data, 0, s->region->shard_nbyte );
+        lua_pushboolean( L, 1 );
     }
 
     return 1;
@@ -192,8 +1442,11 @@ static int reset_lua( lua_State *L )
 {
     tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
 
-    if( s->data ){
-        memset( (void*)s->data, 0, s->nbyte );
+    if( s->region ){
+        memset( (void*)tempest_stats_shard( s, 0 ), 0,
+                s->region->shard_nbyte * s->region->nshard );
+        s->region->epoch = 0;
+        s->drained = 0;
     }
 
     return 0;
@@ -204,8 +1457,9 @@ static int dispose_lua( lua_State *L )
 {
     tempest_stats_t *s = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
 
-    if( s->data && s->pid == getpid() ){
-        munmap( (void*)s->data, s->nbyte );
+    if( s->region && s->pid == getpid() ){
+        munmap( (void*)s->region, s->nbyte );
+        s->region = NULL;
         s->data = NULL;
     }
 
@@ -234,9 +1488,10 @@ static int gc_lua( lua_State *L )
 {
     tempest_stats_t *s = (tempest_stats_t*)lua_touserdata( L, 1 );
 
-    if( s->data && s->pid == getpid() ){
-        munmap( (void*)s->data, s->nbyte );
+    if( s->region && s->pid == getpid() ){
+        munmap( (void*)s->region, s->nbyte );
     }
+    lauxh_unref( L, s->snapref );
 
     return 0;
 }
@@ -245,16 +1500,75 @@ static int gc_lua( lua_State *L )
 static int new_lua( lua_State *L )
 {
     uint32_t msec = lauxh_checkuint32( L, 1 );
-    size_t len = (size_t)msec * 100;
-    tempest_stats_t *s = lua_newuserdata( L, sizeof( tempest_stats_t ) );
+    uint32_t sigdigs = lauxh_optuint32( L, 2, TEMPEST_HIST_SIGDIGS );
+    uint32_t nshard = lauxh_optuint32( L, 3, 1 );
+    uint32_t interval = lauxh_optuint32( L, 4, 0 );
+    uint32_t nlabel = lauxh_optuint32( L, 5, 0 );
+    tempest_hist_t hist;
+    tempest_hist_t slot_hist;
+    tempest_stats_t *s = NULL;
+    size_t data_nbyte = 0;
+    size_t slot_nbyte = 0;
+    size_t nslot = 0;
+    void *region = NULL;
+
+    if( nshard < 1 ){
+        return lauxh_argerror( L, 3, "nshard must be greater than 0" );
+    }
+    else if( nlabel > TEMPEST_STATS_MAXLABEL ){
+        return lauxh_argerror( L, 5, "nlabel must be less than or equal to "
+                                     "%d", TEMPEST_STATS_MAXLABEL );
+    }
+    // per-interval snapshots use at most 2 significant digits to keep
+    // the ring small
+    else if( tempest_hist_init( &hist, (uint64_t)msec * 1000000,
+                                sigdigs ) != 0 ||
+             tempest_hist_init( &slot_hist, (uint64_t)msec * 1000000,
+                                sigdigs < 2 ? sigdigs : 2 ) != 0 ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+
+    data_nbyte = TEMPEST_ALIGN( offsetof( tempest_stats_data_t, latency ) +
+                                sizeof( uint64_t ) * hist.len * TEMPEST_NHIST +
+                                sizeof( uint64_t ) * ( hist.len + 1 ) *
+                                nlabel + sizeof( tempest_stats_outcome_t ) );
+    if( interval ){
+        nslot = TEMPEST_STATS_NSLOT;
+        slot_nbyte = TEMPEST_ALIGN( offsetof( tempest_stats_slot_t, latency ) +
+                                    sizeof( uint64_t ) * slot_hist.len );
+    }
 
+    s = lua_newuserdata( L, sizeof( tempest_stats_t ) );
     memset( (void*)s, 0, sizeof( tempest_stats_t ) );
-    s->nbyte = sizeof( uint64_t ) * len + sizeof( tempest_stats_data_t );
-    s->data = (tempest_stats_data_t*)mmap( NULL, s->nbyte, PROT_READ|PROT_WRITE,
-                                          MAP_ANONYMOUS|MAP_SHARED, -1, 0 );
-    if( s->data ){
-        memset( (void*)s->data, 0, s->nbyte );
-        s->data->len = len;
+    s->snapref = LUA_NOREF;
+    s->nbyte = TEMPEST_STATS_HEADER_SIZE +
+               ( data_nbyte + slot_nbyte * nslot ) * nshard;
+    region = mmap( NULL, s->nbyte, PROT_READ|PROT_WRITE,
+                   MAP_ANONYMOUS|MAP_SHARED, -1, 0 );
+    // the anonymous mapping is zero-filled; the pages of each shard are
+    // touched first by the worker that selects it so that they are placed
+    // on the NUMA node of the worker
+    if( region != MAP_FAILED ){
+        s->region = (tempest_stats_region_t*)region;
+        *s->region = (tempest_stats_region_t){
+            .clock = {
+                .id = TEMPEST_CLOCK_MONOTONIC,
+                .clkid = CLOCK_MONOTONIC
+            },
+            .hist = hist,
+            .nshard = nshard,
+            .shard_nbyte = data_nbyte + slot_nbyte * nslot,
+            .data_nbyte = data_nbyte,
+            .nlabel = nlabel,
+            .slot_hist = slot_hist,
+            .nslot = nslot,
+            .slot_nbyte = slot_nbyte,
+            .interval = (uint64_t)interval * 1000000,
+            .epoch = 0
+        };
+        s->data = tempest_stats_shard( s, 0 );
         s->pid = getpid();
         lauxh_setmetatable( L, TEMPEST_STATS_MT );
         return 1;
@@ -281,10 +1595,22 @@ LUALIB_API int luaopen_tempest_stats( lua_State *L )
         struct luaL_Reg method[] = {
             { "dispose", dispose_lua },
             { "reset", reset_lua },
+            { "shard", shard_lua },
+            { "clock", clock_lua },
+            { "now", now_lua },
+            { "start", start_lua },
+            { "stop", stop_lua },
+            { "drain", drain_lua },
             { "data", data_lua },
+            { "hist", hist_lua },
+            { "counts", counts_lua },
+            { "snapshot", snapshot_lua },
+            { "encode", encode_lua },
+            { "merge", merge_lua },
             // stat
             { "incrSuccess", incr_success_lua },
             { "incrFailure", incr_failure_lua },
+            { "addFailure", add_failure_lua },
             { "addBytesSent", add_bytes_sent_lua },
             { "addBytesRecv", add_bytes_recv_lua },
             { "incrEConnect", incr_econnect_lua },
@@ -293,6 +1619,8 @@ LUALIB_API int luaopen_tempest_stats( lua_State *L )
             { "incrESend", incr_esend_lua },
             { "incrESendTimeo", incr_esend_timeo_lua },
             { "incrEInternal", incr_einternal_lua },
+            { "incrStatus", incr_status_lua },
+            { "recordLoopLag", record_loop_lag_lua },
             { NULL, NULL }
         };
         struct luaL_Reg *ptr = mmethod;
@@ -310,6 +1638,21 @@ LUALIB_API int luaopen_tempest_stats( lua_State *L )
             lauxh_pushfn2tbl( L, ptr->name, ptr->func );
             ptr++;
         } while( ptr->name );
+        lua_pushliteral( L, "incrErrno" );
+        push_errnos( L );
+        lua_pushcclosure( L, incr_errno_lua, 1 );
+        lua_rawset( L, -3 );
+        lua_rawset( L, -3 );
+    }
+    lua_settop( L, 0 );
+
+    // create metatable of snapshot
+    if( luaL_newmetatable( L, TEMPEST_SNAPSHOT_MT ) )
+    {
+        lauxh_pushfn2tbl( L, "__tostring", snapshot_tostring_lua );
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        lauxh_pushfn2tbl( L, "data", snapshot_data_lua );
         lua_rawset( L, -3 );
     }
     lua_settop( L, 0 );
@@ -317,6 +1660,21 @@ LUALIB_API int luaopen_tempest_stats( lua_State *L )
     // create module table
     lua_newtable( L );
     lauxh_pushfn2tbl( L, "new", new_lua );
+    lauxh_pushfn2tbl( L, "compare", compare_lua );
+    // clock sources that the platform provides
+    lua_pushliteral( L, "clocks" );
+    lua_newtable( L );
+    lauxh_pushbool2tbl( L, "monotonic", 1 );
+#if defined(TEMPEST_HAVE_CLOCK_COARSE)
+    lauxh_pushbool2tbl( L, "coarse", 1 );
+#endif
+#if defined(TEMPEST_HAVE_CLOCK_RAW)
+    lauxh_pushbool2tbl( L, "raw", 1 );
+#endif
+#if defined(TEMPEST_HAVE_TSC)
+    lauxh_pushbool2tbl( L, "rdtsc", 1 );
+#endif
+    lua_rawset( L, -3 );
 
     return 1;
 }
@@ -30,16 +30,427 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include "lauxhlib.h"
 
 
+/**
+ * clock source
+ *
+ * TEMPEST_CLOCK_COARSE: CLOCK_MONOTONIC_COARSE (cheap but ticks every 1-4ms)
+ * TEMPEST_CLOCK_MONOTONIC: CLOCK_MONOTONIC
+ * TEMPEST_CLOCK_RAW: CLOCK_MONOTONIC_RAW
+ * TEMPEST_CLOCK_TSC: invariant TSC calibrated against CLOCK_MONOTONIC
+ */
+enum {
+    TEMPEST_CLOCK_COARSE = 0,
+    TEMPEST_CLOCK_MONOTONIC,
+    TEMPEST_CLOCK_RAW,
+    TEMPEST_CLOCK_TSC
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TEMPEST_HAVE_TSC    1
+#endif
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+// clock_gettime(2) is unavailable before macOS 10.12; the monotonic clock
+// reads mach_absolute_time instead, and the coarse and raw clocks are not
+// available
+#if !defined(CLOCK_MONOTONIC)
+typedef int clockid_t;
+#define CLOCK_MONOTONIC     0
+#endif
+#else
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define TEMPEST_HAVE_CLOCK_COARSE   1
+#endif
+#if defined(CLOCK_MONOTONIC_RAW)
+#define TEMPEST_HAVE_CLOCK_RAW      1
+#endif
+#endif
+
+// nsec = nsec_base + ( ( tsc - tsc_base ) * tsc_mult ) >> TEMPEST_TSC_SHIFT
+#define TEMPEST_TSC_SHIFT   32
+
+typedef struct {
+    int id;
+    clockid_t clkid;
+    uint64_t tsc_base;
+    uint64_t tsc_mult;
+    uint64_t nsec_base;
+} tempest_clock_t;
+
+
+static inline uint64_t tempest_clock_gettime( tempest_clock_t *c )
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t tbinfo = { 0 };
+#else
+    struct timespec ts = {0};
+#endif
+
+#if defined(TEMPEST_HAVE_TSC)
+    if( c->id == TEMPEST_CLOCK_TSC ){
+        return c->nsec_base +
+               (uint64_t)( ( (unsigned __int128)( __rdtsc() - c->tsc_base ) *
+                             c->tsc_mult ) >> TEMPEST_TSC_SHIFT );
+    }
+#endif
+
+#if defined(__APPLE__)
+    if( tbinfo.denom == 0 ){
+        (void)mach_timebase_info( &tbinfo );
+    }
+
+    return mach_absolute_time() * tbinfo.numer / tbinfo.denom;
+#else
+    clock_gettime( c->clkid, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * log-linear latency histogram
+ *
+ * values are tracked in nanoseconds with the HdrHistogram bucket layout;
+ * each power-of-two bucket is split into sub-buckets so that every recorded
+ * value keeps `sigdigs` significant decimal digits. e.g. 3 significant digits
+ * from 1ns to 1h needs 33792 counters (264KB).
+ */
+#define TEMPEST_HIST_SIGDIGS_MIN    1
+#define TEMPEST_HIST_SIGDIGS_MAX    5
+#define TEMPEST_HIST_SIGDIGS        3
+
+typedef struct {
+    uint64_t highest;
+    uint64_t sub_mask;
+    uint32_t sigdigs;
+    uint32_t sub_half_mag;
+    uint32_t sub_count;
+    uint32_t sub_half_count;
+    uint32_t bucket_count;
+    size_t len;
+} tempest_hist_t;
+
+
+static inline int tempest_hist_init( tempest_hist_t *h, uint64_t highest,
+                                     uint32_t sigdigs )
+{
+    uint64_t largest = 2;
+    uint64_t untrackable = 0;
+    uint32_t mag = 0;
+    uint32_t nbucket = 1;
+    uint32_t i = 0;
+
+    if( sigdigs < TEMPEST_HIST_SIGDIGS_MIN ||
+        sigdigs > TEMPEST_HIST_SIGDIGS_MAX ){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // largest value with single unit resolution
+    for(; i < sigdigs; i++ ){
+        largest *= 10;
+    }
+    while( ( (uint64_t)1 << mag ) < largest ){
+        mag++;
+    }
+
+    *h = (tempest_hist_t){
+        .sigdigs = sigdigs,
+        .sub_half_mag = mag - 1,
+        .sub_count = (uint32_t)1 << mag,
+        .sub_half_count = (uint32_t)1 << ( mag - 1 ),
+        .sub_mask = ( (uint64_t)1 << mag ) - 1
+    };
+
+    // highest trackable value must be at least twice the sub-bucket count
+    if( highest < (uint64_t)h->sub_count * 2 ){
+        highest = (uint64_t)h->sub_count * 2;
+    }
+    h->highest = highest;
+
+    // number of buckets required to cover highest trackable value
+    untrackable = h->sub_count;
+    while( untrackable <= highest )
+    {
+        if( untrackable > INT64_MAX / 2 ){
+            nbucket++;
+            break;
+        }
+        untrackable <<= 1;
+        nbucket++;
+    }
+    h->bucket_count = nbucket;
+    h->len = (size_t)( nbucket + 1 ) * h->sub_half_count;
+
+    return 0;
+}
+
+
+/**
+ * tempest_hist_index
+ *  returns the counter index of value. values greater than the highest
+ *  trackable value are saturated into the last counter.
+ */
+static inline size_t tempest_hist_index( tempest_hist_t *h, uint64_t v )
+{
+    uint32_t pow2ceil = 0;
+    uint32_t bidx = 0;
+    uint64_t sidx = 0;
+
+    if( v > h->highest ){
+        v = h->highest;
+    }
+    pow2ceil = 64 - __builtin_clzll( v | h->sub_mask );
+    bidx = pow2ceil - ( h->sub_half_mag + 1 );
+    sidx = v >> bidx;
+
+    return ( (size_t)( bidx + 1 ) << h->sub_half_mag ) +
+           ( sidx - h->sub_half_count );
+}
+
+
+/**
+ * tempest_hist_value
+ *  returns the lowest value that is equivalent to the counter index, and
+ *  the size of the range of equivalent values into *width.
+ */
+static inline uint64_t tempest_hist_value( tempest_hist_t *h, size_t idx,
+                                           uint64_t *width )
+{
+    int32_t bidx = (int32_t)( idx >> h->sub_half_mag ) - 1;
+    uint64_t sidx = ( idx & ( h->sub_half_count - 1 ) ) + h->sub_half_count;
+
+    if( bidx < 0 ){
+        sidx -= h->sub_half_count;
+        bidx = 0;
+    }
+    if( width ){
+        *width = (uint64_t)1 << bidx;
+    }
+
+    return sidx << bidx;
+}
+
+
+/**
+ * sparse encoding of counters
+ *
+ * the counters are encoded in the following endian-independent format;
+ *
+ *  magic(4) version(1) <header varints> varint(nnz) { varint(gap) varint(n) }
+ *
+ * nnz is the number of non-zero counters, gap is the distance from the
+ * previous non-zero counter (the index of the first one plus 1), and n is
+ * the value of counter. all varints are unsigned LEB128.
+ */
+#define TEMPEST_ENC_VERSION     1
+#define TEMPEST_ENC_MAGICLEN    4
+// maximum length of varint of uint64_t
+#define TEMPEST_VARINT_MAXLEN   10
+
+typedef struct {
+    const uint8_t *cur;
+    const uint8_t *end;
+} tempest_dec_t;
+
+
+static inline size_t tempest_enc_varint( uint8_t *buf, uint64_t v )
+{
+    size_t len = 0;
+
+    while( v >= 0x80 ){
+        buf[len++] = (uint8_t)( v | 0x80 );
+        v >>= 7;
+    }
+    buf[len++] = (uint8_t)v;
+
+    return len;
+}
+
+
+static inline int tempest_dec_varint( tempest_dec_t *d, uint64_t *v )
+{
+    uint64_t val = 0;
+    int shift = 0;
+
+    while( d->cur < d->end && shift < 64 )
+    {
+        uint8_t c = *d->cur++;
+
+        val |= (uint64_t)( c & 0x7f ) << shift;
+        if( !( c & 0x80 ) ){
+            *v = val;
+            return 0;
+        }
+        shift += 7;
+    }
+
+    // truncated or overflowed
+    return -1;
+}
+
+
+static inline uint64_t tempest_enc_get( const void *data, size_t width,
+                                        size_t idx )
+{
+    if( width == sizeof( uint32_t ) ){
+        return ( (const uint32_t*)data )[idx];
+    }
+    return ( (const uint64_t*)data )[idx];
+}
+
+
+/**
+ * tempest_enc_nnz
+ *  returns the number of non-zero counters.
+ */
+static inline size_t tempest_enc_nnz( const void *data, size_t width,
+                                      size_t len )
+{
+    size_t nnz = 0;
+    size_t i = 0;
+
+    for(; i < len; i++ ){
+        nnz += tempest_enc_get( data, width, i ) != 0;
+    }
+
+    return nnz;
+}
+
+
+/**
+ * tempest_enc_sparse
+ *  encodes nnz and the non-zero counters into buf that must have at least
+ *  ( nnz * 2 + 1 ) * TEMPEST_VARINT_MAXLEN bytes. returns the length.
+ */
+static inline size_t tempest_enc_sparse( uint8_t *buf, const void *data,
+                                         size_t width, size_t len,
+                                         size_t nnz )
+{
+    size_t nbyte = tempest_enc_varint( buf, nnz );
+    size_t prev = 0;
+    size_t i = 0;
+
+    for(; i < len; i++ )
+    {
+        uint64_t v = tempest_enc_get( data, width, i );
+
+        if( v ){
+            nbyte += tempest_enc_varint( buf + nbyte, i + 1 - prev );
+            nbyte += tempest_enc_varint( buf + nbyte, v );
+            prev = i + 1;
+        }
+    }
+
+    return nbyte;
+}
+
+
+/**
+ * tempest_dec_sparse
+ *  decodes the non-zero counters and adds them to the counters of dst
+ *  without expanding the encoded data. if dst is NULL, it only validates
+ *  the data. returns -1 on malformed data.
+ */
+static inline int tempest_dec_sparse( tempest_dec_t *d, void *dst,
+                                      size_t width, size_t len )
+{
+    uint64_t nnz = 0;
+    uint64_t idx = 0;
+
+    if( tempest_dec_varint( d, &nnz ) || nnz > len ){
+        return -1;
+    }
+
+    while( nnz-- )
+    {
+        uint64_t gap = 0;
+        uint64_t v = 0;
+
+        if( tempest_dec_varint( d, &gap ) || tempest_dec_varint( d, &v ) ||
+            gap == 0 || gap > len - idx ||
+            ( width == sizeof( uint32_t ) && v > UINT32_MAX ) ){
+            return -1;
+        }
+        idx += gap;
+        if( dst ){
+            if( width == sizeof( uint32_t ) ){
+                ( (uint32_t*)dst )[idx - 1] += (uint32_t)v;
+            }
+            else {
+                ( (uint64_t*)dst )[idx - 1] += v;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
 #define TEMPEST_STATS_MT    "tempest.stats"
 
+#define TEMPEST_CACHELINE   64
+#define TEMPEST_ALIGN(n)    \
+    (((n) + TEMPEST_CACHELINE - 1) & ~((size_t)TEMPEST_CACHELINE - 1))
+
+/**
+ * histograms of shard
+ *
+ * TEMPEST_HIST_LATENCY: latency measured from the intended start time if
+ *                       the request was scheduled, otherwise same as the
+ *                       uncorrected latency.
+ * TEMPEST_HIST_UNCORRECTED: latency measured from the actual start time of
+ *                           scheduled requests.
+ * TEMPEST_HIST_TTFB: time to first byte of the response.
+ * TEMPEST_HIST_CONNECT: time to establish a connection including the TLS
+ *                       handshake.
+ * TEMPEST_HIST_LAG: how far the actual start time of scheduled requests fell
+ *                   behind the intended start time.
+ * TEMPEST_HIST_LOOP: event-loop lag of the worker; how late the coroutine
+ *                    was resumed after it became runnable.
+ * TEMPEST_HIST_FAILURE: time until the request failed by an error, timeout
+ *                       or the script.
+ * TEMPEST_HIST_HANDSHAKE: time of the full TLS handshakes.
+ * TEMPEST_HIST_RESUMED: time of the TLS handshakes that resumed the session.
+ *
+ * new histograms must be appended to keep the encoded stats of older
+ * layout decodable.
+ */
+enum {
+    TEMPEST_HIST_LATENCY = 0,
+    TEMPEST_HIST_UNCORRECTED,
+    TEMPEST_HIST_TTFB,
+    TEMPEST_HIST_CONNECT,
+    TEMPEST_HIST_LAG,
+    TEMPEST_HIST_LOOP,
+    TEMPEST_HIST_FAILURE,
+    TEMPEST_HIST_HANDSHAKE,
+    TEMPEST_HIST_RESUMED,
+    TEMPEST_NHIST
+};
+
+/**
+ * shard of stats
+ *
+ * each worker owns one shard and is the only writer of it, so the counters
+ * and histograms are updated with plain stores. shards are aligned to the
+ * cache-line size to avoid false sharing between workers.
+ */
 typedef struct {
     uint64_t success;
     uint64_t failure;
@@ -54,24 +465,323 @@ typedef struct {
     uint64_t esend_timeo;
     uint64_t einternal;
 
-    size_t len;
+    // TEMPEST_NHIST histograms
     uint64_t latency;
 } tempest_stats_data_t;
 
 
+/**
+ * per-label measurement
+ *
+ * the labels of measure('label') calls are registered at compile time of
+ * the script and each shard has nlabel of them after the histograms, so
+ * the worker records them by index.
+ */
+#define TEMPEST_STATS_MAXLABEL  64
+
+typedef struct {
+    uint64_t failure;
+    // latency histogram
+    uint64_t latency;
+} tempest_stats_label_t;
+
+
+/**
+ * outcome counters
+ *
+ * each shard has the counters of the failures by errno and the responses by
+ * HTTP status code after the labels. errno 0 counts the failures that have
+ * no errno such as closed by peer, and the errnos out of range. the status
+ * codes are counted from 100 to 599.
+ */
+#if defined(ELAST)
+// BSD and macOS
+# define TEMPEST_STATS_NERRNO   (ELAST + 1)
+#elif defined(EHWPOISON)
+// the last errno of Linux
+# define TEMPEST_STATS_NERRNO   (EHWPOISON + 1)
+#else
+# define TEMPEST_STATS_NERRNO   256
+#endif
+#define TEMPEST_STATS_NSTATUS   500
+
+typedef struct {
+    uint64_t errnos[TEMPEST_STATS_NERRNO];
+    uint64_t status[TEMPEST_STATS_NSTATUS];
+} tempest_stats_outcome_t;
+
+#define TEMPEST_STATS_NOUTCOME  \
+    (sizeof(tempest_stats_outcome_t) / sizeof(uint64_t))
+
+
+/**
+ * per-interval snapshot of shard
+ *
+ * each shard has a ring of slots. a slot is reset and stamped with the
+ * sequence number of the interval (1-based) by the worker when it records
+ * the first value of the interval. the parent process merges the slots of
+ * completed intervals without locking.
+ */
+#define TEMPEST_STATS_NSLOT     8
+
+typedef struct {
+    uint64_t seq;
+    uint64_t success;
+    uint64_t failure;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+
+    uint64_t latency;
+} tempest_stats_slot_t;
+
+
+/**
+ * shared stats region
+ *
+ * +--------+---------+---------+-----+
+ * | header | shard 0 | shard 1 | ... |
+ * +--------+---------+---------+-----+
+ *
+ * shard: data and nslot slots
+ *
+ * +------+--------+--------+-----+
+ * | data | slot 0 | slot 1 | ... |
+ * +------+--------+--------+-----+
+ *
+ * data: counters, histograms, nlabel labels and outcome counters
+ */
+typedef struct {
+    tempest_clock_t clock;
+    tempest_hist_t hist;
+    size_t nshard;
+    size_t shard_nbyte;
+    size_t data_nbyte;
+    size_t nlabel;
+    // per-interval snapshots
+    tempest_hist_t slot_hist;
+    size_t nslot;
+    size_t slot_nbyte;
+    uint64_t interval;
+    // start time of the measurement phase. it is 0 during the ramp-up and
+    // warm-up phase, and the recordings are discarded until it is set
+    uint64_t epoch;
+} tempest_stats_region_t;
+
+#define TEMPEST_STATS_HEADER_SIZE   TEMPEST_ALIGN(sizeof(tempest_stats_region_t))
+
+
 typedef struct {
     pid_t pid;
     size_t nbyte;
+    tempest_stats_region_t *region;
     tempest_stats_data_t *data;
+    // current slot of worker
+    tempest_stats_slot_t *slot;
+    uint64_t slot_deadline;
+    // last sequence number that drained by parent
+    uint64_t drained;
+    // reference of the snapshot that is reused by the data method
+    int snapref;
 } tempest_stats_t;
 
 
-static inline void tempest_stats_record( tempest_stats_t *s, uint64_t nsec )
+/**
+ * snapshot of stats
+ *
+ * the sum of all shards that copied into the buffer owned by the caller.
+ * words has the same layout as tempest_stats_data_t.
+ */
+#define TEMPEST_SNAPSHOT_MT "tempest.stats.snapshot"
+// maximum number of percentiles that can be calculated at once
+#define TEMPEST_SNAPSHOT_MAXPCT     32
+// default maximum number of grouped histogram rows
+#define TEMPEST_SNAPSHOT_MAXROWS    50
+
+typedef struct {
+    tempest_hist_t hist;
+    size_t nword;
+    size_t nlabel;
+    // total number of requests of each histogram
+    uint64_t total[TEMPEST_NHIST];
+    uint64_t words[];
+} tempest_snapshot_t;
+
+
+static inline uint64_t tempest_stats_now( tempest_stats_t *s )
 {
-    size_t idx = nsec / 1000 / 10;
+    return tempest_clock_gettime( &s->region->clock );
+}
 
-    if( idx < s->data->len ){
-        __atomic_fetch_add( &(&s->data->latency)[idx], 1, __ATOMIC_RELAXED );
+
+/**
+ * tempest_stats_measuring
+ *  returns non-zero if the measurement phase has started.
+ */
+static inline int tempest_stats_measuring( tempest_stats_t *s )
+{
+    return __atomic_load_n( &s->region->epoch, __ATOMIC_RELAXED ) != 0;
+}
+
+
+static inline tempest_stats_data_t *tempest_stats_shard( tempest_stats_t *s,
+                                                         size_t idx )
+{
+    return (tempest_stats_data_t*)( (char*)s->region +
+                                    TEMPEST_STATS_HEADER_SIZE +
+                                    s->region->shard_nbyte * idx );
+}
+
+
+static inline tempest_stats_slot_t *tempest_stats_ring( tempest_stats_t *s,
+                                                        tempest_stats_data_t *data,
+                                                        uint64_t seq )
+{
+    return (tempest_stats_slot_t*)( (char*)data + s->region->data_nbyte +
+                                    s->region->slot_nbyte *
+                                    ( ( seq - 1 ) % s->region->nslot ) );
+}
+
+
+/**
+ * tempest_stats_slot
+ *  returns the slot of the interval that contains nsec, or NULL if the
+ *  per-interval snapshots are disabled or not started yet.
+ */
+static inline tempest_stats_slot_t *tempest_stats_slot( tempest_stats_t *s,
+                                                        uint64_t nsec )
+{
+    tempest_stats_region_t *r = s->region;
+    uint64_t epoch = 0;
+    uint64_t seq = 0;
+    tempest_stats_slot_t *slot = NULL;
+
+    if( nsec < s->slot_deadline ){
+        return s->slot;
+    }
+    epoch = __atomic_load_n( &r->epoch, __ATOMIC_ACQUIRE );
+    if( !r->nslot || !epoch || nsec < epoch ){
+        return NULL;
+    }
+
+    seq = ( nsec - epoch ) / r->interval + 1;
+    slot = tempest_stats_ring( s, s->data, seq );
+    if( slot->seq != seq ){
+        memset( (void*)&slot->success, 0,
+                r->slot_nbyte - offsetof( tempest_stats_slot_t, success ) );
+        __atomic_store_n( &slot->seq, seq, __ATOMIC_RELEASE );
+    }
+    s->slot = slot;
+    s->slot_deadline = epoch + seq * r->interval;
+
+    return slot;
+}
+
+
+static inline uint64_t *tempest_stats_hist( tempest_stats_data_t *data,
+                                            tempest_hist_t *hist, int id )
+{
+    return &data->latency + hist->len * id;
+}
+
+
+static inline void tempest_stats_record( tempest_stats_t *s, int id,
+                                         uint64_t nsec )
+{
+    tempest_hist_t *hist = &s->region->hist;
+
+    if( tempest_stats_measuring( s ) ){
+        tempest_stats_hist( s->data, hist, id )[tempest_hist_index( hist,
+                                                                    nsec )]++;
+    }
+}
+
+
+static inline tempest_stats_label_t *tempest_stats_label( tempest_stats_data_t *data,
+                                                          tempest_hist_t *hist,
+                                                          size_t idx )
+{
+    return (tempest_stats_label_t*)( tempest_stats_hist( data, hist,
+                                                         TEMPEST_NHIST ) +
+                                     ( hist->len + 1 ) * idx );
+}
+
+
+/**
+ * tempest_stats_record_label
+ *  records the latency into the label of 1-based id. 0 means no label.
+ */
+static inline void tempest_stats_record_label( tempest_stats_t *s, size_t id,
+                                               uint64_t nsec )
+{
+    if( id && id <= s->region->nlabel && tempest_stats_measuring( s ) ){
+        tempest_hist_t *hist = &s->region->hist;
+        tempest_stats_label_t *label = tempest_stats_label( s->data, hist,
+                                                            id - 1 );
+
+        (&label->latency)[tempest_hist_index( hist, nsec )]++;
+    }
+}
+
+
+static inline void tempest_stats_label_failure( tempest_stats_t *s, size_t id,
+                                                uint64_t n )
+{
+    if( id && id <= s->region->nlabel && tempest_stats_measuring( s ) ){
+        tempest_stats_label( s->data, &s->region->hist, id - 1 )->failure += n;
+    }
+}
+
+
+static inline tempest_stats_outcome_t *tempest_stats_outcome( tempest_stats_data_t *data,
+                                                              tempest_hist_t *hist,
+                                                              size_t nlabel )
+{
+    return (tempest_stats_outcome_t*)tempest_stats_label( data, hist, nlabel );
+}
+
+
+/**
+ * tempest_stats_errno
+ *  counts the failure of errno.
+ */
+static inline void tempest_stats_errno( tempest_stats_t *s, int err )
+{
+    if( tempest_stats_measuring( s ) ){
+        tempest_stats_outcome( s->data, &s->region->hist,
+                               s->region->nlabel )->errnos[
+            err > 0 && err < TEMPEST_STATS_NERRNO ? err : 0
+        ]++;
+    }
+}
+
+
+/**
+ * tempest_stats_status
+ *  counts the response of HTTP status code.
+ */
+static inline void tempest_stats_status( tempest_stats_t *s, int status )
+{
+    if( status >= 100 && status < 100 + TEMPEST_STATS_NSTATUS &&
+        tempest_stats_measuring( s ) ){
+        tempest_stats_outcome( s->data, &s->region->hist,
+                               s->region->nlabel )->status[status - 100]++;
+    }
+}
+
+
+/**
+ * tempest_stats_record_slot
+ *  records the latency of the request that completed at the time `at` into
+ *  the per-interval snapshot.
+ */
+static inline void tempest_stats_record_slot( tempest_stats_t *s, uint64_t at,
+                                              uint64_t nsec )
+{
+    tempest_stats_slot_t *slot = tempest_stats_slot( s, at );
+
+    if( slot ){
+        tempest_hist_t *hist = &s->region->slot_hist;
+        (&slot->latency)[tempest_hist_index( hist, nsec )]++;
     }
 }
 
@@ -99,14 +809,618 @@ static inline void tempest_array_incr( tempest_array_t *arr, uint64_t nsec )
 LUALIB_API int luaopen_tempest_array( lua_State *L );
 
 
+#define TEMPEST_CORPUS_MT       "tempest.corpus"
+#define TEMPEST_CORPUS_ENTRY_MT "tempest.corpus.entry"
+
+/**
+ * indexed corpus file
+ *
+ *  header
+ *  uint64_t offsets[nentry + 1]    offsets of entries from the data section
+ *  data section
+ */
+#define TEMPEST_CORPUS_MAGIC    "TCORPUS"
+#define TEMPEST_CORPUS_VERSION  1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nentry;
+} tempest_corpus_hdr_t;
+
+/**
+ * corpus that is mapped before fork and shared read-only by the workers.
+ * the selection state is private to each process.
+ */
+typedef struct {
+    void *addr;
+    size_t size;
+    const uint64_t *offs;
+    const char *data;
+    size_t nentry;
+    // state of selection
+    size_t seq;
+    uint64_t rng;
+    // constants of the zipf sampler
+    double exponent;
+    double hx1;
+    double hn;
+    double sv;
+} tempest_corpus_t;
+
+typedef struct {
+    int ref;
+    tempest_corpus_t *corpus;
+    const char *data;
+    size_t len;
+} tempest_corpus_entry_t;
+
+
+/**
+ * tempest_corpus_toentry
+ *  returns the corpus entry at idx, or NULL if it is not an entry.
+ */
+static inline tempest_corpus_entry_t *tempest_corpus_toentry( lua_State *L,
+                                                              int idx )
+{
+    tempest_corpus_entry_t *e = NULL;
+
+    if( lua_type( L, idx ) == LUA_TUSERDATA && lua_getmetatable( L, idx ) )
+    {
+        luaL_getmetatable( L, TEMPEST_CORPUS_ENTRY_MT );
+        if( lua_rawequal( L, -1, -2 ) ){
+            e = (tempest_corpus_entry_t*)lua_touserdata( L, idx );
+        }
+        lua_pop( L, 2 );
+    }
+
+    return e;
+}
+
+
+LUALIB_API int luaopen_tempest_corpus( lua_State *L );
+
+
+#define TEMPEST_HTTP_TEMPLATE_MT    "tempest.http.template"
+
+/**
+ * pre-serialized request template
+ *
+ * the request is split into segments; a literal segment refers to the range
+ * of buf, a slot segment is substituted with the argument at sending time.
+ */
+#define TEMPEST_HTTP_NSLOT      9
+#define TEMPEST_HTTP_SEG_LITERAL    0
+// content-length of the body that contains the slots
+#define TEMPEST_HTTP_SEG_BODYLEN    -1
+
+typedef struct {
+    int slot;
+    size_t off;
+    size_t len;
+} tempest_http_seg_t;
+
+typedef struct {
+    int head;
+    char *buf;
+    size_t len;
+    size_t nseg;
+    // index of first segment of body
+    size_t body;
+    tempest_http_seg_t *segs;
+} tempest_http_tmpl_t;
+
+
+#define TEMPEST_HTTP_PARSER_MT  "tempest.http.parser"
+
+#define TEMPEST_HTTP_BUFSIZE    16384
+#define TEMPEST_HTTP_MAXLINE    65536
+
+typedef enum {
+    TEMPEST_HTTP_STATUS = 0,
+    TEMPEST_HTTP_HEADER,
+    TEMPEST_HTTP_BODY,
+    TEMPEST_HTTP_BODY_UNTIL_CLOSE,
+    TEMPEST_HTTP_CHUNK_SIZE,
+    TEMPEST_HTTP_CHUNK_DATA,
+    TEMPEST_HTTP_CHUNK_CRLF,
+    TEMPEST_HTTP_TRAILER,
+    TEMPEST_HTTP_DONE
+} tempest_http_state_t;
+
+/**
+ * incremental response parser
+ *
+ * the body is not retained; only the status code, keep-alive flag and the
+ * length of the body are reported. the bytes that follow the response are
+ * kept for the next response.
+ */
+typedef struct {
+    tempest_http_state_t state;
+    int head;
+    int status;
+    int keepalive;
+    int chunked;
+    int has_len;
+    uint64_t remain;
+    uint64_t nbody;
+    char *buf;
+    size_t cap;
+    size_t cur;
+    size_t len;
+} tempest_http_parser_t;
+
+
+static inline char *tempest_http_find_eol( char *str, size_t len )
+{
+    // accept bare LF as well
+    return memchr( str, '\n', len );
+}
+
+
+static inline size_t tempest_http_trim_cr( const char *line, size_t len )
+{
+    if( len && line[len - 1] == '\r' ){
+        return len - 1;
+    }
+    return len;
+}
+
+
+static inline int tempest_http_contains_token( const char *val, size_t vlen,
+                                               const char *token, size_t tlen )
+{
+    size_t i = 0;
+
+    for(; i + tlen <= vlen; i++ ){
+        if( strncasecmp( val + i, token, tlen ) == 0 ){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static inline int tempest_http_parse_status( tempest_http_parser_t *p,
+                                             const char *line, size_t len )
+{
+    int status = 0;
+    size_t i = 9;
+
+    // HTTP/1.x SP 3DIGIT
+    if( len < 12 || memcmp( line, "HTTP/1.", 7 ) != 0 || line[8] != ' ' ){
+        return -1;
+    }
+    for(; i < 12; i++ )
+    {
+        if( line[i] < '0' || line[i] > '9' ){
+            return -1;
+        }
+        status = status * 10 + line[i] - '0';
+    }
+
+    p->status = status;
+    p->keepalive = line[7] != '0';
+    p->chunked = 0;
+    p->has_len = 0;
+    p->remain = 0;
+
+    return 0;
+}
+
+
+static inline int tempest_http_parse_header( tempest_http_parser_t *p,
+                                             const char *line, size_t len )
+{
+    const char *sep = memchr( line, ':', len );
+    const char *val = NULL;
+    size_t klen = 0;
+    size_t vlen = 0;
+
+    if( !sep ){
+        return -1;
+    }
+    klen = sep - line;
+    val = sep + 1;
+    vlen = len - klen - 1;
+    while( vlen && ( *val == ' ' || *val == '\t' ) ){
+        val++;
+        vlen--;
+    }
+
+    if( klen == 14 && strncasecmp( line, "Content-Length", 14 ) == 0 )
+    {
+        uint64_t n = 0;
+        size_t i = 0;
+
+        // trailing whitespace
+        while( vlen && ( val[vlen - 1] == ' ' || val[vlen - 1] == '\t' ) ){
+            vlen--;
+        }
+        for(; i < vlen && val[i] >= '0' && val[i] <= '9'; i++ )
+        {
+            uint64_t d = (uint64_t)( val[i] - '0' );
+
+            // overflow
+            if( n > ( UINT64_MAX - d ) / 10 ){
+                return -1;
+            }
+            n = n * 10 + d;
+        }
+        // empty, trailing garbage or conflicting duplicate
+        if( i == 0 || i != vlen || ( p->has_len && p->remain != n ) ){
+            return -1;
+        }
+        p->has_len = 1;
+        p->remain = n;
+    }
+    else if( klen == 17 &&
+             strncasecmp( line, "Transfer-Encoding", 17 ) == 0 ){
+        p->chunked = tempest_http_contains_token( val, vlen, "chunked", 7 );
+    }
+    else if( klen == 10 && strncasecmp( line, "Connection", 10 ) == 0 )
+    {
+        if( tempest_http_contains_token( val, vlen, "close", 5 ) ){
+            p->keepalive = 0;
+        }
+        else if( tempest_http_contains_token( val, vlen, "keep-alive", 10 ) ){
+            p->keepalive = 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * tempest_http_parse
+ *  returns 1 if the response has been completed, 0 if more data is needed,
+ *  or -1 on malformed response.
+ */
+static inline int tempest_http_parse( tempest_http_parser_t *p )
+{
+    while( p->state != TEMPEST_HTTP_DONE )
+    {
+        char *str = p->buf + p->cur;
+        size_t avail = p->len - p->cur;
+        char *eol = NULL;
+        size_t llen = 0;
+
+        switch( p->state )
+        {
+            case TEMPEST_HTTP_BODY:
+            case TEMPEST_HTTP_CHUNK_DATA:
+                if( !avail ){
+                    return 0;
+                }
+                llen = avail < p->remain ? avail : (size_t)p->remain;
+                p->cur += llen;
+                p->nbody += llen;
+                p->remain -= llen;
+                if( !p->remain ){
+                    p->state = ( p->state == TEMPEST_HTTP_BODY ) ?
+                               TEMPEST_HTTP_DONE : TEMPEST_HTTP_CHUNK_CRLF;
+                }
+                continue;
+
+            case TEMPEST_HTTP_BODY_UNTIL_CLOSE:
+                p->cur += avail;
+                p->nbody += avail;
+                return 0;
+
+            default:
+            break;
+        }
+
+        // line oriented states
+        if( !( eol = tempest_http_find_eol( str, avail ) ) ){
+            if( avail > TEMPEST_HTTP_MAXLINE ){
+                return -1;
+            }
+            return 0;
+        }
+        llen = tempest_http_trim_cr( str, eol - str );
+        p->cur += eol - str + 1;
+
+        switch( p->state )
+        {
+            case TEMPEST_HTTP_STATUS:
+                if( tempest_http_parse_status( p, str, llen ) ){
+                    return -1;
+                }
+                p->state = TEMPEST_HTTP_HEADER;
+            break;
+
+            case TEMPEST_HTTP_HEADER:
+                if( llen ){
+                    if( tempest_http_parse_header( p, str, llen ) ){
+                        return -1;
+                    }
+                }
+                // interim response
+                else if( p->status / 100 == 1 && p->status != 101 ){
+                    p->state = TEMPEST_HTTP_STATUS;
+                }
+                // response without body
+                else if( p->head || p->status / 100 == 1 ||
+                         p->status == 204 || p->status == 304 ){
+                    p->state = TEMPEST_HTTP_DONE;
+                }
+                else if( p->chunked ){
+                    p->state = TEMPEST_HTTP_CHUNK_SIZE;
+                }
+                else if( p->has_len ){
+                    p->state = p->remain ? TEMPEST_HTTP_BODY :
+                                           TEMPEST_HTTP_DONE;
+                }
+                else {
+                    p->keepalive = 0;
+                    p->state = TEMPEST_HTTP_BODY_UNTIL_CLOSE;
+                }
+            break;
+
+            case TEMPEST_HTTP_CHUNK_SIZE: {
+                uint64_t n = 0;
+                size_t i = 0;
+
+                for(; i < llen; i++ )
+                {
+                    char c = str[i];
+                    uint64_t d = 0;
+
+                    if( c >= '0' && c <= '9' ){
+                        d = (uint64_t)( c - '0' );
+                    }
+                    else if( c >= 'a' && c <= 'f' ){
+                        d = (uint64_t)( c - 'a' + 10 );
+                    }
+                    else if( c >= 'A' && c <= 'F' ){
+                        d = (uint64_t)( c - 'A' + 10 );
+                    }
+                    // chunk-extension
+                    else if( c == ';' || c == ' ' || c == '\t' ){
+                        break;
+                    }
+                    else {
+                        return -1;
+                    }
+                    // overflow
+                    if( n > UINT64_MAX >> 4 ){
+                        return -1;
+                    }
+                    n = ( n << 4 ) | d;
+                }
+                if( i == 0 ){
+                    return -1;
+                }
+                p->remain = n;
+                p->state = n ? TEMPEST_HTTP_CHUNK_DATA : TEMPEST_HTTP_TRAILER;
+            } break;
+
+            case TEMPEST_HTTP_CHUNK_CRLF:
+                if( llen ){
+                    return -1;
+                }
+                p->state = TEMPEST_HTTP_CHUNK_SIZE;
+            break;
+
+            case TEMPEST_HTTP_TRAILER:
+                if( !llen ){
+                    p->state = TEMPEST_HTTP_DONE;
+                }
+            break;
+
+            default:
+                return -1;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * tempest_http_prepare
+ *  discards the consumed bytes and makes room for reading.
+ */
+static inline int tempest_http_prepare( tempest_http_parser_t *p, size_t len )
+{
+    if( p->cur ){
+        memmove( p->buf, p->buf + p->cur, p->len - p->cur );
+        p->len -= p->cur;
+        p->cur = 0;
+    }
+
+    if( p->cap - p->len < len )
+    {
+        size_t cap = p->cap ? p->cap : TEMPEST_HTTP_BUFSIZE;
+        char *buf = NULL;
+
+        while( cap - p->len < len ){
+            cap *= 2;
+        }
+        if( !( buf = realloc( p->buf, cap ) ) ){
+            return -1;
+        }
+        p->buf = buf;
+        p->cap = cap;
+    }
+
+    return 0;
+}
+
+
+/**
+ * tempest_http_reset
+ *  prepares for the next response. the bytes that follow the previous
+ *  response are kept unless discard is true.
+ */
+static inline void tempest_http_reset( tempest_http_parser_t *p, int head,
+                                       int discard )
+{
+    p->state = TEMPEST_HTTP_STATUS;
+    p->head = head;
+    p->status = 0;
+    p->keepalive = 1;
+    p->chunked = 0;
+    p->has_len = 0;
+    p->remain = 0;
+    p->nbody = 0;
+    if( discard ){
+        p->cur = p->len = 0;
+    }
+}
+
+
+LUALIB_API int luaopen_tempest_http( lua_State *L );
+
+
+#define TEMPEST_SOCKET_MT   "tempest.socket"
+
+typedef struct {
+    int fd;
+} tempest_socket_t;
+
+
+LUALIB_API int luaopen_tempest_socket( lua_State *L );
+
+
+#define TEMPEST_ENGINE_MT   "tempest.engine"
+
+typedef enum {
+    TEMPEST_ENGINE_IDLE = 0,
+    TEMPEST_ENGINE_CONNECTING,
+    TEMPEST_ENGINE_SENDING,
+    TEMPEST_ENGINE_RECEIVING
+} tempest_engine_state_t;
+
+/**
+ * connection of native engine
+ *
+ * the idle connection that has a deadline is waiting for the backoff time
+ * of reconnection.
+ */
+typedef struct {
+    int fd;
+    tempest_engine_state_t state;
+    uint32_t events;
+    uint32_t nreq;
+    uint64_t backoff;
+    // start time of connect or request
+    uint64_t since;
+    uint64_t ttfb;
+    uint64_t deadline;
+    size_t sent;
+    size_t nrecv;
+    tempest_http_parser_t parser;
+} tempest_engine_conn_t;
+
+/**
+ * native engine
+ *
+ * drives the connections of the fixed scenario with epoll and records the
+ * results into the shard of the stats without calling back to Lua.
+ */
+typedef struct {
+    int ref;
+    tempest_stats_t *stats;
+    int epfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *req;
+    size_t reqlen;
+    int http;
+    uint32_t churn;
+    uint64_t rcvtimeo;
+    uint64_t sndtimeo;
+    uint64_t seed;
+    size_t nconn;
+    tempest_engine_conn_t *conns;
+} tempest_engine_t;
+
+
+LUALIB_API int luaopen_tempest_engine( lua_State *L );
+
+
+#define TEMPEST_URING_MT    "tempest.uring"
+
+/**
+ * io_uring of worker
+ *
+ * the sends are copied into the slots of registered buffers, and the
+ * received data are written into the provided buffers that are selected by
+ * kernel. the completions are notified via eventfd.
+ */
+typedef struct {
+    int fd;
+    int efd;
+    int sqpoll;
+    int multishot;
+    unsigned entries;
+    // submission queue
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    void *sqes;
+    size_t sqes_len;
+    unsigned npending;
+    // completion queue
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    // registered send buffers
+    char *sbuf;
+    size_t nslot;
+    size_t slotsize;
+    uint32_t *freelist;
+    size_t nfree;
+    // provided recv buffers
+    char *rbuf;
+    size_t nrbuf;
+    size_t rbufsize;
+} tempest_uring_t;
+
+
+LUALIB_API int luaopen_tempest_uring( lua_State *L );
+
+
 #define TEMPEST_TIMER_MT    "tempest.timer"
 
+/**
+ * in-flight request of pipelining
+ */
+typedef struct {
+    uint64_t intended;
+    uint64_t start;
+    size_t label;
+} tempest_timer_req_t;
+
 typedef struct {
     int ref;
     tempest_stats_t *stats;
+    uint64_t connect;
+    uint64_t handshake;
+    uint64_t intended;
     uint64_t start;
     uint64_t stop;
     uint64_t ttfb;
+    // 1-based id of the label of measurement
+    size_t label;
+    // FIFO of in-flight requests
+    uint64_t qttfb;
+    size_t depth;
+    size_t head;
+    size_t nqueue;
+    tempest_timer_req_t queue[];
 } tempest_timer_t;
 
 
@@ -26,48 +26,88 @@
  */
 
 #include "tempest.h"
+#include <sys/resource.h>
+
+/**
+ * record
+ *  records the latency of measured request. if the request was scheduled,
+ *  the latency is measured from the intended start time to correct the
+ *  coordinated omission, and the uncorrected latency and the schedule lag
+ *  are recorded as well. the latency is also recorded into the label if
+ *  the measurement is labeled.
+ */
+static inline void record_req( tempest_timer_t *t, uint64_t intended,
+                               uint64_t start, uint64_t ttfb, uint64_t stop,
+                               size_t label )
+{
+    uint64_t from = start;
+
+    if( intended ){
+        tempest_stats_record( t->stats, TEMPEST_HIST_LAG,
+                              intended < start ? start - intended : 0 );
+        tempest_stats_record( t->stats, TEMPEST_HIST_UNCORRECTED,
+                              stop - start );
+        // the request started late
+        if( intended < start ){
+            from = intended;
+        }
+    }
+    tempest_stats_record( t->stats, TEMPEST_HIST_LATENCY, stop - from );
+    tempest_stats_record_slot( t->stats, stop, stop - from );
+    tempest_stats_record_label( t->stats, label, stop - from );
+    if( ttfb ){
+        tempest_stats_record( t->stats, TEMPEST_HIST_TTFB, ttfb - start );
+    }
+}
 
-#if defined(__APPLE__)
-#include <mach/mach.h>
-#include <mach/mach_time.h>
 
-static inline uint64_t getnsec( void )
+static inline void record( tempest_timer_t *t, uint64_t stop )
 {
-    static mach_timebase_info_data_t tbinfo = { 0 };
+    record_req( t, t->intended, t->start, t->ttfb, stop, t->label );
+}
 
-    if( tbinfo.denom == 0 ){
-        (void)mach_timebase_info( &tbinfo );
-    }
 
-    return mach_absolute_time() * tbinfo.numer / tbinfo.denom;
+/**
+ * record_failure
+ *  records the time until the request failed into the failure histogram.
+ *  it is measured from the intended start time as well as the latency.
+ */
+static inline void record_failure( tempest_timer_t *t, uint64_t intended,
+                                   uint64_t start, uint64_t at )
+{
+    uint64_t from = intended && intended < start ? intended : start;
+
+    tempest_stats_record( t->stats, TEMPEST_HIST_FAILURE,
+                          at > from ? at - from : 0 );
 }
 
-#else
 
-static inline uint64_t getnsec( void )
+static int stop_lua( lua_State *L )
 {
-    struct timespec ts = {0};
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    uint64_t nsec = tempest_stats_now( t->stats );
 
-#if defined(CLOCK_MONOTONIC_COARSE)
-    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
-#else
-    clock_gettime( CLOCK_MONOTONIC, &ts );
-#endif
+    if( t->start ){
+        record( t, nsec );
+        t->intended = t->start = t->stop = t->ttfb = 0;
+    }
 
-    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    return 0;
 }
 
-#endif
 
-
-static int stop_lua( lua_State *L )
+/**
+ * flush_lua
+ *  records the pending measurement that has received the response before
+ *  the connection is closed.
+ */
+static int flush_lua( lua_State *L )
 {
-    uint64_t nsec = getnsec();
     tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
 
-    if( t->start ){
-        tempest_stats_record( t->stats, nsec - t->start );
-        t->start = t->stop = t->ttfb = 0;
+    if( t->stop ){
+        record( t, t->stop );
+        t->intended = t->start = t->stop = t->ttfb = 0;
     }
 
     return 0;
@@ -76,8 +116,8 @@ static int stop_lua( lua_State *L )
 
 static int measure_lua( lua_State *L )
 {
-    uint64_t nsec = getnsec();
     tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    uint64_t nsec = tempest_stats_now( t->stats );
 
     if( t->stop ){
         t->stop = nsec;
@@ -90,31 +130,255 @@ static int measure_lua( lua_State *L )
 }
 
 
+/**
+ * start_lua
+ *  records the pending measurement and starts the new one. the label is
+ *  changed to the 1-based id if passed, otherwise it is kept. 0 means no
+ *  label.
+ */
 static int start_lua( lua_State *L )
 {
     tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
 
     if( t->stop ){
-        tempest_stats_record( t->stats, t->stop - t->start );
+        record( t, t->stop );
+        // intended start time is only applied to the first request
+        t->intended = 0;
     }
 
+    if( !lua_isnoneornil( L, 2 ) ){
+        t->label = (size_t)lauxh_checkuint32( L, 2 );
+    }
     t->stop = t->ttfb = 0;
-    t->start = getnsec();
+    t->start = tempest_stats_now( t->stats );
 
     return 1;
 }
 
 
-static int reset_lua( lua_State *L )
+static int connected_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    uint64_t nsec = tempest_stats_now( t->stats );
+
+    if( t->connect ){
+        tempest_stats_record( t->stats, TEMPEST_HIST_CONNECT,
+                              nsec - t->connect );
+        t->connect = 0;
+    }
+
+    return 0;
+}
+
+
+static int connect_lua( lua_State *L )
 {
     tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
 
-    t->start = t->stop = t->ttfb = 0;
+    t->connect = tempest_stats_now( t->stats );
 
     return 0;
 }
 
 
+/**
+ * handshaked_lua
+ *  records the time of the TLS handshake into the histogram of the resumed
+ *  handshakes if resumed is true, otherwise the full handshakes.
+ */
+static int handshaked_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    int resumed = lauxh_optboolean( L, 2, 0 );
+    uint64_t nsec = tempest_stats_now( t->stats );
+
+    if( t->handshake ){
+        tempest_stats_record( t->stats, resumed ? TEMPEST_HIST_RESUMED :
+                                                  TEMPEST_HIST_HANDSHAKE,
+                              nsec - t->handshake );
+        t->handshake = 0;
+    }
+
+    return 0;
+}
+
+
+static int handshake_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    t->handshake = tempest_stats_now( t->stats );
+
+    return 0;
+}
+
+
+static int schedule_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    uint64_t intended = (uint64_t)lauxh_checknumber( L, 2 );
+
+    // record the pending measurement with the previous intended start time
+    if( t->stop ){
+        record( t, t->stop );
+        t->start = t->stop = t->ttfb = 0;
+    }
+    t->intended = intended;
+
+    return 0;
+}
+
+
+/**
+ * enqueue_lua
+ *  pushes the start time of the pipelined request to the FIFO. returns
+ *  false if the FIFO is full.
+ */
+static int enqueue_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    if( t->nqueue == t->depth ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+
+    t->queue[( t->head + t->nqueue ) % t->depth] = (tempest_timer_req_t){
+        .intended = t->intended,
+        .start = tempest_stats_now( t->stats ),
+        .label = t->label
+    };
+    t->nqueue++;
+    t->intended = 0;
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+/**
+ * arrive_lua
+ *  marks the first byte of the response of the oldest in-flight request.
+ */
+static int arrive_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    if( t->nqueue && !t->qttfb ){
+        t->qttfb = tempest_stats_now( t->stats );
+    }
+
+    return 0;
+}
+
+
+/**
+ * dequeue_lua
+ *  pops the oldest in-flight request and records its latency. returns
+ *  false if the FIFO is empty.
+ */
+static int dequeue_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    tempest_timer_req_t *req = NULL;
+    uint64_t nsec = 0;
+
+    if( !t->nqueue ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+
+    nsec = tempest_stats_now( t->stats );
+    req = t->queue + t->head;
+    record_req( t, req->intended, req->start,
+                t->qttfb >= req->start ? t->qttfb : 0, nsec, req->label );
+    t->head = ( t->head + 1 ) % t->depth;
+    t->nqueue--;
+    t->qttfb = 0;
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+static int pending_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    lua_pushinteger( L, t->nqueue );
+
+    return 1;
+}
+
+
+/**
+ * error_lua
+ *  records the pending measurement as a failure that occurred now, and
+ *  discards it.
+ */
+static int error_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    if( t->start ){
+        record_failure( t, t->intended, t->start,
+                        tempest_stats_now( t->stats ) );
+        t->intended = t->start = t->stop = t->ttfb = 0;
+    }
+
+    return 0;
+}
+
+
+/**
+ * fail_lua
+ *  records the pending measurement as a failure that occurred at the last
+ *  received data, and counts the failure of the current label. the label is
+ *  kept across the reset of the connection.
+ */
+static int fail_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+
+    if( t->start ){
+        record_failure( t, t->intended, t->start,
+                        t->stop ? t->stop : tempest_stats_now( t->stats ) );
+        t->intended = t->start = t->stop = t->ttfb = 0;
+    }
+    tempest_stats_label_failure( t->stats, t->label, 1 );
+
+    return 0;
+}
+
+
+/**
+ * reset_lua
+ *  discards the measurements. returns the number of discarded in-flight
+ *  requests. if fail is true, they are recorded as failures and counted as
+ *  failures of their labels.
+ */
+static int reset_lua( lua_State *L )
+{
+    tempest_timer_t *t = lauxh_checkudata( L, 1, TEMPEST_TIMER_MT );
+    int fail = lauxh_optboolean( L, 2, 0 );
+    uint64_t nsec = fail && t->nqueue ? tempest_stats_now( t->stats ) : 0;
+    size_t i = 0;
+
+    for(; fail && i < t->nqueue; i++ ){
+        tempest_timer_req_t *req = t->queue + ( t->head + i ) % t->depth;
+
+        record_failure( t, req->intended, req->start, nsec );
+        tempest_stats_label_failure( t->stats, req->label, 1 );
+    }
+    lua_pushinteger( L, t->nqueue );
+    t->connect = t->handshake = 0;
+    t->intended = t->start = t->stop = t->ttfb = 0;
+    t->qttfb = t->head = t->nqueue = 0;
+
+    return 1;
+}
+
+
 static int tostring_lua( lua_State *L )
 {
     lua_pushfstring( L, TEMPEST_TIMER_MT ": %p", lua_touserdata( L, 1 ) );
@@ -135,15 +399,30 @@ static int gc_lua( lua_State *L )
 static int new_lua( lua_State *L )
 {
     tempest_stats_t *stats = lauxh_checkudata( L, 1, TEMPEST_STATS_MT );
-    tempest_timer_t *t = lua_newuserdata( L, sizeof( tempest_timer_t ) );
+    // maximum number of in-flight requests
+    size_t depth = (size_t)lauxh_optuint32( L, 2, 1 );
+    tempest_timer_t *t = NULL;
 
+    if( !depth ){
+        return lauxh_argerror( L, 2, "depth must be greater than 0" );
+    }
+    t = lua_newuserdata( L, sizeof( tempest_timer_t ) +
+                            sizeof( tempest_timer_req_t ) * depth );
     lua_pushvalue( L, 1 );
     *t = (tempest_timer_t){
         .ref = lauxh_ref( L ),
         .stats = stats,
+        .connect = 0,
+        .handshake = 0,
+        .intended = 0,
         .start = 0,
         .stop = 0,
-        .ttfb = 0
+        .ttfb = 0,
+        .label = 0,
+        .qttfb = 0,
+        .depth = depth,
+        .head = 0,
+        .nqueue = 0
     };
     lauxh_setmetatable( L, TEMPEST_TIMER_MT );
 
@@ -160,6 +439,29 @@ static int usleep_lua( lua_State *L )
 }
 
 
+/**
+ * rusage_lua
+ *  returns the user and system cpu time of the process in seconds.
+ */
+static int rusage_lua( lua_State *L )
+{
+    struct rusage ru;
+
+    if( getrusage( RUSAGE_SELF, &ru ) == -1 ){
+        lua_pushnil( L );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 3;
+    }
+    lua_pushnumber( L, (double)ru.ru_utime.tv_sec +
+                       (double)ru.ru_utime.tv_usec / 1000000.0 );
+    lua_pushnumber( L, (double)ru.ru_stime.tv_sec +
+                       (double)ru.ru_stime.tv_usec / 1000000.0 );
+
+    return 2;
+}
+
+
 LUALIB_API int luaopen_tempest_timer( lua_State *L )
 {
     // create metatable
@@ -172,9 +474,21 @@ LUALIB_API int luaopen_tempest_timer( lua_State *L )
         };
         struct luaL_Reg method[] = {
             { "reset", reset_lua },
+            { "connect", connect_lua },
+            { "connected", connected_lua },
+            { "handshake", handshake_lua },
+            { "handshaked", handshaked_lua },
+            { "schedule", schedule_lua },
             { "start", start_lua },
             { "measure", measure_lua },
             { "stop", stop_lua },
+            { "flush", flush_lua },
+            { "fail", fail_lua },
+            { "error", error_lua },
+            { "enqueue", enqueue_lua },
+            { "arrive", arrive_lua },
+            { "dequeue", dequeue_lua },
+            { "pending", pending_lua },
             { NULL, NULL }
         };
         struct luaL_Reg *ptr = mmethod;
@@ -200,6 +514,7 @@ LUALIB_API int luaopen_tempest_timer( lua_State *L )
     lua_newtable( L );
     lauxh_pushfn2tbl( L, "new", new_lua );
     lauxh_pushfn2tbl( L, "usleep", usleep_lua );
+    lauxh_pushfn2tbl( L, "rusage", rusage_lua );
 
     return 1;
 }
@@ -0,0 +1,615 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ *
+ *  src/uring.c
+ *  tempest
+ *
+ *  Created by Masatoshi Fukunaga on 18/09/26.
+ */
+
+#include "tempest.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup)
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+#endif
+
+
+#define URING_ENTRIES   256
+#define URING_BUFSIZE   16384
+// the slot of the send buffer is encoded in the upper bits of user_data
+#define URING_SLOT_SHIFT    40
+#define URING_ID_MASK       ( ( 1ULL << URING_SLOT_SHIFT ) - 1 )
+
+
+static void uring_close( tempest_uring_t *r )
+{
+    if( r->sq_ptr ){
+        munmap( r->sq_ptr, r->sq_len );
+    }
+    if( r->cq_ptr && r->cq_ptr != r->sq_ptr ){
+        munmap( r->cq_ptr, r->cq_len );
+    }
+    if( r->sqes ){
+        munmap( r->sqes, r->sqes_len );
+    }
+    if( r->fd != -1 ){
+        close( r->fd );
+    }
+    if( r->efd != -1 ){
+        close( r->efd );
+    }
+    free( (void*)r->sbuf );
+    free( (void*)r->rbuf );
+    free( (void*)r->freelist );
+    memset( (void*)r, 0, sizeof( tempest_uring_t ) );
+    r->fd = r->efd = -1;
+}
+
+
+#if defined(__NR_io_uring_setup)
+
+static inline int uring_enter( int fd, unsigned nsubmit, unsigned flags )
+{
+    return (int)syscall( __NR_io_uring_enter, fd, nsubmit, 0, flags, NULL,
+                         0 );
+}
+
+
+/**
+ * uring_flush
+ *  submits the queued requests. the sq thread submits them without system
+ *  call unless it is sleeping.
+ */
+static int uring_flush( tempest_uring_t *r )
+{
+    if( r->sqpoll ){
+        if( __atomic_load_n( r->sq_flags, __ATOMIC_ACQUIRE ) &
+            IORING_SQ_NEED_WAKEUP ){
+            uring_enter( r->fd, 0, IORING_ENTER_SQ_WAKEUP );
+        }
+        r->npending = 0;
+        return 0;
+    }
+
+    while( r->npending )
+    {
+        int n = uring_enter( r->fd, r->npending, 0 );
+
+        if( n >= 0 ){
+            r->npending -= (unsigned)n;
+        }
+        else if( errno == EAGAIN || errno == EBUSY ){
+            // retry at next flush
+            return 0;
+        }
+        else if( errno != EINTR ){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * uring_sqe
+ *  returns the free entry of the submission queue, or NULL if the queue is
+ *  full.
+ */
+static struct io_uring_sqe *uring_sqe( tempest_uring_t *r )
+{
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *sqe = NULL;
+
+    if( tail - __atomic_load_n( r->sq_head, __ATOMIC_ACQUIRE ) >=
+        r->entries ){
+        uring_flush( r );
+        if( tail - __atomic_load_n( r->sq_head, __ATOMIC_ACQUIRE ) >=
+            r->entries ){
+            return NULL;
+        }
+    }
+
+    sqe = (struct io_uring_sqe*)r->sqes + ( tail & *r->sq_mask );
+    memset( (void*)sqe, 0, sizeof( struct io_uring_sqe ) );
+
+    return sqe;
+}
+
+
+static inline void uring_push( tempest_uring_t *r )
+{
+    unsigned tail = *r->sq_tail;
+
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n( r->sq_tail, tail + 1, __ATOMIC_RELEASE );
+    r->npending++;
+}
+
+
+/**
+ * uring_provide
+ *  gives nbuf recv buffers from bid back to the kernel.
+ */
+static int uring_provide( tempest_uring_t *r, size_t bid, size_t nbuf )
+{
+    struct io_uring_sqe *sqe = uring_sqe( r );
+
+    if( !sqe ){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)nbuf;
+    sqe->addr = (uint64_t)(uintptr_t)( r->rbuf + bid * r->rbufsize );
+    sqe->len = (uint32_t)r->rbufsize;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+    uring_push( r );
+
+    return 0;
+}
+
+
+/**
+ * has_multishot
+ *  returns 1 if the kernel supports the multishot recv (6.0 or later).
+ */
+static int has_multishot( void )
+{
+    struct utsname u;
+    int major = 0;
+    int minor = 0;
+
+    if( uname( &u ) == 0 && sscanf( u.release, "%d.%d", &major, &minor ) == 2 ){
+        return major >= 6;
+    }
+
+    return 0;
+}
+
+
+static int uring_open( tempest_uring_t *r, unsigned entries, size_t bufsize )
+{
+    struct io_uring_params p;
+    struct iovec iov;
+    size_t i = 0;
+
+    // try the sq thread first to submit without system call
+    memset( (void*)&p, 0, sizeof( p ) );
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = 100;
+    r->sqpoll = 1;
+    if( ( r->fd = (int)syscall( __NR_io_uring_setup, entries, &p ) ) == -1 ){
+        memset( (void*)&p, 0, sizeof( p ) );
+        r->sqpoll = 0;
+        if( ( r->fd = (int)syscall( __NR_io_uring_setup, entries,
+                                    &p ) ) == -1 ){
+            return -1;
+        }
+    }
+    r->entries = p.sq_entries;
+
+    // map the rings
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    if( p.features & IORING_FEAT_SINGLE_MMAP && r->cq_len > r->sq_len ){
+        r->sq_len = r->cq_len;
+    }
+    r->sq_ptr = mmap( NULL, r->sq_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+    if( r->sq_ptr == MAP_FAILED ){
+        r->sq_ptr = NULL;
+        return -1;
+    }
+    if( p.features & IORING_FEAT_SINGLE_MMAP ){
+        r->cq_ptr = r->sq_ptr;
+    }
+    else if( ( r->cq_ptr = mmap( NULL, r->cq_len, PROT_READ|PROT_WRITE,
+                                 MAP_SHARED|MAP_POPULATE, r->fd,
+                                 IORING_OFF_CQ_RING ) ) == MAP_FAILED ){
+        r->cq_ptr = NULL;
+        return -1;
+    }
+    r->sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+    if( ( r->sqes = mmap( NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, r->fd,
+                          IORING_OFF_SQES ) ) == MAP_FAILED ){
+        r->sqes = NULL;
+        return -1;
+    }
+    r->sq_head = (unsigned*)( (char*)r->sq_ptr + p.sq_off.head );
+    r->sq_tail = (unsigned*)( (char*)r->sq_ptr + p.sq_off.tail );
+    r->sq_mask = (unsigned*)( (char*)r->sq_ptr + p.sq_off.ring_mask );
+    r->sq_flags = (unsigned*)( (char*)r->sq_ptr + p.sq_off.flags );
+    r->sq_array = (unsigned*)( (char*)r->sq_ptr + p.sq_off.array );
+    r->cq_head = (unsigned*)( (char*)r->cq_ptr + p.cq_off.head );
+    r->cq_tail = (unsigned*)( (char*)r->cq_ptr + p.cq_off.tail );
+    r->cq_mask = (unsigned*)( (char*)r->cq_ptr + p.cq_off.ring_mask );
+    r->cqes = (char*)r->cq_ptr + p.cq_off.cqes;
+
+    // notify the completions via eventfd
+    if( ( r->efd = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC ) ) == -1 ||
+        syscall( __NR_io_uring_register, r->fd, IORING_REGISTER_EVENTFD,
+                 &r->efd, 1 ) == -1 ){
+        return -1;
+    }
+
+    // register the send buffers
+    r->nslot = r->entries;
+    r->slotsize = bufsize;
+    if( !( r->sbuf = malloc( r->nslot * r->slotsize ) ) ||
+        !( r->freelist = malloc( r->nslot * sizeof( uint32_t ) ) ) ){
+        return -1;
+    }
+    iov = (struct iovec){
+        .iov_base = r->sbuf,
+        .iov_len = r->nslot * r->slotsize
+    };
+    if( syscall( __NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                 &iov, 1 ) == -1 ){
+        return -1;
+    }
+    for(; i < r->nslot; i++ ){
+        r->freelist[i] = (uint32_t)i;
+    }
+    r->nfree = r->nslot;
+
+    // provide the recv buffers
+    r->nrbuf = r->entries;
+    r->rbufsize = bufsize;
+    if( !( r->rbuf = malloc( r->nrbuf * r->rbufsize ) ) ||
+        uring_provide( r, 0, r->nrbuf ) || uring_flush( r ) ){
+        return -1;
+    }
+    r->multishot = has_multishot();
+
+    return 0;
+}
+
+#else
+
+static int uring_flush( tempest_uring_t *r )
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+
+static int uring_open( tempest_uring_t *r, unsigned entries, size_t bufsize )
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
+
+
+/**
+ * send_lua
+ *  queues the send of the string that is copied into a registered buffer.
+ *  returns false if the string does not fit in a buffer or the queue is
+ *  full.
+ */
+static int send_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+    int fd = (int)lauxh_checkinteger( L, 2 );
+    size_t len = 0;
+    const char *str = lauxh_checklstring( L, 3, &len );
+    uint64_t id = (uint64_t)lauxh_checkuint64( L, 4 ) & URING_ID_MASK;
+#if defined(__NR_io_uring_setup)
+    struct io_uring_sqe *sqe = NULL;
+    uint32_t slot = 0;
+
+    if( len <= r->slotsize && r->nfree && ( sqe = uring_sqe( r ) ) ){
+        slot = r->freelist[--r->nfree];
+        memcpy( r->sbuf + slot * r->slotsize, str, len );
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)( r->sbuf + slot * r->slotsize );
+        sqe->len = (uint32_t)len;
+        sqe->buf_index = 0;
+        sqe->user_data = id | (uint64_t)( slot + 1 ) << URING_SLOT_SHIFT;
+        uring_push( r );
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+#endif
+
+    lua_pushboolean( L, 0 );
+    return 1;
+}
+
+
+/**
+ * recv_lua
+ *  queues the recv into the provided buffers. it is multishot if the
+ *  kernel supports it; the completions have the more flag until it stops.
+ */
+static int recv_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+    int fd = (int)lauxh_checkinteger( L, 2 );
+    uint64_t id = (uint64_t)lauxh_checkuint64( L, 3 ) & URING_ID_MASK;
+#if defined(__NR_io_uring_setup)
+    struct io_uring_sqe *sqe = uring_sqe( r );
+
+    if( sqe ){
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = r->multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = id;
+        uring_push( r );
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+#endif
+
+    lua_pushboolean( L, 0 );
+    return 1;
+}
+
+
+/**
+ * cancel_lua
+ *  cancels the request of id.
+ */
+static int cancel_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+    uint64_t id = (uint64_t)lauxh_checkuint64( L, 2 ) & URING_ID_MASK;
+#if defined(__NR_io_uring_setup)
+    struct io_uring_sqe *sqe = uring_sqe( r );
+
+    if( sqe ){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = id;
+        uring_push( r );
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+#endif
+
+    lua_pushboolean( L, 0 );
+    return 1;
+}
+
+
+/**
+ * submit_lua
+ *  submits all queued requests at once.
+ */
+static int submit_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+
+    if( uring_flush( r ) ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+/**
+ * reap_lua
+ *  stores the completions into the table as the sequence of id, result,
+ *  received data or error message or false, and more flag. returns the
+ *  number of the completions. the table should be reused by caller.
+ */
+static int reap_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+    int n = 0;
+#if defined(__NR_io_uring_setup)
+    unsigned head = *r->cq_head;
+    unsigned tail = 0;
+    uint64_t cnt = 0;
+    int idx = 0;
+
+    lauxh_checktable( L, 2 );
+    // reset the notification
+    while( read( r->efd, &cnt, sizeof( cnt ) ) == -1 && errno == EINTR ){}
+
+    tail = __atomic_load_n( r->cq_tail, __ATOMIC_ACQUIRE );
+    for(; head != tail; head++ )
+    {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe*)r->cqes +
+                                   ( head & *r->cq_mask );
+        uint64_t ud = cqe->user_data;
+        uint64_t slot = ud >> URING_SLOT_SHIFT;
+
+        // completion of internal request
+        if( !ud ){
+            continue;
+        }
+        else if( slot ){
+            r->freelist[r->nfree++] = (uint32_t)( slot - 1 );
+        }
+
+        lua_pushnumber( L, (lua_Number)( ud & URING_ID_MASK ) );
+        lua_rawseti( L, 2, ++idx );
+        lua_pushinteger( L, cqe->res );
+        lua_rawseti( L, 2, ++idx );
+        if( cqe->flags & IORING_CQE_F_BUFFER )
+        {
+            size_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            lua_pushlstring( L, r->rbuf + bid * r->rbufsize,
+                             cqe->res > 0 ? (size_t)cqe->res : 0 );
+            // give back the buffer
+            uring_provide( r, bid, 1 );
+        }
+        else if( cqe->res < 0 ){
+            lua_pushstring( L, strerror( -cqe->res ) );
+        }
+        else {
+            lua_pushboolean( L, 0 );
+        }
+        lua_rawseti( L, 2, ++idx );
+        lua_pushboolean( L, cqe->flags & IORING_CQE_F_MORE );
+        lua_rawseti( L, 2, ++idx );
+        n++;
+    }
+    __atomic_store_n( r->cq_head, head, __ATOMIC_RELEASE );
+    uring_flush( r );
+#endif
+
+    lua_pushinteger( L, n );
+
+    return 1;
+}
+
+
+static int efd_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+
+    lua_pushinteger( L, r->efd );
+
+    return 1;
+}
+
+
+/**
+ * features_lua
+ *  returns true if the submissions are polled by the sq thread, and true
+ *  if the recv is multishot.
+ */
+static int features_lua( lua_State *L )
+{
+    tempest_uring_t *r = lauxh_checkudata( L, 1, TEMPEST_URING_MT );
+
+    lua_pushboolean( L, r->sqpoll );
+    lua_pushboolean( L, r->multishot );
+
+    return 2;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, TEMPEST_URING_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+static int gc_lua( lua_State *L )
+{
+    uring_close( (tempest_uring_t*)lua_touserdata( L, 1 ) );
+    return 0;
+}
+
+
+/**
+ * new_lua
+ *  creates the io_uring. returns nil and error message if the kernel does
+ *  not support it.
+ */
+static int new_lua( lua_State *L )
+{
+    uint32_t entries = lauxh_optuint32( L, 1, URING_ENTRIES );
+    uint32_t bufsize = lauxh_optuint32( L, 2, URING_BUFSIZE );
+    tempest_uring_t *r = NULL;
+
+    if( !entries ){
+        return lauxh_argerror( L, 1, "entries must be greater than 0" );
+    }
+    else if( !bufsize ){
+        return lauxh_argerror( L, 2, "bufsize must be greater than 0" );
+    }
+
+    r = lua_newuserdata( L, sizeof( tempest_uring_t ) );
+    memset( (void*)r, 0, sizeof( tempest_uring_t ) );
+    r->fd = r->efd = -1;
+    lauxh_setmetatable( L, TEMPEST_URING_MT );
+    if( uring_open( r, entries, bufsize ) ){
+        int err = errno;
+
+        uring_close( r );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( err ) );
+        return 2;
+    }
+
+    return 1;
+}
+
+
+LUALIB_API int luaopen_tempest_uring( lua_State *L )
+{
+    // create metatable
+    if( luaL_newmetatable( L, TEMPEST_URING_MT ) )
+    {
+        struct luaL_Reg mmethod[] = {
+            { "__gc", gc_lua },
+            { "__tostring", tostring_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg method[] = {
+            { "efd", efd_lua },
+            { "features", features_lua },
+            { "send", send_lua },
+            { "recv", recv_lua },
+            { "cancel", cancel_lua },
+            { "submit", submit_lua },
+            { "reap", reap_lua },
+            { NULL, NULL }
+        };
+        struct luaL_Reg *ptr = mmethod;
+
+        // metamethods
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        // methods
+        lua_pushstring( L, "__index" );
+        lua_newtable( L );
+        ptr = method;
+        do {
+            lauxh_pushfn2tbl( L, ptr->name, ptr->func );
+            ptr++;
+        } while( ptr->name );
+        lua_rawset( L, -3 );
+    }
+    lua_settop( L, 0 );
+
+    // create module table
+    lua_newtable( L );
+    lauxh_pushfn2tbl( L, "new", new_lua );
+    // results of the recv that should be re-armed
+    lauxh_pushint2tbl( L, "ENOBUFS", -ENOBUFS );
+    lauxh_pushint2tbl( L, "ECANCELED", -ECANCELED );
+
+    return 1;
+}
@@ -0,0 +1,62 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  test/churn_test.lua
+  tempest
+
+  the last request of each connection must be recorded before the churn
+  mode closes it. run with `lua test/churn_test.lua` after `luarocks make`.
+
+--]]
+
+--- file scope variables
+local Stats = require('tempest.stats')
+local Connection = require('tempest.connection')
+--- constants
+local NREQ = 10
+
+
+--- class FakeSocket
+-- a connected socket that only counts the close
+local FakeSocket = {}
+
+
+function FakeSocket:close()
+    self.nclose = self.nclose + 1
+end
+
+
+local stats = assert( Stats.new( 1000 ) )
+local sock = setmetatable({
+    nclose = 0
+}, {
+    __index = FakeSocket
+})
+local conn = Connection.new( stats, {
+    host = '127.0.0.1',
+    port = 8080,
+    churn = 1,
+} )
+
+stats:start()
+for _ = 1, NREQ do
+    conn.sock = sock
+    -- request and response of the script
+    conn:measure()
+    conn.timer:measure()
+    stats:incrSuccess()
+    conn:done()
+    assert( conn.sock == nil, 'connection must be closed every request' )
+end
+
+local data = stats:data()
+assert( sock.nclose == NREQ )
+assert( data.success == NREQ )
+assert( data.latency.nreq == NREQ, string.format(
+    'latency must be recorded for every request: %d of %d',
+    data.latency.nreq, NREQ
+) )
+assert( data.ttfb.nreq == NREQ )
+stats:dispose()
+print( 'ok' )
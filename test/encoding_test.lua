@@ -0,0 +1,180 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  test/encoding_test.lua
+  tempest
+
+  the sparse varint encoding of the array and the stats must round trip,
+  and the malformed data must be rejected without updating the target.
+  run with `lua test/encoding_test.lua` after `luarocks make`.
+
+--]]
+
+--- file scope variables
+local Array = require('tempest.array')
+local Stats = require('tempest.stats')
+local floor = math.floor
+local strchar = string.char
+local concat = table.concat
+--- constants
+-- length of Array.new(1)
+local LEN = 100000
+local VERSION = 1
+
+
+--- varint
+-- encodes the value into unsigned LEB128
+-- @param v
+-- @return str
+local function varint( v )
+    local buf = {}
+
+    while v >= 0x80 do
+        buf[#buf + 1] = strchar( v % 0x80 + 0x80 )
+        v = floor( v / 0x80 )
+    end
+    buf[#buf + 1] = strchar( v )
+
+    return concat( buf )
+end
+
+
+--- encode
+-- encodes the pairs of gap and value as the array of length len
+-- @param len
+-- @param counters
+-- @param magic
+-- @param nnz
+-- @return str
+local function encode( len, counters, magic, nnz )
+    local buf = {
+        magic or 'TMPA',
+        strchar( VERSION ),
+        varint( len ),
+        varint( nnz or #counters ),
+    }
+
+    for _, p in ipairs( counters ) do
+        buf[#buf + 1] = varint( p[1] )
+        buf[#buf + 1] = varint( p[2] )
+    end
+
+    return concat( buf )
+end
+
+
+--- equals
+-- asserts that the counters of the array are the expected values
+-- @param arr
+-- @param exp
+local function equals( arr, exp )
+    local data = arr:data()
+    local n = 0
+
+    for idx, v in pairs( data ) do
+        assert( exp[idx] == v, string.format(
+            'counter %d must be %s: %d', idx, tostring( exp[idx] ), v
+        ) )
+        n = n + 1
+    end
+    for _ in pairs( exp ) do
+        n = n - 1
+    end
+    assert( n == 0, 'number of the counters does not match' )
+end
+
+
+-- encode, decode and merge the array
+do
+    -- counters 1, 5 and the last one
+    local enc = encode( LEN, {
+        { 2, 3 },
+        { 4, 300 },
+        { LEN - 6, 0xffffffff },
+    } )
+    local arr = assert( Array.new( 1 ) )
+    local dec
+
+    assert( #arr == LEN )
+    -- empty array has no counters
+    assert( arr:encode() == encode( LEN, {} ) )
+
+    assert( arr:merge( enc ) == true )
+    equals( arr, { [1] = 3, [5] = 300, [LEN - 1] = 0xffffffff } )
+    assert( arr:encode() == enc, 'encoding must be canonical' )
+
+    -- decode
+    dec = assert( Array.decode( enc ) )
+    assert( #dec == LEN )
+    equals( dec, { [1] = 3, [5] = 300, [LEN - 1] = 0xffffffff } )
+
+    -- merge encoded string and array
+    assert( arr:merge( encode( LEN, { { 6, 1 } } ) ) == true )
+    assert( arr:merge( Array.decode( encode( LEN, { { 2, 2 } } ) ) ) == true )
+    equals( arr, { [1] = 5, [5] = 301, [LEN - 1] = 0xffffffff } )
+end
+
+
+-- malformed data
+do
+    local arr = assert( Array.new( 1 ) )
+    local exp = { [1] = 3 }
+    local valid = encode( LEN, { { 2, 3 } } )
+
+    assert( arr:merge( valid ) == true )
+    for desc, enc in pairs({
+        ['wrong magic'] = encode( LEN, { { 2, 3 } }, 'TMPS' ),
+        ['wrong version'] = 'TMPA' .. strchar( VERSION + 1 ) ..
+                            valid:sub( 6 ),
+        ['truncated header'] = valid:sub( 1, 4 ),
+        ['truncated body'] = valid:sub( 1, #valid - 1 ),
+        ['truncated varint'] = valid:sub( 1, #valid - 1 ) .. '\128',
+        ['more counters than the length'] = encode( LEN, {}, nil, LEN + 1 ),
+        ['missing counters'] = encode( LEN, { { 2, 3 } }, nil, 2 ),
+        ['zero gap'] = encode( LEN, { { 2, 3 }, { 0, 1 } } ),
+        -- the valid pair is not applied before the invalid pair
+        ['oversized gap'] = encode( LEN, { { 2, 3 }, { LEN, 1 } } ),
+        ['overflowed counter'] = encode( LEN, { { 2, 0x100000000 } } ),
+    }) do
+        local ok, err = arr:merge( enc )
+
+        assert( ok == false and err == 'invalid encoded array',
+                desc .. ' must be rejected' )
+        assert( Array.decode( enc ) == nil, desc .. ' must not be decoded' )
+        equals( arr, exp )
+    end
+
+    -- the length of the other array
+    local ok, err = arr:merge( encode( LEN + 1, { { 2, 3 } } ) )
+    assert( ok == false and err == 'invalid encoded array' )
+    equals( arr, exp )
+end
+
+
+-- encode and merge the stats
+do
+    local src = assert( Stats.new( 1000 ) )
+    local dst = assert( Stats.new( 1000 ) )
+    local enc, ok, err
+
+    src:start()
+    src:incrSuccess()
+    src:recordLoopLag( 1000000 )
+    enc = assert( src:encode() )
+    assert( dst:merge( enc ) == true )
+    assert( dst:merge( enc ) == true )
+    assert( dst:hist( 'loop' ).nreq == 2 )
+    assert( dst:counts() == 2 )
+
+    ok, err = dst:merge( 'TMPA' .. enc:sub( 5 ) )
+    assert( ok == false and err == 'invalid encoded stats' )
+    ok, err = dst:merge( enc:sub( 1, #enc - 1 ) )
+    assert( ok == false and err == 'invalid encoded stats' )
+    -- the layout of the other precision
+    ok, err = dst:merge( assert( Stats.new( 1000, 2 ) ):encode() )
+    assert( ok == false and err == 'layout of encoded stats does not match' )
+    assert( dst:hist( 'loop' ).nreq == 2 )
+end
+
+print( 'ok' )
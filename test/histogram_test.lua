@@ -0,0 +1,126 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  test/histogram_test.lua
+  tempest
+
+  the log-linear histogram must keep every recorded value within the
+  precision of the significant digits, and the percentiles must be the
+  highest value equivalent to the ranked bucket. run with
+  `lua test/histogram_test.lua` after `luarocks make`.
+
+--]]
+
+--- file scope variables
+local Stats = require('tempest.stats')
+local floor = math.floor
+local strformat = string.format
+--- constants
+local MSEC = 60000
+local SIGDIGS = 3
+
+
+--- nsec
+-- converts the msec of the summary into nsec
+-- @param msec
+-- @return nsec
+local function nsec( msec )
+    return floor( msec * 1000000 + 0.5 )
+end
+
+
+--- record
+-- records the values into the loop histogram of a new stats, and returns
+-- its summary
+-- @param values
+-- @param pcts
+-- @return summary
+local function record( values, pcts )
+    local stats = assert( Stats.new( MSEC, SIGDIGS ) )
+    local summary
+
+    stats:start()
+    for _, v in ipairs( values ) do
+        stats:recordLoopLag( v )
+    end
+    summary = stats:hist( 'loop', pcts )
+    stats:dispose()
+
+    return summary
+end
+
+
+-- bucket index and value round trip
+do
+    -- relative width of a bucket is less than 10^-sigdigs
+    local precision = 10 ^ -SIGDIGS
+
+    for _, v in ipairs({
+        1, 2, 999, 1000, 2047, 2048, 2049, 4097, 123456, 1000000, 999999999,
+        MSEC * 1000000 - 1
+    }) do
+        local summary = record({ v })
+        local lo = nsec( summary.min )
+        local hi = nsec( summary.max )
+
+        assert( summary.nreq == 1 )
+        assert( lo <= v and v <= hi, strformat(
+            '%d must be in the equivalent range [%d, %d]', v, lo, hi
+        ) )
+        assert( ( hi - lo + 1 ) / v <= precision, strformat(
+            'range [%d, %d] of %d exceeds the precision', lo, hi, v
+        ) )
+        -- every value below 2^11 has its own bucket with 3 digits
+        if v < 2048 then
+            assert( lo == v and hi == v )
+        end
+    end
+
+    -- the value above the highest is clamped into the highest bucket
+    local summary = record({ MSEC * 1000000 * 10 })
+    assert( summary.nreq == 1 )
+    assert( nsec( summary.max ) >= MSEC * 1000000 )
+    assert( nsec( summary.min ) <= MSEC * 1000000 )
+end
+
+
+-- percentiles
+do
+    local values = {}
+    local summary
+
+    -- 1 usec to 1 msec in 1 usec step
+    for i = 1, 1000 do
+        values[i] = i * 1000
+    end
+    summary = record( values, { 99.99, 50, 99, 90, 99.9 } )
+
+    assert( summary.nreq == 1000 )
+    assert( #summary.percentiles == 5 )
+    for i, exp in ipairs({
+        { 50, 500000 },
+        { 90, 900000 },
+        { 99, 990000 },
+        { 99.9, 999000 },
+        { 99.99, 1000000 },
+    }) do
+        local pct = summary.percentiles[i]
+        local v = nsec( pct.msec )
+
+        -- sorted in ascending order
+        assert( pct.percentile == exp[1] )
+        assert( v >= exp[2] and ( v - exp[2] ) / exp[2] <= 10 ^ -SIGDIGS,
+                strformat( 'p%s must be %d: %d', exp[1], exp[2], v ) )
+    end
+    assert( nsec( summary.min ) == 1000 )
+    assert( nsec( summary.max ) >= 1000000 )
+
+    -- nothing is recorded before the measurement is started
+    local stats = assert( Stats.new( MSEC, SIGDIGS ) )
+    stats:recordLoopLag( 1000 )
+    assert( stats:hist( 'loop' ).nreq == 0 )
+    stats:dispose()
+end
+
+print( 'ok' )
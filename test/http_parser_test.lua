@@ -0,0 +1,170 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  test/http_parser_test.lua
+  tempest
+
+  the framing of the incremental response parser. run with
+  `lua test/http_parser_test.lua` after `luarocks make`.
+
+--]]
+
+--- file scope variables
+local Http = require('tempest.http')
+local strformat = string.format
+
+
+--- parse
+-- feeds the response to a new parser
+-- @param res
+-- @param head
+-- @return parser
+-- @return status
+-- @return err
+local function parse( res, head )
+    local parser = Http.parser()
+
+    parser:reset( head, true )
+    return parser, parser:feed( res )
+end
+
+
+--- malformed
+-- asserts that the response is rejected
+-- @param res
+-- @param desc
+local function malformed( res, desc )
+    local _, status, err = parse( res )
+
+    assert( status == nil and err == 'malformed response', strformat(
+        '%s must be rejected: %s', desc, tostring( status )
+    ) )
+end
+
+
+-- content-length
+do
+    local parser, status = parse( 'HTTP/1.1 200 OK\r\n' ..
+                                  'Content-Length: 5\r\n' ..
+                                  '\r\n' ..
+                                  'hello' )
+
+    assert( status == 200 )
+    assert( parser:bodylen() == 5 )
+    assert( parser:keepalive() == true )
+
+    -- fed in pieces
+    parser = Http.parser()
+    assert( parser:feed( 'HTTP/1.1 200 OK\r\nContent-Le' ) == false )
+    assert( parser:feed( 'ngth: 5\r\n\r\nhel' ) == false )
+    assert( parser:feed( 'lo' ) == 200 )
+
+    -- identical duplicates and trailing whitespace are accepted
+    parser, status = parse( 'HTTP/1.1 200 OK\r\n' ..
+                            'Content-Length: 5 \r\n' ..
+                            'Content-Length: 5\r\n' ..
+                            '\r\n' ..
+                            'hello' )
+    assert( status == 200 )
+    assert( parser:bodylen() == 5 )
+
+    malformed( 'HTTP/1.1 200 OK\r\nContent-Length: 12abc\r\n\r\n',
+               'trailing garbage of content-length' )
+    malformed( 'HTTP/1.1 200 OK\r\nContent-Length: \r\n\r\n',
+               'empty content-length' )
+    malformed( 'HTTP/1.1 200 OK\r\n' ..
+               'Content-Length: 99999999999999999999\r\n\r\n',
+               'overflowed content-length' )
+    malformed( 'HTTP/1.1 200 OK\r\n' ..
+               'Content-Length: 5\r\nContent-Length: 6\r\n\r\nhello',
+               'conflicting content-length' )
+end
+
+
+-- chunked with trailers
+do
+    local parser, status = parse( 'HTTP/1.1 200 OK\r\n' ..
+                                  'Transfer-Encoding: chunked\r\n' ..
+                                  '\r\n' ..
+                                  '5;ext=1\r\nhello\r\n' ..
+                                  'A\r\n0123456789\r\n' ..
+                                  '0\r\n' ..
+                                  'X-Checksum: 1\r\n' ..
+                                  '\r\n' )
+
+    assert( status == 200 )
+    assert( parser:bodylen() == 15 )
+
+    malformed( 'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n' ..
+               '11111111111111111\r\n', 'overflowed chunk-size' )
+    malformed( 'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n' ..
+               '5g\r\n', 'invalid chunk-size' )
+    malformed( 'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n' ..
+               '5\r\nhelloX\r\n', 'chunk without CRLF' )
+end
+
+
+-- 1xx interim responses
+do
+    local parser, status = parse( 'HTTP/1.1 100 Continue\r\n' ..
+                                  '\r\n' ..
+                                  'HTTP/1.1 103 Early Hints\r\n' ..
+                                  'Link: </style.css>\r\n' ..
+                                  '\r\n' ..
+                                  'HTTP/1.1 200 OK\r\n' ..
+                                  'Content-Length: 2\r\n' ..
+                                  '\r\n' ..
+                                  'ok' )
+
+    assert( status == 200 )
+    assert( parser:bodylen() == 2 )
+end
+
+
+-- HEAD and responses without body
+do
+    local parser, status = parse( 'HTTP/1.1 200 OK\r\n' ..
+                                  'Content-Length: 5\r\n' ..
+                                  '\r\n', true )
+
+    assert( status == 200 )
+    assert( parser:bodylen() == 0 )
+
+    parser, status = parse( 'HTTP/1.1 304 Not Modified\r\n' ..
+                            'Content-Length: 5\r\n' ..
+                            '\r\n' )
+    assert( status == 304 )
+    assert( parser:bodylen() == 0 )
+
+    -- the next response is kept in the buffer
+    parser, status = parse( 'HTTP/1.1 204 No Content\r\n' ..
+                            '\r\n' ..
+                            'HTTP/1.1 200 OK\r\n' ..
+                            'Content-Length: 0\r\n' ..
+                            '\r\n' )
+    assert( status == 204 )
+    parser:reset()
+    assert( parser:feed( '' ) == 200 )
+end
+
+
+-- close-delimited body
+do
+    local parser, status = parse( 'HTTP/1.1 200 OK\r\n' ..
+                                  '\r\n' ..
+                                  'until ' )
+
+    assert( status == false )
+    assert( parser:feed( 'close' ) == false )
+    assert( parser:eof() == 200 )
+    assert( parser:bodylen() == 11 )
+    assert( parser:keepalive() == false )
+
+    -- closed before the end of the content-length
+    parser = parse( 'HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhel' )
+    status = parser:eof()
+    assert( status == nil )
+end
+
+print( 'ok' )
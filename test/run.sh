@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+#  Copyright (C) 2018 Masatoshi Fukunaga
+#
+#  test/run.sh
+#  tempest
+#
+#  runs every *_test.lua with lua and every *_test.sh with sh, and exits
+#  with the number of the failed tests. the modules must be installed by
+#  `luarocks make` beforehand. LUA can be set to use other interpreter.
+#
+
+LUA=${LUA:-lua}
+NFAIL=0
+
+cd "$(dirname "$0")" || exit 1
+for t in *_test.lua *_test.sh; do
+    [ -e "$t" ] || continue
+    case "$t" in
+        *.lua) set -- "$LUA" "$t" ;;
+        *) set -- sh "$t" ;;
+    esac
+    if "$@" > /dev/null; then
+        echo "ok   $t"
+    else
+        echo "FAIL $t"
+        NFAIL=$((NFAIL + 1))
+    fi
+done
+
+exit $NFAIL
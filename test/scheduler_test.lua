@@ -0,0 +1,139 @@
+--[[
+
+  Copyright (C) 2018 Masatoshi Fukunaga
+
+  test/scheduler_test.lua
+  tempest
+
+  the scheduler must keep the timetable of the rate even if the generator
+  falls behind it, and the scheduled request must be recorded from the
+  intended start time into the corrected latency and from the actual start
+  time into the uncorrected latency. run with `lua test/scheduler_test.lua`
+  after `luarocks make`.
+
+--]]
+
+--- file scope variables
+local Scheduler = require('tempest.scheduler')
+local Stats = require('tempest.stats')
+local Timer = require('tempest.timer')
+local strformat = string.format
+--- constants
+local NSEC_PER_MSEC = 1000000
+
+
+--- class FakeClock
+-- a clock of the stats that only advances by sleep
+local FakeClock = {}
+
+
+function FakeClock:now()
+    return self.nsec
+end
+
+
+local clock = setmetatable({
+    nsec = 0,
+    nsleep = 0,
+}, {
+    __index = FakeClock
+})
+
+-- act.sleep of the client coroutine
+function sleep( msec )
+    clock.nsleep = clock.nsleep + 1
+    clock.nsec = clock.nsec + msec * NSEC_PER_MSEC
+end
+
+
+-- fixed timetable
+do
+    -- 1000 req/s
+    local sched = Scheduler.new( clock, 1000 )
+
+    clock.nsec = 5 * NSEC_PER_MSEC
+    sched:start()
+    for i = 0, 9 do
+        local intended = sched:next()
+
+        assert( intended == 5 * NSEC_PER_MSEC + i * NSEC_PER_MSEC, strformat(
+            'request %d must be intended at %d: %d', i, i * NSEC_PER_MSEC,
+            intended
+        ) )
+        -- never starts before the intended start time
+        assert( clock.nsec >= intended )
+    end
+    -- the first request starts immediately
+    assert( clock.nsleep == 9 )
+
+    -- the generator stalls for 100 msec. the timetable is kept and the
+    -- missed requests are returned immediately
+    local deadline = clock.nsec + NSEC_PER_MSEC
+    clock.nsec = clock.nsec + 100 * NSEC_PER_MSEC
+    clock.nsleep = 0
+    for i = 0, 99 do
+        assert( sched:next() == deadline + i * NSEC_PER_MSEC )
+    end
+    assert( clock.nsleep == 0 )
+
+    -- the sleep is rounded up to msec
+    sched:rate( 400 )
+    clock.nsleep = 0
+    assert( sched:next() == clock.nsec )
+    local intended = sched:next()
+    assert( clock.nsleep == 1 )
+    assert( clock.nsec - intended == NSEC_PER_MSEC / 2 )
+end
+
+
+-- poisson timetable
+do
+    local sched = Scheduler.new( clock, 1000, true )
+    local n = 10000
+    local first
+
+    math.randomseed( 1 )
+    sched:start()
+    first = sched:next()
+    for _ = 1, n do
+        sched:next()
+    end
+    -- mean inter-arrival time is the interval of the rate
+    local mean = ( sched.deadline - first ) / ( n + 1 )
+    assert( math.abs( mean - NSEC_PER_MSEC ) < NSEC_PER_MSEC * 0.05,
+            strformat( 'mean interval must be about 1 msec: %f', mean ) )
+end
+
+
+-- corrected and uncorrected latency
+do
+    local stats = assert( Stats.new( 1000 ) )
+    local timer = Timer.new( stats )
+    local late = 50 * NSEC_PER_MSEC
+    local data
+
+    stats:start()
+    -- the request starts 50 msec behind the timetable
+    timer:schedule( stats:now() - late )
+    timer:start()
+    timer:measure()
+    timer:stop()
+    -- the unscheduled request is not corrected
+    timer:start()
+    timer:measure()
+    timer:stop()
+
+    data = stats:data()
+    assert( data.latency.nreq == 2 )
+    assert( data.uncorrected.nreq == 1 )
+    assert( data.lag.nreq == 1 )
+    assert( data.latency.max * NSEC_PER_MSEC >= late,
+            'latency must be measured from the intended start time' )
+    assert( data.uncorrected.max * NSEC_PER_MSEC < late,
+            'uncorrected latency must be measured from the actual start' )
+    assert( data.lag.min * NSEC_PER_MSEC >= late * 0.999 )
+    assert( data.latency.min < data.latency.max )
+    stats:dispose()
+end
+
+print( 'ok' )
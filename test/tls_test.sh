@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+#  Copyright (C) 2018 Masatoshi Fukunaga
+#
+#  test/tls_test.sh
+#  tempest
+#
+#  the clients of --tls-resume must resume the TLS session of a local server
+#  that uses a generated self-signed certificate. requires openssl(1) and
+#  `tempest` installed by `luarocks make`. run with `sh test/tls_test.sh`.
+#  TEMPEST and PORT can be set to use other command and port.
+#
+
+TEMPEST=${TEMPEST:-tempest}
+PORT=${PORT:-18443}
+WORKDIR=$(mktemp -d) || exit 1
+SERVER=
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "$1" >&2
+    [ -f "$WORKDIR/out.txt" ] && cat "$WORKDIR/out.txt" >&2
+    exit 1
+}
+
+# self-signed certificate of the address
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj '/CN=127.0.0.1' \
+    -addext 'subjectAltName=IP:127.0.0.1' -keyout "$WORKDIR/key.pem" \
+    -out "$WORKDIR/cert.pem" 2>/dev/null ||
+    fail 'failed to generate a self-signed certificate'
+
+# TLS 1.2 server that issues the session ticket and session ID
+openssl s_server -quiet -www -no_tls1_3 -accept "$PORT" \
+    -cert "$WORKDIR/cert.pem" -key "$WORKDIR/key.pem" >/dev/null 2>&1 &
+SERVER=$!
+sleep 1
+kill -0 "$SERVER" 2>/dev/null || fail "failed to start a TLS server on $PORT"
+
+cat > "$WORKDIR/script.lua" <<'EOF'
+local GET = Http.template( 'GET', '/', { Host = '127.0.0.1' } )
+
+return function( conn )
+    return conn:request( GET ) == 200
+end
+EOF
+
+# every request opens a new connection that must resume the session
+"$TEMPEST" -c 1 -w 1 -d 2s --tls --cacert="$WORKDIR/cert.pem" \
+    --tls-resume --churn=1 --script="$WORKDIR/script.lua" \
+    "127.0.0.1:$PORT" > "$WORKDIR/out.txt" 2>&1 ||
+    fail 'tempest exited with an error'
+
+# total: <full> <resumed> of the handshakes section
+RESUMED=$(awk '/^\[Handshakes\]/ { found = 1 }
+               found && $1 == "total:" { print $3; exit }' "$WORKDIR/out.txt")
+[ -n "$RESUMED" ] || fail 'no handshakes are reported'
+[ "$RESUMED" -gt 0 ] || fail 'no TLS sessions are resumed'
+
+echo "ok: $RESUMED handshakes resumed"